@@ -17,11 +17,13 @@
  */
 
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "mqtt_protocol.h"
 #include "amqtt.h"
@@ -34,6 +36,147 @@
 #define ISSET(_v, _m)	((_v) & (_m))
 #endif
 
+#ifndef timespecclear
+#define timespecclear(_tsp)	((_tsp)->tv_sec = (_tsp)->tv_nsec = 0)
+#define timespecisset(_tsp)	((_tsp)->tv_sec || (_tsp)->tv_nsec)
+#define timespeccmp(_tsp, _usp, _cmp)					\
+	(((_tsp)->tv_sec == (_usp)->tv_sec) ?				\
+	    ((_tsp)->tv_nsec _cmp (_usp)->tv_nsec) :			\
+	    ((_tsp)->tv_sec _cmp (_usp)->tv_sec))
+#define timespecadd(_tsp, _usp, _vsp) do {				\
+	(_vsp)->tv_sec = (_tsp)->tv_sec + (_usp)->tv_sec;		\
+	(_vsp)->tv_nsec = (_tsp)->tv_nsec + (_usp)->tv_nsec;		\
+	if ((_vsp)->tv_nsec >= 1000000000L) {				\
+		(_vsp)->tv_sec++;					\
+		(_vsp)->tv_nsec -= 1000000000L;				\
+	}								\
+} while (0)
+#define timespecsub(_tsp, _usp, _vsp) do {				\
+	(_vsp)->tv_sec = (_tsp)->tv_sec - (_usp)->tv_sec;		\
+	(_vsp)->tv_nsec = (_tsp)->tv_nsec - (_usp)->tv_nsec;		\
+	if ((_vsp)->tv_nsec < 0) {					\
+		(_vsp)->tv_sec--;					\
+		(_vsp)->tv_nsec += 1000000000L;				\
+	}								\
+} while (0)
+#endif
+
+/*
+ * static tracepoints for bpftrace and friends, eg:
+ *	bpftrace -e 'usdt:./libamqtt.so:amqtt:output { @[arg2] = count(); }'
+ */
+#ifdef MQTT_USDT
+#include <sys/sdt.h>
+#define MQTT_TRACE1(_n, _a)		DTRACE_PROBE1(amqtt, _n, _a)
+#define MQTT_TRACE2(_n, _a, _b)		DTRACE_PROBE2(amqtt, _n, _a, _b)
+#define MQTT_TRACE3(_n, _a, _b, _c)	DTRACE_PROBE3(amqtt, _n, _a, _b, _c)
+#define MQTT_TRACE4(_n, _a, _b, _c, _d)	\
+	DTRACE_PROBE4(amqtt, _n, _a, _b, _c, _d)
+#else
+#define MQTT_TRACE1(_n, _a)		do { } while (0)
+#define MQTT_TRACE2(_n, _a, _b)		do { } while (0)
+#define MQTT_TRACE3(_n, _a, _b, _c)	do { } while (0)
+#define MQTT_TRACE4(_n, _a, _b, _c, _d)	do { } while (0)
+#endif
+
+/*
+ * compile time profiles for builds that only need part of the
+ * library, eg, make PROFILE=publish. MQTT_NO_SERVER leaves out the
+ * server role, MQTT_NO_SUBSCRIBE leaves out subscribing, and
+ * MQTT_NO_PUBLISH leaves out sending publishes. the functions that
+ * are left out still exist but fail. a client that can't subscribe
+ * isn't sent publishes, so without the server role the code to
+ * receive them goes too. MQTT_MAX_QOS and MQTT_MAX_TOPIC fix the
+ * highest QOS and the longest topic that are sent or accepted.
+ */
+#ifndef MQTT_MAX_QOS
+#define MQTT_MAX_QOS		2
+#endif
+#if MQTT_MAX_QOS < 0 || MQTT_MAX_QOS > 2
+#error "MQTT_MAX_QOS must be 0, 1, or 2"
+#endif
+
+#ifndef MQTT_MAX_TOPIC
+#define MQTT_MAX_TOPIC		MQTT_MAX_LEN
+#endif
+#if MQTT_MAX_TOPIC < 1 || MQTT_MAX_TOPIC > MQTT_MAX_LEN
+#error "MQTT_MAX_TOPIC must be from 1 to MQTT_MAX_LEN"
+#endif
+
+#if defined(MQTT_NO_SERVER) && defined(MQTT_NO_SUBSCRIBE)
+#define MQTT_NO_PUBLISH_INPUT
+#endif
+
+#if defined(MQTT_NO_PUBLISH) || defined(MQTT_NO_PUBLISH_INPUT)
+#define MQTT_NO_BRIDGE
+#endif
+
+/*
+ * a group tracks a set of (un)subscribe requests that were sent as
+ * one or more multi-topic packets, so the per-topic return codes can
+ * be handed back to each request once all the acks have arrived.
+ */
+struct mqtt_subreq {
+	void		*sr_cookie;
+	unsigned int	 sr_off;
+	unsigned int	 sr_n;
+};
+
+struct mqtt_subgrp {
+	int		 sg_type;
+	unsigned int	 sg_npkts;	/* packets waiting for an ack */
+					/* plus one while they go out */
+	uint8_t		*sg_rcodes;
+	unsigned int	 sg_nreqs;
+	struct mqtt_subreq
+			 sg_reqs[];
+};
+
+struct mqtt_msg {
+	unsigned int	 msg_refs;
+	enum mqtt_qos	 msg_qos;
+	unsigned int	 msg_pid;
+	size_t		 msg_topic_len;
+	size_t		 msg_payload_len;
+	char		*msg_payload;
+	char		 msg_topic[];
+};
+
+/*
+ * the app only gives us one timer, so everything that needs one
+ * keeps a deadline here and the timer is armed for the earliest.
+ */
+enum mqtt_tmo {
+	MQTT_TMO_KEEPALIVE,
+	MQTT_TMO_PACE,
+	MQTT_TMO_LIVENESS,
+
+	MQTT_TMO_COUNT
+};
+
+struct mqtt_bridge {
+	struct mqtt_conn
+			*br_to;
+	const char	*br_strip;
+	size_t		 br_strip_len;
+	const char	*br_prefix;
+	size_t		 br_prefix_len;
+	unsigned int	 br_flags;
+	uint64_t	 br_shed;
+};
+
+/*
+ * token bucket. tokens are kept in units per second * nsec so
+ * refilling them is a multiply and never loses a fraction.
+ */
+struct mqtt_bucket {
+	uint64_t	 b_rate;	/* units per second */
+	int64_t		 b_tokens;
+	int64_t		 b_burst;
+};
+
+#define MQTT_NSEC		1000000000LL
+
 struct mqtt_message {
 	uint8_t		*mm_buf;
 	size_t		 mm_len;
@@ -41,6 +184,19 @@ struct mqtt_message {
 	void		*mm_cookie;
 	int		 mm_type;
 	int		 mm_id;
+	enum mqtt_prio	 mm_prio;
+
+	struct mqtt_subgrp
+			*mm_grp;
+	unsigned int	 mm_grp_off;
+	unsigned int	 mm_grp_n;
+
+	struct timespec	 mm_enqueued;	/* only set for mc_lathist */
+
+	/* payload that follows mm_buf straight out of a file */
+	int		 mm_fd;
+	off_t		 mm_fdoff;
+	size_t		 mm_fdlen;
 
 	TAILQ_ENTRY(mqtt_message)
 			 mm_entry;
@@ -48,14 +204,24 @@ struct mqtt_message {
 
 TAILQ_HEAD(mqtt_messages, mqtt_message);
 
+struct mqtt_codec_ent {
+	char		*mce_prefix;
+	size_t		 mce_prefix_len;
+	const struct mqtt_codec
+			*mce_codec;
+	void		*mce_ctx;
+};
+
 enum mqtt_state {
 	MQTT_S_IDLE,
 	MQTT_S_REMLEN,
 
 	MQTT_S_MEMCPY,
+	MQTT_S_SKIP,
 
 	MQTT_S_TOPIC_LEN_HI,
 	MQTT_S_TOPIC_LEN_LO,
+	MQTT_S_TOPIC,
 	MQTT_S_PID_HI,
 	MQTT_S_PID_LO,
 	MQTT_S_PAYLOAD,
@@ -63,6 +229,7 @@ enum mqtt_state {
 
 	MQTT_S_DONE,
 
+	MQTT_S_GONE,
 	MQTT_S_DEAD,
 };
 
@@ -73,14 +240,30 @@ struct mqtt_conn {
 	const char	*mc_errstr;
 
 	uint16_t	 mc_id;
+	unsigned int	 mc_server;
+	unsigned int	 mc_connected;
 
 	/* output state */
 	struct mqtt_messages
-			 mc_messages;
+			 mc_messages[MQTT_NPRIO];
+	struct mqtt_message
+			*mc_output;	/* partially written */
+	enum mqtt_prio	 mc_pubprio;
+	size_t		 mc_queued;	/* bytes waiting to be written */
+	unsigned int	 mc_blocked;
 	struct mqtt_messages
 			 mc_pending;
 	struct timespec	 mc_keepalive;
 	unsigned int	 mc_pinging;
+	enum mqtt_dead_reason
+			 mc_dead_reason;
+
+	/* fast liveness, see mqtt_set_liveness */
+	struct timespec	 mc_live_idle;
+	struct timespec	 mc_live_wait;
+	struct timespec	 mc_live_heard;	/* last input */
+	struct timespec	 mc_live_probe;	/* when the PINGREQ went */
+	unsigned int	 mc_live_probing;
 
 	/* input parser state */
 	enum mqtt_state	 mc_state;
@@ -89,6 +272,7 @@ struct mqtt_conn {
 	uint8_t		 mc_flags;
 
 	unsigned int	 mc_remlen;
+	unsigned int	 mc_pktlen;	/* mc_remlen before it's consumed */
 	unsigned int	 mc_shift;
 
 	uint8_t		*mc_mem;
@@ -98,18 +282,84 @@ struct mqtt_conn {
 	uint8_t		*mc_topic;
 	unsigned int	 mc_topic_len;
 	int		 mc_pid;
+
+	/* topics are read here first if the app filters them */
+	char		*mc_topicbuf;
+	size_t		 mc_topicbuf_len;
+	unsigned int	 mc_skip;
+
+	/* payload codecs by topic prefix */
+	struct mqtt_codec_ent
+			*mc_codecs;
+	size_t		 mc_ncodecs;
+
+	struct mqtt_lvc	*mc_lvc;
+
+	/* subscribes coalesced while in mqtt_input */
+	unsigned int	 mc_inputting;
+	struct mqtt_topic
+			*mc_subq;
+	void		**mc_subq_cookies;
+	size_t		 mc_nsubq;
+	size_t		 mc_subq_cap;
+
+	/* publishes waiting for mqtt_on_message_batch */
+	struct mqtt_batch_msg
+			*mc_batch;
+	size_t		 mc_nbatch;
+	size_t		 mc_batch_max;
+
+	/* the message being read for mqtt_on_msg */
+	struct mqtt_msg	*mc_msg;
+
+	struct mqtt_lathist
+			*mc_lathist;
+	struct mqtt_dispatch
+			*mc_dispatch;
+
+	/* publishes forwarded to another connection */
+	struct mqtt_bridge
+			*mc_bridge;
+	struct mqtt_conn
+			*mc_bridged;	/* the connection forwarding to us */
+	uint8_t		*mc_fwd;	/* the packet being forwarded */
+
+	/* memory held by the connection, and the budget it comes from */
+	struct mqtt_budget
+			*mc_budget;
+	size_t		 mc_memused;
+	size_t		 mc_incharge;	/* the packet being read */
+
+	struct timespec	 mc_deadlines[MQTT_TMO_COUNT];
+	struct timespec	 mc_armed;
+
+	unsigned int	 mc_pacing;
+	struct mqtt_bucket
+			 mc_pace_msgs;
+	struct mqtt_bucket
+			 mc_pace_bytes;
+	struct timespec	 mc_pace_last;
 };
 
 #define MQTT_KEEPALIVES(_mc)	((_mc)->mc_keepalive.tv_sec > 0)
+#define MQTT_LIVENESS(_mc)	timespecisset(&(_mc)->mc_live_idle)
+#ifdef MQTT_NO_SERVER
+#define MQTT_SERVER(_mc)	0
+#else
+#define MQTT_SERVER(_mc)	((_mc)->mc_server)
+#endif
 
+/*
+ * this only touches the bytes the header needs, so buf can be a packet
+ * sized with mqtt_packet_len rather than a whole struct mqtt_header.
+ */
 static size_t
 mqtt_header_set(void *buf, uint8_t type, uint8_t flags, size_t len)
 {
-	struct mqtt_header *hdr = buf;
-	uint8_t *p = hdr->remlen;
-	size_t rv = sizeof(hdr->p);
+	uint8_t *p = buf;
+	size_t rv = 0;
 
-	hdr->p = (type << 4) | flags;
+	p[rv++] = (type << 4) | flags;
 
 	do {
 		uint8_t byte = len & 0x7f;
@@ -117,14 +367,13 @@ mqtt_header_set(void *buf, uint8_t type, uint8_t flags, size_t len)
 		if (len)
 			byte |= 0x80;
 
-		*p++ = byte;
-		rv++;
+		p[rv++] = byte;
 	} while (len);
 
 	return (rv);
 }
 
-static uint16_t
+static inline uint16_t
 mqtt_u16_rd(const void *buf)
 {
 	const struct mqtt_u16 *mu16 = buf;
@@ -155,6 +404,33 @@ mqtt_lenstr(void *buf, uint16_t len, const void *str)
 	return (blen + len);
 }
 
+#ifndef MQTT_NO_SERVER
+static int
+mqtt_lenstr_rd(const uint8_t **bufp, size_t *lenp,
+    const char **strp, size_t *slenp)
+{
+	const uint8_t *buf = *bufp;
+	size_t len = *lenp;
+	size_t slen;
+
+	if (len < sizeof(struct mqtt_u16))
+		return (-1);
+	slen = mqtt_u16_rd(buf);
+	buf += sizeof(struct mqtt_u16);
+	len -= sizeof(struct mqtt_u16);
+
+	if (len < slen)
+		return (-1);
+
+	*strp = (const char *)buf;
+	*slenp = slen;
+	*bufp = buf + slen;
+	*lenp = len - slen;
+
+	return (0);
+}
+#endif /* MQTT_NO_SERVER */
+
 void *
 mqtt_cookie(struct mqtt_conn *mc)
 {
@@ -167,57 +443,403 @@ mqtt_errstr(struct mqtt_conn *mc)
 	return (mc->mc_errstr);
 }
 
-struct mqtt_conn *
-mqtt_conn_create(const struct mqtt_settings *ms, void *cookie)
+enum mqtt_dead_reason
+mqtt_dead_reason(struct mqtt_conn *mc)
+{
+	return (mc->mc_dead_reason);
+}
+
+static void
+mqtt_die(struct mqtt_conn *mc, enum mqtt_dead_reason reason,
+    const char *errstr)
+{
+	mc->mc_dead_reason = reason;
+	mc->mc_errstr = errstr;
+	mc->mc_state = MQTT_S_DEAD;
+	(*mc->mc_settings->mqtt_dead)(mc);
+}
+
+static struct mqtt_conn *
+mqtt_conn_alloc(const struct mqtt_settings *ms, void *cookie,
+    unsigned int server)
 {
 	struct mqtt_conn *mc;
+	int i;
 
 	mc = malloc(sizeof(*mc));
 	if (mc == NULL)
 		return (NULL);
 
 	mc->mc_id = arc4random(); /* random starting point */
+	mc->mc_server = server;
+	mc->mc_connected = 0;
 
 	mc->mc_cookie = cookie;
 	mc->mc_settings = ms;
-	TAILQ_INIT(&mc->mc_messages);
+	mc->mc_errstr = NULL;
+	for (i = 0; i < MQTT_NPRIO; i++)
+		TAILQ_INIT(&mc->mc_messages[i]);
+	mc->mc_output = NULL;
+	mc->mc_pubprio = MQTT_PRIO_BULK;
+	mc->mc_queued = 0;
+	mc->mc_blocked = 0;
 	TAILQ_INIT(&mc->mc_pending);
 	mc->mc_keepalive.tv_sec = 0;
 	mc->mc_keepalive.tv_nsec = 0;
 	mc->mc_pinging = 0;
+	mc->mc_dead_reason = MQTT_DEAD_NONE;
+	timespecclear(&mc->mc_live_idle);
+	timespecclear(&mc->mc_live_wait);
+	mc->mc_live_probing = 0;
 
 	mc->mc_state = MQTT_S_IDLE;
 
+	mc->mc_codecs = NULL;
+	mc->mc_ncodecs = 0;
+
+	mc->mc_lvc = NULL;
+
+	mc->mc_inputting = 0;
+	mc->mc_subq = NULL;
+	mc->mc_subq_cookies = NULL;
+	mc->mc_nsubq = 0;
+	mc->mc_subq_cap = 0;
+
+	mc->mc_msg = NULL;
+	mc->mc_topicbuf = NULL;
+	mc->mc_topicbuf_len = 0;
+	mc->mc_lathist = NULL;
+	mc->mc_dispatch = NULL;
+	mc->mc_bridge = NULL;
+	mc->mc_bridged = NULL;
+	mc->mc_fwd = NULL;
+	mc->mc_budget = NULL;
+	mc->mc_memused = sizeof(*mc);
+	mc->mc_incharge = 0;
+
+	for (i = 0; i < MQTT_TMO_COUNT; i++)
+		timespecclear(&mc->mc_deadlines[i]);
+	timespecclear(&mc->mc_armed);
+	mc->mc_pacing = 0;
+
+	mc->mc_batch = NULL;
+	mc->mc_nbatch = 0;
+	mc->mc_batch_max = 0;
+	if (ms->mqtt_on_message_batch != NULL && ms->mqtt_on_msg == NULL) {
+		mc->mc_batch_max = ms->mqtt_message_batch_max;
+		if (mc->mc_batch_max == 0)
+			mc->mc_batch_max = MQTT_BATCH_DEFAULT;
+
+		mc->mc_batch = calloc(mc->mc_batch_max,
+		    sizeof(*mc->mc_batch));
+		if (mc->mc_batch == NULL) {
+			free(mc);
+			return (NULL);
+		}
+		mc->mc_memused += mc->mc_batch_max * sizeof(*mc->mc_batch);
+	}
+
 	return (mc);
 }
 
+struct mqtt_conn *
+mqtt_conn_create(const struct mqtt_settings *ms, void *cookie)
+{
+	return (mqtt_conn_alloc(ms, cookie, 0));
+}
+
+struct mqtt_conn *
+mqtt_conn_create_server(const struct mqtt_settings *ms, void *cookie)
+{
+#ifdef MQTT_NO_SERVER
+	return (NULL);
+#else
+	return (mqtt_conn_alloc(ms, cookie, 1));
+#endif
+}
+
+/*
+ * account memory held by the connection. only work that can be
+ * dropped is allowed to fail, everything else is charged even if it
+ * takes the budget over.
+ */
+static int
+mqtt_charge(struct mqtt_conn *mc, size_t len, int force)
+{
+	struct mqtt_budget *mb = mc->mc_budget;
+
+	if (mb != NULL) {
+		if (force)
+			mqtt_budget_add(mb, len);
+		else if (mqtt_budget_charge(mb, len) == -1)
+			return (-1);
+	}
+
+	mc->mc_memused += len;
+	return (0);
+}
+
+static void
+mqtt_rele(struct mqtt_conn *mc, size_t len)
+{
+	if (mc->mc_budget != NULL)
+		mqtt_budget_rele(mc->mc_budget, len);
+
+	mc->mc_memused -= len;
+}
+
+/* what the connection currently holds is moved to the new budget */
+void
+mqtt_set_budget(struct mqtt_conn *mc, struct mqtt_budget *mb)
+{
+	if (mc->mc_budget != NULL)
+		mqtt_budget_rele(mc->mc_budget, mc->mc_memused);
+	if (mb != NULL)
+		mqtt_budget_add(mb, mc->mc_memused);
+
+	mc->mc_budget = mb;
+}
+
+size_t
+mqtt_memused(struct mqtt_conn *mc)
+{
+	return (mc->mc_memused);
+}
+
+static void
+mqtt_subgrp_rele(struct mqtt_subgrp *sg)
+{
+	if (--sg->sg_npkts == 0)
+		free(sg);
+}
+
+static void
+mqtt_subq_free(struct mqtt_conn *mc)
+{
+	size_t i;
+
+	for (i = 0; i < mc->mc_nsubq; i++)
+		free((char *)mc->mc_subq[i].filter);
+	mc->mc_nsubq = 0;
+}
+
+static void
+mqtt_message_free(struct mqtt_conn *mc, struct mqtt_message *mm)
+{
+	if (mm->mm_grp != NULL)
+		mqtt_subgrp_rele(mm->mm_grp);
+	if (mm->mm_buf != NULL) {
+		mqtt_rele(mc, mm->mm_len);
+		free(mm->mm_buf);
+	}
+	mqtt_rele(mc, sizeof(*mm));
+	if (mm->mm_fd != -1)
+		close(mm->mm_fd);
+	free(mm);
+}
+
+static void
+mqtt_messages_free(struct mqtt_conn *mc, struct mqtt_messages *mms)
+{
+	struct mqtt_message *mm;
+
+	while ((mm = TAILQ_FIRST(mms)) != NULL) {
+		TAILQ_REMOVE(mms, mm, mm_entry);
+		mqtt_message_free(mc, mm);
+	}
+}
+
+static void
+mqtt_bridge_free(struct mqtt_conn *mc)
+{
+	struct mqtt_bridge *br = mc->mc_bridge;
+
+	if (br == NULL)
+		return;
+
+	br->br_to->mc_bridged = NULL;
+	mc->mc_bridge = NULL;
+	free(br);
+}
+
 void
 mqtt_conn_destroy(struct mqtt_conn *mc)
 {
+	size_t i;
+
+	for (i = 0; i < mc->mc_ncodecs; i++)
+		free(mc->mc_codecs[i].mce_prefix);
+	free(mc->mc_codecs);
+
+	mqtt_subq_free(mc);
+	free(mc->mc_subq);
+	free(mc->mc_subq_cookies);
+
+	for (i = 0; i < mc->mc_nbatch; i++) {
+		free(mc->mc_batch[i].topic);
+		free(mc->mc_batch[i].payload);
+	}
+	free(mc->mc_batch);
+
+	for (i = 0; i < MQTT_NPRIO; i++)
+		mqtt_messages_free(mc, &mc->mc_messages[i]);
+	mqtt_messages_free(mc, &mc->mc_pending);
+
+	mqtt_bridge_free(mc);
+	if (mc->mc_bridged != NULL)
+		mqtt_bridge_free(mc->mc_bridged);
+
+	if (mc->mc_fwd != NULL) {
+		/* mc_mem points into the packet being forwarded */
+		free(mc->mc_fwd);
+	} else if (mc->mc_msg != NULL) {
+		/* mc_mem points into the message */
+		mqtt_msg_unref(mc->mc_msg);
+	} else if (mc->mc_state == MQTT_S_MEMCPY &&
+	    mc->mc_nstate != MQTT_S_TOPIC) {
+		free(mc->mc_mem);
+		if (mc->mc_nstate == MQTT_S_PUB_DONE)
+			free(mc->mc_topic);
+	} else if (mc->mc_state == MQTT_S_PID_HI ||
+	    mc->mc_state == MQTT_S_PID_LO) {
+		/* mc_mem is the topic until the pid has been read */
+		free(mc->mc_mem);
+	}
+	free(mc->mc_topicbuf);
+
+	if (mc->mc_budget != NULL)
+		mqtt_budget_rele(mc->mc_budget, mc->mc_memused);
 	free(mc);
 }
 
-static int
-mqtt_enqueue(struct mqtt_conn *mc, void *cookie, int type, int id,
-    void *msg, size_t len)
+/*
+ * off is where the packet starts in msg, which is only non-zero for
+ * packets where the header was written after the body.
+ */
+static void	mqtt_subq_flush(struct mqtt_conn *);
+static void	mqtt_timer_set(struct mqtt_conn *, enum mqtt_tmo,
+		    const struct timespec *);
+
+static struct mqtt_message *
+mqtt_message_alloc(struct mqtt_conn *mc, void *cookie, int type, int id,
+    void *msg, size_t off, size_t len, int fd, off_t fdoff, size_t fdlen)
 {
 	struct mqtt_message *mm;
 
+	/* publishes are the only output that can be dropped */
+	if (mqtt_charge(mc, sizeof(*mm) + len,
+	    type != MQTT_T_PUBLISH) == -1) {
+		MQTT_TRACE3(shed, mc, type, len);
+		return (NULL);
+	}
+
 	mm = malloc(sizeof(*mm));
-	if (mm == NULL)
-		return (-1);
+	if (mm == NULL) {
+		mqtt_rele(mc, sizeof(*mm) + len);
+		return (NULL);
+	}
 
 	mm->mm_buf = msg;
 	mm->mm_len = len;
-	mm->mm_off = 0;
+	mm->mm_off = off;
 	mm->mm_cookie = cookie;
 	mm->mm_type = type;
 	mm->mm_id = id;
+	mm->mm_fd = fd;
+	mm->mm_fdoff = fdoff;
+	mm->mm_fdlen = fdlen;
+	mm->mm_grp = NULL;
+
+	/* everything except publishes is needed to keep the session up */
+	mm->mm_prio = (type == MQTT_T_PUBLISH) ?
+	    mc->mc_pubprio : MQTT_PRIO_CONTROL;
 
-	TAILQ_INSERT_TAIL(&mc->mc_messages, mm, mm_entry);
+	return (mm);
+}
+
+static void
+mqtt_message_push(struct mqtt_conn *mc, struct mqtt_message *mm)
+{
+	size_t len = (mm->mm_len - mm->mm_off) + mm->mm_fdlen;
+
+	if (mc->mc_lathist != NULL)
+		clock_gettime(CLOCK_MONOTONIC, &mm->mm_enqueued);
+
+	TAILQ_INSERT_TAIL(&mc->mc_messages[mm->mm_prio], mm, mm_entry);
+	mc->mc_queued += len;
+	MQTT_TRACE4(enqueue, mc, mm->mm_type, len, mc->mc_queued);
+
+	/* the peer has to be heard from while there's output for it */
+	if (MQTT_LIVENESS(mc) &&
+	    !timespecisset(&mc->mc_deadlines[MQTT_TMO_LIVENESS]))
+		mqtt_timer_set(mc, MQTT_TMO_LIVENESS, &mc->mc_live_idle);
 
 	/* push hard */
 	mqtt_output(mc);
+}
+
+static struct mqtt_message *
+mqtt_enqueue_fd(struct mqtt_conn *mc, void *cookie, int type, int id,
+    void *msg, size_t off, size_t len, int fd, off_t fdoff, size_t fdlen)
+{
+	struct mqtt_message *mm;
+
+	/* keep coalesced subscribes in order with everything else */
+	if (mc->mc_nsubq > 0)
+		mqtt_subq_flush(mc);
+
+	mm = mqtt_message_alloc(mc, cookie, type, id,
+	    msg, off, len, fd, fdoff, fdlen);
+	if (mm == NULL)
+		return (NULL);
+
+	mqtt_message_push(mc, mm);
+
+	return (mm);
+}
+
+/*
+ * the dispatcher isn't owned by the connection, so several
+ * connections serviced by one io thread can share it.
+ */
+void
+mqtt_set_dispatch(struct mqtt_conn *mc, struct mqtt_dispatch *md)
+{
+	mc->mc_dispatch = md;
+}
+
+void
+mqtt_set_lathist(struct mqtt_conn *mc, struct mqtt_lathist *lh)
+{
+	mc->mc_lathist = lh;
+}
+
+static void
+mqtt_lathist_add(struct mqtt_conn *mc, const struct mqtt_message *mm)
+{
+	struct timespec now;
+	uint64_t nsec;
+	unsigned int b = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nsec = (uint64_t)(now.tv_sec - mm->mm_enqueued.tv_sec) * 1000000000 +
+	    (now.tv_nsec - mm->mm_enqueued.tv_nsec);
+
+	/* bucket n counts latencies from 2^n to 2^(n+1) - 1 nsec */
+	while ((nsec >>= 1) != 0 && b < MQTT_LATHIST_BUCKETS - 1)
+		b++;
+
+	mc->mc_lathist->lh_buckets[b]++;
+	MQTT_TRACE3(flushed, mc, mm->mm_type, b);
+}
+
+static int
+mqtt_enqueue(struct mqtt_conn *mc, void *cookie, int type, int id,
+    void *msg, size_t len)
+{
+	if (mqtt_enqueue_fd(mc, cookie, type, id,
+	    msg, 0, len, -1, 0, 0) == NULL)
+		return (-1);
 
 	return (0);
 }
@@ -235,15 +857,20 @@ mqtt_id_isset(struct mqtt_messages *mms, int id)
 	return (0);
 }
 
-static int
+static inline int
 mqtt_id(struct mqtt_conn *mc)
 {
 	int id;
+	int i;
 
 	for (;;) {
 		id = mc->mc_id++;
 
-		if (mqtt_id_isset(&mc->mc_messages, id))
+		for (i = 0; i < MQTT_NPRIO; i++) {
+			if (mqtt_id_isset(&mc->mc_messages[i], id))
+				break;
+		}
+		if (i < MQTT_NPRIO)
 			continue;
 		if (mqtt_id_isset(&mc->mc_pending, id))
 			continue;
@@ -254,475 +881,2873 @@ mqtt_id(struct mqtt_conn *mc)
 	return (id);
 }
 
-static enum mqtt_state
-mqtt_memcpy(struct mqtt_conn *mc, size_t len, enum mqtt_state nstate)
+/*
+ * publishes are refused once the amount of queued output reaches the
+ * high watermark, until it drains below the low watermark again.
+ */
+static inline int
+mqtt_wouldblock(struct mqtt_conn *mc)
 {
-	mc->mc_mem = malloc(len);
-	if (mc->mc_mem == NULL)
-		return (MQTT_S_DEAD);
+	size_t hiwat = mc->mc_settings->mqtt_output_hiwat;
 
-	mc->mc_len = len;
-	mc->mc_off = 0;
-	mc->mc_nstate = nstate;
+	if (hiwat == 0 || mc->mc_queued < hiwat)
+		return (0);
 
-	return (MQTT_S_MEMCPY);
+	mc->mc_blocked = 1;
+	return (1);
 }
 
-static enum mqtt_state
-mqtt_strcpy(struct mqtt_conn *mc, size_t len, enum mqtt_state nstate)
+int
+mqtt_set_bridge(struct mqtt_conn *mc, struct mqtt_conn *to,
+    const char *strip, size_t strip_len,
+    const char *prefix, size_t prefix_len, unsigned int flags)
 {
-	mc->mc_mem = malloc(len + 1);
-	if (mc->mc_mem == NULL)
-		return (MQTT_S_DEAD);
+#ifdef MQTT_NO_BRIDGE
+	return (-1);
+#else
+	struct mqtt_bridge *br;
+	char *p;
+
+	if (to == NULL) {
+		mqtt_bridge_free(mc);
+		return (0);
+	}
 
-	mc->mc_mem[len] = '\0';
-	mc->mc_len = len;
-	mc->mc_off = 0;
-	mc->mc_nstate = nstate;
+	if (to == mc || (to->mc_bridged != NULL && to->mc_bridged != mc))
+		return (-1);
+	if (strip_len > MQTT_MAX_TOPIC || prefix_len > MQTT_MAX_TOPIC)
+		return (-1);
+	if (flags & ~MQTT_BRIDGE_NORETAIN)
+		return (-1);
 
-	return (MQTT_S_MEMCPY);
+	br = malloc(sizeof(*br) + strip_len + prefix_len);
+	if (br == NULL)
+		return (-1);
+
+	p = (char *)(br + 1);
+	if (strip_len > 0)
+		memcpy(p, strip, strip_len);
+	br->br_strip = p;
+	br->br_strip_len = strip_len;
+	p += strip_len;
+	if (prefix_len > 0)
+		memcpy(p, prefix, prefix_len);
+	br->br_prefix = p;
+	br->br_prefix_len = prefix_len;
+	br->br_flags = flags;
+	br->br_shed = 0;
+
+	if (mc->mc_bridge != NULL) {
+		br->br_shed = mc->mc_bridge->br_shed;
+		mqtt_bridge_free(mc);
+	}
+
+	br->br_to = to;
+	to->mc_bridged = mc;
+	mc->mc_bridge = br;
+
+	return (0);
+#endif
 }
 
-static enum mqtt_state
-mqtt_parse(struct mqtt_conn *mc, uint8_t ch)
+int
+mqtt_bridge_blocked(struct mqtt_conn *mc)
 {
-	enum mqtt_state state = mc->mc_state;
-	uint8_t type, flags;
+	struct mqtt_bridge *br = mc->mc_bridge;
 
-	switch (state) {
-	case MQTT_S_IDLE:
-		type = (ch >> 4) & 0xf;
-		flags = (ch >> 0) & 0xf;
+	if (br == NULL)
+		return (0);
 
-		switch (type) {
-		case MQTT_T_CONNECT:
-			return (MQTT_S_DEAD);
-		case MQTT_T_CONNACK:
-			if (flags != 0)
-				return (MQTT_S_DEAD);
-			/* check if this is first? */
-			break;
+	return (br->br_to->mc_blocked || mqtt_wouldblock(br->br_to));
+}
 
-		case MQTT_T_PUBLISH:
-			break;
+uint64_t
+mqtt_bridge_shed(struct mqtt_conn *mc)
+{
+	struct mqtt_bridge *br = mc->mc_bridge;
 
-		case MQTT_T_PUBACK:
-			return (MQTT_S_DEAD);
-		case MQTT_T_PUBREC:
-			return (MQTT_S_DEAD);
-		case MQTT_T_PUBREL:
-			return (MQTT_S_DEAD);
-		case MQTT_T_PUBCOMP:
-			return (MQTT_S_DEAD);
+	return (br == NULL ? 0 : br->br_shed);
+}
 
-		case MQTT_T_SUBSCRIBE:
-			return (MQTT_S_DEAD);
-		case MQTT_T_SUBACK:
-			break;
+/*
+ * publishes made after this go into the given class. the output queue
+ * is drained in class order, control packets first, but a packet that
+ * has been partially written is always finished first.
+ */
+int
+mqtt_set_publish_prio(struct mqtt_conn *mc, enum mqtt_prio prio)
+{
+	switch (prio) {
+	case MQTT_PRIO_CONTROL:
+	case MQTT_PRIO_LATENCY:
+	case MQTT_PRIO_BULK:
+		break;
+	default:
+		return (-1);
+	}
 
-		case MQTT_T_UNSUBSCRIBE:
-			return (MQTT_S_DEAD);
-		case MQTT_T_UNSUBACK:
-			break;
+	mc->mc_pubprio = prio;
 
-		case MQTT_T_PINGREQ:
-			return (MQTT_S_DEAD);
-		case MQTT_T_PINGRESP:
-			if (flags != 0)
-				return (MQTT_S_DEAD);
-			break;
+	return (0);
+}
 
-		case MQTT_T_DISCONNECT:
-			return (MQTT_S_DEAD);
+/*
+ * keep the last value received on every topic in lvc. a cache may be
+ * shared by several connections as long as they're used from the
+ * same thread.
+ */
+void
+mqtt_set_lvc(struct mqtt_conn *mc, struct mqtt_lvc *lvc)
+{
+	mc->mc_lvc = lvc;
+}
 
-		default:
-			return (MQTT_S_DEAD);
-		}
+/*
+ * payloads published to or received on topics starting with prefix
+ * are run through the codec. the ctx is kept for the life of the
+ * connection and passed to every codec call, so codecs can keep
+ * their state and dictionaries there instead of allocating per
+ * message. setting a NULL codec removes the prefix.
+ */
+int
+mqtt_codec_set(struct mqtt_conn *mc, const char *prefix, size_t prefix_len,
+    const struct mqtt_codec *mcd, void *ctx)
+{
+	struct mqtt_codec_ent *mce;
+	size_t i;
 
-		mc->mc_type = type;
-		mc->mc_flags = flags;
-		mc->mc_remlen = 0;
-		mc->mc_shift = 0;
+	for (i = 0; i < mc->mc_ncodecs; i++) {
+		mce = &mc->mc_codecs[i];
+		if (mce->mce_prefix_len == prefix_len &&
+		    memcmp(mce->mce_prefix, prefix, prefix_len) == 0)
+			break;
+	}
 
-		return (MQTT_S_REMLEN);
+	if (mcd == NULL) {
+		if (i == mc->mc_ncodecs)
+			return (-1);
 
-	case MQTT_S_REMLEN:
-		mc->mc_remlen |= (unsigned int)(ch & 0x7f) << mc->mc_shift;
+		free(mce->mce_prefix);
+		mc->mc_codecs[i] = mc->mc_codecs[--mc->mc_ncodecs];
+		return (0);
+	}
 
-		if (ch & 0x80) {
-			mc->mc_shift += 7;
-			if (mc->mc_shift > 28)
-				return (MQTT_S_DEAD);
-			return (state);
-		}
+	if (i == mc->mc_ncodecs) {
+		mce = reallocarray(mc->mc_codecs, mc->mc_ncodecs + 1,
+		    sizeof(*mce));
+		if (mce == NULL)
+			return (-1);
+		mc->mc_codecs = mce;
 
-		switch (mc->mc_type) {
-		case MQTT_T_PUBLISH:
-			if (mc->mc_remlen < sizeof(struct mqtt_u16))
-				return (MQTT_S_DEAD);
-			mc->mc_remlen -= sizeof(struct mqtt_u16);
+		mce = &mc->mc_codecs[i];
+		mce->mce_prefix = malloc(prefix_len + 1);
+		if (mce->mce_prefix == NULL)
+			return (-1);
+		memcpy(mce->mce_prefix, prefix, prefix_len);
+		mce->mce_prefix[prefix_len] = '\0';
+		mce->mce_prefix_len = prefix_len;
 
-			return (MQTT_S_TOPIC_LEN_HI);
+		mc->mc_ncodecs++;
+	}
 
-		case MQTT_T_PINGRESP:
-			if (mc->mc_remlen != 0)
-				return (MQTT_S_DEAD);
+	mce->mce_codec = mcd;
+	mce->mce_ctx = ctx;
 
-			mc->mc_pinging = 0;
-			return (MQTT_S_IDLE);
-		default:
-			break;
-		}
+	return (0);
+}
 
-		return (mqtt_memcpy(mc, mc->mc_remlen, MQTT_S_DONE));
+#if !defined(MQTT_NO_PUBLISH) || !defined(MQTT_NO_PUBLISH_INPUT)
+static const struct mqtt_codec_ent *
+mqtt_codec_lookup(struct mqtt_conn *mc, const void *topic, size_t topic_len)
+{
+	const struct mqtt_codec_ent *mce, *best = NULL;
+	size_t i;
 
-	case MQTT_S_MEMCPY:
-		/* this should be handled in mqtt_input() */
-		abort();
+	for (i = 0; i < mc->mc_ncodecs; i++) {
+		mce = &mc->mc_codecs[i];
+		if (mce->mce_prefix_len > topic_len)
+			continue;
+		if (best != NULL && best->mce_prefix_len >= mce->mce_prefix_len)
+			continue;
+		if (memcmp(mce->mce_prefix, topic, mce->mce_prefix_len) != 0)
+			continue;
 
-	case MQTT_S_TOPIC_LEN_HI:
-		mc->mc_topic_len = (unsigned int)ch << 8;
-		return (MQTT_S_TOPIC_LEN_LO);
-	case MQTT_S_TOPIC_LEN_LO:
-		mc->mc_topic_len |= ch;
+		best = mce;
+	}
 
-		if (ISSET(mc->mc_flags, 0x3 << 1)) {
-			if (mc->mc_remlen < sizeof(struct mqtt_u16))
-				return (MQTT_S_DEAD);
-			mc->mc_remlen -= sizeof(struct mqtt_u16);
+	return (best);
+}
+#endif
 
-			state = MQTT_S_PID_HI;
-		} else {
-			mc->mc_pid = -1;
-			state = MQTT_S_PAYLOAD;
-		}
+#ifndef MQTT_NO_PUBLISH_INPUT
+/*
+ * the decoded payload is charged on top of the packet it came in, and
+ * a QOS0 publish is shed if it won't fit, the same as in mqtt_parse.
+ */
+static int
+mqtt_codec_charge(struct mqtt_conn *mc, size_t len)
+{
+	if (mqtt_charge(mc, len, ISSET(mc->mc_flags, 0x3 << 1)) == -1) {
+		MQTT_TRACE3(shed, mc, MQTT_T_PUBLISH, len);
+		return (-1);
+	}
+	mc->mc_incharge += len;
 
-		if (mc->mc_topic_len > mc->mc_remlen)
-			return (MQTT_S_DEAD);
-		mc->mc_remlen -= mc->mc_topic_len;
+	return (0);
+}
 
-		return (mqtt_strcpy(mc, mc->mc_topic_len, state));
+static enum mqtt_state
+mqtt_codec_decode(struct mqtt_conn *mc)
+{
+	const struct mqtt_codec_ent *mce;
+	const struct mqtt_codec *mcd;
+	ssize_t len, rv;
+	uint8_t *mem;
+
+	mce = mqtt_codec_lookup(mc, mc->mc_topic, mc->mc_topic_len);
+	if (mce == NULL)
+		return (MQTT_S_PUB_DONE);
+	mcd = mce->mce_codec;
+
+	/* the peer can't be allowed to inflate a payload without limit */
+	len = (*mcd->decoded_len)(mce->mce_ctx, mc->mc_mem, mc->mc_len);
+	if (len < 0 || len > MQTT_MAX_REMLEN)
+		return (MQTT_S_DEAD);
 
-	case MQTT_S_PID_HI:
-		mc->mc_pid = (unsigned int)ch << 8;
-		return (MQTT_S_PID_LO);
-	case MQTT_S_PID_LO:
-		mc->mc_pid |= (unsigned int)ch;
+	if (mqtt_codec_charge(mc, len) == -1)
+		return (MQTT_S_IDLE);
 
-		mc->mc_topic = mc->mc_mem;
-		return (mqtt_strcpy(mc, mc->mc_remlen, MQTT_S_PUB_DONE));
+	mem = malloc(len + 1);
+	if (mem == NULL)
+		return (MQTT_S_DEAD);
 
-	default:
-		abort();
+	rv = (*mcd->decode)(mce->mce_ctx, mem, len, mc->mc_mem, mc->mc_len);
+	if (rv < 0 || rv > len) {
+		free(mem);
+		return (MQTT_S_DEAD);
 	}
+	mem[rv] = '\0';
+
+	free(mc->mc_mem);
+	mc->mc_mem = mem;
+	mc->mc_len = rv;
+
+	return (MQTT_S_PUB_DONE);
 }
+#endif /* MQTT_NO_PUBLISH_INPUT */
 
-static enum mqtt_state
-mqtt_connack(struct mqtt_conn *mc, const void *mem, size_t len)
+static struct mqtt_msg *
+mqtt_msg_alloc(size_t topic_len, size_t payload_len)
 {
-	const struct mqtt_p_connack *pc;
+	struct mqtt_msg *msg;
 
-	if (len < sizeof(*pc))
-		return (MQTT_S_DEAD);
+	msg = malloc(sizeof(*msg) + topic_len + 1 + payload_len + 1);
+	if (msg == NULL)
+		return (NULL);
 
-	pc = mem;
-	if (pc->code != MQTT_CONNACK_ACCEPTED)
-		return (MQTT_S_DEAD);
+	msg->msg_refs = 1;
+	msg->msg_qos = MQTT_QOS0;
+	msg->msg_pid = 0;
+	msg->msg_topic_len = topic_len;
+	msg->msg_topic[topic_len] = '\0';
+	msg->msg_payload_len = payload_len;
+	msg->msg_payload = msg->msg_topic + topic_len + 1;
+	msg->msg_payload[payload_len] = '\0';
 
-	(*mc->mc_settings->mqtt_on_connect)(mc);
+	return (msg);
+}
 
-	return (MQTT_S_IDLE);
+struct mqtt_msg *
+mqtt_msg_create(const char *topic, size_t topic_len,
+    const void *payload, size_t payload_len, enum mqtt_qos qos)
+{
+	struct mqtt_msg *msg;
+
+	msg = mqtt_msg_alloc(topic_len, payload_len);
+	if (msg == NULL)
+		return (NULL);
+
+	memcpy(msg->msg_topic, topic, topic_len);
+	memcpy(msg->msg_payload, payload, payload_len);
+	msg->msg_qos = qos;
+
+	return (msg);
 }
 
-static struct mqtt_message *
-mqtt_get_pending(struct mqtt_conn *mc, int pid)
+struct mqtt_msg *
+mqtt_msg_ref(struct mqtt_msg *msg)
 {
-	struct mqtt_message *mm;
+	__atomic_add_fetch(&msg->msg_refs, 1, __ATOMIC_RELAXED);
+	return (msg);
+}
 
-	/* don't need SAFE here cos we're not iterating past the removal */
-	TAILQ_FOREACH(mm, &mc->mc_pending, mm_entry) {
-		if (mm->mm_id == pid) {
-			TAILQ_REMOVE(&mc->mc_pending, mm, mm_entry);
-			return (mm);
-		}
-	}
+void
+mqtt_msg_unref(struct mqtt_msg *msg)
+{
+	if (__atomic_sub_fetch(&msg->msg_refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(msg);
+}
 
-	return (NULL);
+const char *
+mqtt_msg_topic(const struct mqtt_msg *msg, size_t *lenp)
+{
+	if (lenp != NULL)
+		*lenp = msg->msg_topic_len;
+	return (msg->msg_topic);
 }
 
-static enum mqtt_state
-mqtt_suback(struct mqtt_conn *mc, const void *mem, size_t len)
+const char *
+mqtt_msg_payload(const struct mqtt_msg *msg, size_t *lenp)
 {
-	struct mqtt_message *mm;
-	const struct mqtt_u16 *mu16 = mem;
-	const uint8_t *buf;
-	void *cookie;
-	int pid;
+	if (lenp != NULL)
+		*lenp = msg->msg_payload_len;
+	return (msg->msg_payload);
+}
 
-	if (len < sizeof(*mu16))
-		return (MQTT_S_DEAD);
+enum mqtt_qos
+mqtt_msg_qos(const struct mqtt_msg *msg)
+{
+	return (msg->msg_qos);
+}
 
-	pid = mqtt_u16_rd(mu16);
-	mm = mqtt_get_pending(mc, pid);
-	if (mm == NULL || mm->mm_type != MQTT_T_SUBSCRIBE)
+unsigned int
+mqtt_msg_pid(const struct mqtt_msg *msg)
+{
+	return (msg->msg_pid);
+}
+
+#ifndef MQTT_NO_PUBLISH_INPUT
+/*
+ * decoding changes the payload length, so the decoded payload goes
+ * into a new message.
+ */
+static enum mqtt_state
+mqtt_codec_decode_msg(struct mqtt_conn *mc)
+{
+	struct mqtt_msg *omsg = mc->mc_msg;
+	struct mqtt_msg *msg;
+	const struct mqtt_codec_ent *mce;
+	const struct mqtt_codec *mcd;
+	ssize_t len, rv;
+
+	mce = mqtt_codec_lookup(mc, omsg->msg_topic, omsg->msg_topic_len);
+	if (mce == NULL)
+		return (MQTT_S_PUB_DONE);
+	mcd = mce->mce_codec;
+
+	len = (*mcd->decoded_len)(mce->mce_ctx,
+	    omsg->msg_payload, omsg->msg_payload_len);
+	if (len < 0 || len > MQTT_MAX_REMLEN)
 		return (MQTT_S_DEAD);
 
-	cookie = mm->mm_cookie;
-	free(mm);
+	if (mqtt_codec_charge(mc, len) == -1)
+		return (MQTT_S_IDLE);
 
-	buf = (const uint8_t *)(mu16 + 1);
-	len -= sizeof(*mu16);
-	if (len == 0)
+	msg = mqtt_msg_alloc(omsg->msg_topic_len, len);
+	if (msg == NULL)
 		return (MQTT_S_DEAD);
 
-	(*mc->mc_settings->mqtt_on_suback)(mc, cookie, buf, len);
+	rv = (*mcd->decode)(mce->mce_ctx, msg->msg_payload, len,
+	    omsg->msg_payload, omsg->msg_payload_len);
+	if (rv < 0 || rv > len) {
+		free(msg);
+		return (MQTT_S_DEAD);
+	}
+	msg->msg_payload[rv] = '\0';
+	msg->msg_payload_len = rv;
+	memcpy(msg->msg_topic, omsg->msg_topic, omsg->msg_topic_len);
 
-	return (MQTT_S_IDLE);
+	mc->mc_msg = msg;
+	mqtt_msg_unref(omsg);
+
+	return (MQTT_S_PUB_DONE);
 }
 
+/*
+ * read the topic and payload of a PUBLISH straight into a message
+ * rather than separate buffers.
+ */
 static enum mqtt_state
-mqtt_unsuback(struct mqtt_conn *mc, const void *mem, size_t len)
+mqtt_msgcpy(struct mqtt_conn *mc, enum mqtt_state nstate)
 {
-	struct mqtt_message *mm;
-	const struct mqtt_u16 *mu16 = mem;
-	void *cookie;
-	int pid;
+	struct mqtt_msg *msg;
 
-	if (len < sizeof(*mu16))
+	msg = mqtt_msg_alloc(mc->mc_topic_len, mc->mc_remlen);
+	if (msg == NULL)
 		return (MQTT_S_DEAD);
 
-	pid = mqtt_u16_rd(mu16);
-	mm = mqtt_get_pending(mc, pid);
-	if (mm == NULL || mm->mm_type != MQTT_T_UNSUBSCRIBE)
-		return (MQTT_S_DEAD);
+	mc->mc_msg = msg;
+	mc->mc_mem = (uint8_t *)msg->msg_topic;
+	mc->mc_len = msg->msg_topic_len;
+	mc->mc_off = 0;
+	mc->mc_nstate = nstate;
 
-	cookie = mm->mm_cookie;
-	free(mm);
+	return (MQTT_S_MEMCPY);
+}
 
-	len -= sizeof(*mu16);
-	if (len != 0)
-		return (MQTT_S_DEAD);
+static enum mqtt_state
+mqtt_msg_payload_cpy(struct mqtt_conn *mc)
+{
+	struct mqtt_msg *msg = mc->mc_msg;
 
-	(*mc->mc_settings->mqtt_on_unsuback)(mc, cookie);
+	mc->mc_mem = (uint8_t *)msg->msg_payload;
+	mc->mc_len = msg->msg_payload_len;
+	mc->mc_off = 0;
+	mc->mc_nstate = MQTT_S_PUB_DONE;
 
-	return (MQTT_S_IDLE);
+	return (MQTT_S_MEMCPY);
 }
 
-static enum mqtt_state
-mqtt_nstate(struct mqtt_conn *mc)
+/*
+ * publishes the peer can't take are dropped before they're read.
+ * only QOS0 ones are dropped for flow control, the app is expected
+ * to stop reading when mqtt_bridge_blocked says so.
+ */
+static int
+mqtt_bridge_drop(struct mqtt_conn *mc)
 {
-	enum mqtt_state state = mc->mc_nstate;
+	struct mqtt_conn *to = mc->mc_bridge->br_to;
 
-	switch (state) {
-	case MQTT_S_PID_HI:
+	switch (to->mc_state) {
+	case MQTT_S_GONE:
+	case MQTT_S_DEAD:
+		return (1);
+	default:
 		break;
-	case MQTT_S_PAYLOAD:
-		mc->mc_topic = mc->mc_mem;
-		if (mc->mc_remlen > 0) {
-			return (mqtt_strcpy(mc, mc->mc_remlen,
-			    MQTT_S_PUB_DONE));
-		}
+	}
 
-		mc->mc_mem = NULL;
-		mc->mc_len = 0;
-		/* FALLTHROUGH */
+	return (!ISSET(mc->mc_flags, 0x3 << 1) && mqtt_wouldblock(to));
+}
 
-	case MQTT_S_PUB_DONE:
-		/* we give the topic and payload to the main app */
-		(*mc->mc_settings->mqtt_on_message)(mc,
-		    mc->mc_topic, mc->mc_topic_len,
-		    mc->mc_mem, mc->mc_len,
-		    (mc->mc_flags >> 1) & 0x3);
-		state = MQTT_S_IDLE;
-		break;
+/*
+ * read the topic and payload of a PUBLISH straight into the packet
+ * that will be sent to the peer. room is left in front of the topic
+ * for the prefix and the new header.
+ */
+static enum mqtt_state
+mqtt_bridgecpy(struct mqtt_conn *mc, enum mqtt_state nstate)
+{
+	size_t room = sizeof(struct mqtt_header) + sizeof(struct mqtt_u16) +
+	    mc->mc_bridge->br_prefix_len;
 
-	case MQTT_S_DONE:
-		switch (mc->mc_type) {
+	mc->mc_fwd = malloc(room + mc->mc_topic_len + mc->mc_remlen);
+	if (mc->mc_fwd == NULL)
+		return (MQTT_S_DEAD);
+
+	mc->mc_mem = mc->mc_fwd + room;
+	mc->mc_len = mc->mc_topic_len;
+	mc->mc_off = 0;
+	mc->mc_nstate = nstate;
+
+	return (MQTT_S_MEMCPY);
+}
+
+static enum mqtt_state
+mqtt_bridge_fwd(struct mqtt_conn *mc)
+{
+	struct mqtt_bridge *br = mc->mc_bridge;
+	uint8_t hdr[sizeof(struct mqtt_header)];
+	uint8_t *msg = mc->mc_fwd;
+	uint8_t *p = mc->mc_topic;
+	size_t topic_len = mc->mc_topic_len;
+	size_t len, hlen, off;
+	uint8_t flags = 0;
+
+	mc->mc_fwd = NULL;
+	MQTT_TRACE3(packet__done, mc, MQTT_T_PUBLISH, mc->mc_pktlen);
+
+	/* the bridge was taken down while this was being read */
+	if (br == NULL) {
+		free(msg);
+		return (MQTT_S_IDLE);
+	}
+
+	if (topic_len >= br->br_strip_len &&
+	    memcmp(p, br->br_strip, br->br_strip_len) == 0) {
+		p += br->br_strip_len;
+		topic_len -= br->br_strip_len;
+	}
+	topic_len += br->br_prefix_len;
+	if (topic_len > MQTT_MAX_TOPIC)
+		goto drop;
+
+	len = sizeof(struct mqtt_u16) + topic_len + mc->mc_remlen;
+	if (len > MQTT_MAX_REMLEN)
+		goto drop;
+
+	if (!ISSET(br->br_flags, MQTT_BRIDGE_NORETAIN))
+		flags |= mc->mc_flags & (1 << 0);
+	hlen = mqtt_header_set(hdr, MQTT_T_PUBLISH, flags, len);
+
+	/* the bridge could have been changed to a longer prefix */
+	if ((size_t)(p - msg) <
+	    hlen + sizeof(struct mqtt_u16) + br->br_prefix_len)
+		goto drop;
+
+	p -= br->br_prefix_len;
+	memcpy(p, br->br_prefix, br->br_prefix_len);
+	p -= sizeof(struct mqtt_u16);
+	mqtt_u16(p, topic_len);
+	p -= hlen;
+	memcpy(p, hdr, hlen);
+	off = p - msg;
+
+	if (mqtt_enqueue_fd(br->br_to, NULL, MQTT_T_PUBLISH, -1,
+	    msg, off, off + hlen + len, -1, 0, 0) == NULL)
+		goto drop;
+
+	return (MQTT_S_IDLE);
+
+drop:
+	br->br_shed++;
+	free(msg);
+	return (MQTT_S_IDLE);
+}
+
+static enum mqtt_state
+mqtt_bridge_payload_cpy(struct mqtt_conn *mc)
+{
+	if (mc->mc_remlen == 0)
+		return (mqtt_bridge_fwd(mc));
+
+	mc->mc_mem = mc->mc_topic + mc->mc_topic_len;
+	mc->mc_len = mc->mc_remlen;
+	mc->mc_off = 0;
+	mc->mc_nstate = MQTT_S_PUB_DONE;
+
+	return (MQTT_S_MEMCPY);
+}
+#endif /* MQTT_NO_PUBLISH_INPUT */
+
+static enum mqtt_state
+mqtt_memcpy(struct mqtt_conn *mc, size_t len, enum mqtt_state nstate)
+{
+	mc->mc_mem = malloc(len);
+	if (mc->mc_mem == NULL)
+		return (MQTT_S_DEAD);
+
+	mc->mc_len = len;
+	mc->mc_off = 0;
+	mc->mc_nstate = nstate;
+
+	return (MQTT_S_MEMCPY);
+}
+
+#ifndef MQTT_NO_PUBLISH_INPUT
+static enum mqtt_state
+mqtt_strcpy(struct mqtt_conn *mc, size_t len, enum mqtt_state nstate)
+{
+	mc->mc_mem = malloc(len + 1);
+	if (mc->mc_mem == NULL)
+		return (MQTT_S_DEAD);
+
+	mc->mc_mem[len] = '\0';
+	mc->mc_len = len;
+	mc->mc_off = 0;
+	mc->mc_nstate = nstate;
+
+	return (MQTT_S_MEMCPY);
+}
+
+/*
+ * read the topic into a buffer kept on the connection so the app can
+ * look at it before anything is allocated for the message.
+ */
+static enum mqtt_state
+mqtt_topicbuf(struct mqtt_conn *mc)
+{
+	size_t len = mc->mc_topic_len + 1;
+	char *buf;
+
+	if (len > mc->mc_topicbuf_len) {
+		buf = realloc(mc->mc_topicbuf, len);
+		if (buf == NULL)
+			return (MQTT_S_DEAD);
+
+		mqtt_charge(mc, len - mc->mc_topicbuf_len, 1);
+		mc->mc_topicbuf = buf;
+		mc->mc_topicbuf_len = len;
+	}
+
+	mc->mc_mem = (uint8_t *)mc->mc_topicbuf;
+	mc->mc_len = mc->mc_topic_len;
+	mc->mc_off = 0;
+	mc->mc_nstate = MQTT_S_TOPIC;
+
+	return (MQTT_S_MEMCPY);
+}
+
+/*
+ * let the app decide if it wants the message. if it does, the topic
+ * is copied to where it would have been read to, otherwise the rest
+ * of the packet is skipped over.
+ */
+static enum mqtt_state
+mqtt_topic_filter(struct mqtt_conn *mc)
+{
+	const struct mqtt_settings *ms = mc->mc_settings;
+	enum mqtt_qos qos = (mc->mc_flags >> 1) & 0x3;
+	enum mqtt_state state;
+
+	mc->mc_topicbuf[mc->mc_topic_len] = '\0';
+	if (!(*ms->mqtt_on_topic)(mc, mc->mc_topicbuf, mc->mc_topic_len,
+	    qos)) {
+		mc->mc_skip = mc->mc_remlen;
+		if (qos != MQTT_QOS0)
+			mc->mc_skip += sizeof(struct mqtt_u16); /* pid */
+
+		MQTT_TRACE3(packet__skip, mc, mc->mc_topic_len, mc->mc_skip);
+		return (mc->mc_skip > 0 ? MQTT_S_SKIP : MQTT_S_IDLE);
+	}
+
+	state = qos != MQTT_QOS0 ? MQTT_S_PID_HI : MQTT_S_PAYLOAD;
+
+	if (mc->mc_bridge != NULL) {
+		if (mqtt_bridgecpy(mc, state) == MQTT_S_DEAD)
+			return (MQTT_S_DEAD);
+	} else if (ms->mqtt_on_msg != NULL || mc->mc_dispatch != NULL) {
+		if (mqtt_msgcpy(mc, state) == MQTT_S_DEAD)
+			return (MQTT_S_DEAD);
+	} else {
+		if (mqtt_strcpy(mc, mc->mc_topic_len, state) == MQTT_S_DEAD)
+			return (MQTT_S_DEAD);
+	}
+	memcpy(mc->mc_mem, mc->mc_topicbuf, mc->mc_topic_len);
+
+	return (state);
+}
+#endif /* MQTT_NO_PUBLISH_INPUT */
+
+static int		mqtt_pingresp(struct mqtt_conn *);
+
+static enum mqtt_state
+mqtt_parse(struct mqtt_conn *mc, uint8_t ch)
+{
+	enum mqtt_state state = mc->mc_state;
+	uint8_t type, flags;
+
+	switch (state) {
+	case MQTT_S_IDLE:
+		type = (ch >> 4) & 0xf;
+		flags = (ch >> 0) & 0xf;
+
+		if (MQTT_SERVER(mc)) {
+			/* the first and only the first packet is CONNECT */
+			if (mc->mc_connected) {
+				if (type == MQTT_T_CONNECT)
+					return (MQTT_S_DEAD);
+			} else if (type != MQTT_T_CONNECT)
+				return (MQTT_S_DEAD);
+		}
+
+		switch (type) {
+		case MQTT_T_CONNECT:
+			if (!MQTT_SERVER(mc) || flags != 0)
+				return (MQTT_S_DEAD);
+			break;
 		case MQTT_T_CONNACK:
-			state = mqtt_connack(mc, mc->mc_mem, mc->mc_len);
+			if (MQTT_SERVER(mc) || flags != 0)
+				return (MQTT_S_DEAD);
+			/* check if this is first? */
+			break;
+
+		case MQTT_T_PUBLISH:
+#ifdef MQTT_NO_PUBLISH_INPUT
+			return (MQTT_S_DEAD);
+#else
+			if (((flags >> 1) & 0x3) > MQTT_MAX_QOS)
+				return (MQTT_S_DEAD);
+			break;
+#endif
+
+		case MQTT_T_PUBACK:
+			return (MQTT_S_DEAD);
+		case MQTT_T_PUBREC:
+			return (MQTT_S_DEAD);
+		case MQTT_T_PUBREL:
+			return (MQTT_S_DEAD);
+		case MQTT_T_PUBCOMP:
+			return (MQTT_S_DEAD);
+
+		case MQTT_T_SUBSCRIBE:
+			if (!MQTT_SERVER(mc) || flags != 0x2)
+				return (MQTT_S_DEAD);
 			break;
+#ifndef MQTT_NO_SUBSCRIBE
 		case MQTT_T_SUBACK:
-			state = mqtt_suback(mc, mc->mc_mem, mc->mc_len);
+			if (MQTT_SERVER(mc))
+				return (MQTT_S_DEAD);
+			break;
+#endif
+
+		case MQTT_T_UNSUBSCRIBE:
+			if (!MQTT_SERVER(mc) || flags != 0x2)
+				return (MQTT_S_DEAD);
 			break;
+#ifndef MQTT_NO_SUBSCRIBE
 		case MQTT_T_UNSUBACK:
-			state = mqtt_unsuback(mc, mc->mc_mem, mc->mc_len);
+			if (MQTT_SERVER(mc))
+				return (MQTT_S_DEAD);
+			break;
+#endif
+
+		case MQTT_T_PINGREQ:
+			if (!MQTT_SERVER(mc) || flags != 0)
+				return (MQTT_S_DEAD);
+			break;
+		case MQTT_T_PINGRESP:
+			if (MQTT_SERVER(mc) || flags != 0)
+				return (MQTT_S_DEAD);
+			break;
+
+		case MQTT_T_DISCONNECT:
+			if (!MQTT_SERVER(mc) || flags != 0)
+				return (MQTT_S_DEAD);
 			break;
+
 		default:
-			abort();
+			return (MQTT_S_DEAD);
 		}
-		free(mc->mc_mem);
-		break;
-	default:
-		abort();
-	}
 
-	return (state);
-}
+		mc->mc_type = type;
+		mc->mc_flags = flags;
+		mc->mc_remlen = 0;
+		mc->mc_shift = 0;
 
-void
-mqtt_input(struct mqtt_conn *mc, const void *ptr, size_t len)
-{
-	enum mqtt_state state = mc->mc_state;
-	const uint8_t *buf = ptr;
-	size_t rem;
+		return (MQTT_S_REMLEN);
 
-	do {
-		switch (state) {
-		case MQTT_S_MEMCPY:
-			rem = mc->mc_len - mc->mc_off;
-			if (len < rem)
-				rem = len;
-			memcpy(mc->mc_mem + mc->mc_off, buf, rem);
-			mc->mc_off += rem;
-			if (mc->mc_off == mc->mc_len)
-				state = mqtt_nstate(mc);
+	case MQTT_S_REMLEN:
+		mc->mc_remlen |= (unsigned int)(ch & 0x7f) << mc->mc_shift;
+
+		if (ch & 0x80) {
+			mc->mc_shift += 7;
+			if (mc->mc_shift > 28)
+				return (MQTT_S_DEAD);
+			return (state);
+		}
+
+		mc->mc_pktlen = mc->mc_remlen;
+		MQTT_TRACE3(packet__start, mc, mc->mc_type, mc->mc_remlen);
+
+		switch (mc->mc_type) {
+#ifndef MQTT_NO_PUBLISH_INPUT
+		case MQTT_T_PUBLISH:
+			if (mc->mc_remlen < sizeof(struct mqtt_u16))
+				return (MQTT_S_DEAD);
+
+			if (mc->mc_bridge != NULL && mqtt_bridge_drop(mc)) {
+				mc->mc_bridge->br_shed++;
+				mc->mc_skip = mc->mc_remlen;
+				MQTT_TRACE3(shed, mc, mc->mc_type,
+				    mc->mc_remlen);
+				return (MQTT_S_SKIP);
+			}
+
+			/* QOS0 publishes are dropped if there's no room */
+			if (mqtt_charge(mc, mc->mc_remlen,
+			    ISSET(mc->mc_flags, 0x3 << 1)) == -1) {
+				mc->mc_skip = mc->mc_remlen;
+				MQTT_TRACE3(shed, mc, mc->mc_type,
+				    mc->mc_remlen);
+				return (MQTT_S_SKIP);
+			}
+			mc->mc_incharge = mc->mc_remlen;
+			mc->mc_remlen -= sizeof(struct mqtt_u16);
+
+			return (MQTT_S_TOPIC_LEN_HI);
+#endif
+
+		case MQTT_T_PINGRESP:
+			if (mc->mc_remlen != 0)
+				return (MQTT_S_DEAD);
+
+			mc->mc_pinging = 0;
+			MQTT_TRACE1(keepalive__pingresp, mc);
+			return (MQTT_S_IDLE);
+
+		case MQTT_T_PINGREQ:
+			if (mc->mc_remlen != 0)
+				return (MQTT_S_DEAD);
+			MQTT_TRACE1(keepalive__pingreq, mc);
+			if (mqtt_pingresp(mc) == -1)
+				return (MQTT_S_DEAD);
+
+			return (MQTT_S_IDLE);
+
+		case MQTT_T_DISCONNECT:
+			if (mc->mc_remlen != 0)
+				return (MQTT_S_DEAD);
+
+			return (MQTT_S_GONE);
 
-			break;
 		default:
-			state = mqtt_parse(mc, *buf);
-			rem = 1;
 			break;
 		}
 
-		if (state == MQTT_S_DEAD) {
-			(*mc->mc_settings->mqtt_dead)(mc);
-			return;
+		/* everything else has at least a packet id or flags */
+		if (mc->mc_remlen < sizeof(struct mqtt_u16))
+			return (MQTT_S_DEAD);
+
+		mqtt_charge(mc, mc->mc_remlen, 1);
+		mc->mc_incharge = mc->mc_remlen;
+
+		return (mqtt_memcpy(mc, mc->mc_remlen, MQTT_S_DONE));
+
+	case MQTT_S_MEMCPY:
+	case MQTT_S_SKIP:
+		/* this should be handled in mqtt_input() */
+		abort();
+
+#ifndef MQTT_NO_PUBLISH_INPUT
+	case MQTT_S_TOPIC_LEN_HI:
+		mc->mc_topic_len = (unsigned int)ch << 8;
+		return (MQTT_S_TOPIC_LEN_LO);
+	case MQTT_S_TOPIC_LEN_LO:
+		mc->mc_topic_len |= ch;
+		if (mc->mc_topic_len > MQTT_MAX_TOPIC)
+			return (MQTT_S_DEAD);
+
+		if (MQTT_MAX_QOS > 0 && ISSET(mc->mc_flags, 0x3 << 1)) {
+			if (mc->mc_remlen < sizeof(struct mqtt_u16))
+				return (MQTT_S_DEAD);
+			mc->mc_remlen -= sizeof(struct mqtt_u16);
+
+			state = MQTT_S_PID_HI;
+		} else {
+			mc->mc_pid = -1;
+			state = MQTT_S_PAYLOAD;
 		}
 
-		buf += rem;
-		len -= rem;
+		if (mc->mc_topic_len > mc->mc_remlen)
+			return (MQTT_S_DEAD);
+		mc->mc_remlen -= mc->mc_topic_len;
+
+		if (mc->mc_settings->mqtt_on_topic != NULL)
+			return (mqtt_topicbuf(mc));
+
+		if (mc->mc_bridge != NULL)
+			return (mqtt_bridgecpy(mc, state));
+
+		if (mc->mc_settings->mqtt_on_msg != NULL ||
+		    mc->mc_dispatch != NULL)
+			return (mqtt_msgcpy(mc, state));
+
+		return (mqtt_strcpy(mc, mc->mc_topic_len, state));
+
+	case MQTT_S_PID_HI:
+		mc->mc_pid = (unsigned int)ch << 8;
+		return (MQTT_S_PID_LO);
+	case MQTT_S_PID_LO:
+		mc->mc_pid |= (unsigned int)ch;
+
+		mc->mc_topic = mc->mc_mem;
+		if (mc->mc_fwd != NULL)
+			return (mqtt_bridge_payload_cpy(mc));
+		if (mc->mc_msg != NULL)
+			return (mqtt_msg_payload_cpy(mc));
+
+		return (mqtt_strcpy(mc, mc->mc_remlen, MQTT_S_PUB_DONE));
+#endif /* MQTT_NO_PUBLISH_INPUT */
+
+	default:
+		abort();
+	}
+}
+
+static enum mqtt_state
+mqtt_input_connack(struct mqtt_conn *mc, const void *mem, size_t len)
+{
+	const struct mqtt_p_connack *pc;
+
+	if (len < sizeof(*pc))
+		return (MQTT_S_DEAD);
+
+	pc = mem;
+	if (pc->code != MQTT_CONNACK_ACCEPTED)
+		return (MQTT_S_DEAD);
+
+	(*mc->mc_settings->mqtt_on_connect)(mc);
+
+	return (MQTT_S_IDLE);
+}
+
+#ifndef MQTT_NO_SUBSCRIBE
+static struct mqtt_message *
+mqtt_get_pending(struct mqtt_conn *mc, int pid)
+{
+	struct mqtt_message *mm;
+
+	/* don't need SAFE here cos we're not iterating past the removal */
+	TAILQ_FOREACH(mm, &mc->mc_pending, mm_entry) {
+		if (mm->mm_id == pid) {
+			TAILQ_REMOVE(&mc->mc_pending, mm, mm_entry);
+			return (mm);
+		}
+	}
+
+	return (NULL);
+}
+
+/* every packet in the group has been acked */
+static void
+mqtt_subgrp_done(struct mqtt_conn *mc, struct mqtt_subgrp *sg)
+{
+	const struct mqtt_settings *ms = mc->mc_settings;
+	struct mqtt_subreq *sr;
+	unsigned int i;
+
+	for (i = 0; i < sg->sg_nreqs; i++) {
+		sr = &sg->sg_reqs[i];
+		if (sg->sg_type == MQTT_T_SUBSCRIBE) {
+			(*ms->mqtt_on_suback)(mc, sr->sr_cookie,
+			    sg->sg_rcodes + sr->sr_off, sr->sr_n);
+		} else
+			(*ms->mqtt_on_unsuback)(mc, sr->sr_cookie);
+	}
+}
+
+static enum mqtt_state
+mqtt_input_subgrp(struct mqtt_conn *mc, struct mqtt_message *mm,
+    const uint8_t *rcodes, size_t nrcodes)
+{
+	struct mqtt_subgrp *sg = mm->mm_grp;
+
+	if (sg->sg_type == MQTT_T_SUBSCRIBE) {
+		if (nrcodes != mm->mm_grp_n) {
+			mqtt_message_free(mc, mm);
+			return (MQTT_S_DEAD);
+		}
+		memcpy(sg->sg_rcodes + mm->mm_grp_off, rcodes, nrcodes);
+	} else if (nrcodes != 0) {
+		mqtt_message_free(mc, mm);
+		return (MQTT_S_DEAD);
+	}
+
+	/*
+	 * this is the last ack unless more are coming, or the packets
+	 * are still going out and mqtt_filters_enqueue finishes up.
+	 */
+	if (sg->sg_npkts == 1)
+		mqtt_subgrp_done(mc, sg);
+
+	mqtt_message_free(mc, mm);
+
+	return (MQTT_S_IDLE);
+}
+
+static enum mqtt_state
+mqtt_input_suback(struct mqtt_conn *mc, const void *mem, size_t len)
+{
+	struct mqtt_message *mm;
+	const struct mqtt_u16 *mu16 = mem;
+	const uint8_t *buf;
+	void *cookie;
+	int pid;
+
+	if (len < sizeof(*mu16))
+		return (MQTT_S_DEAD);
+
+	pid = mqtt_u16_rd(mu16);
+	mm = mqtt_get_pending(mc, pid);
+	if (mm == NULL || mm->mm_type != MQTT_T_SUBSCRIBE)
+		return (MQTT_S_DEAD);
+
+	buf = (const uint8_t *)(mu16 + 1);
+	len -= sizeof(*mu16);
+
+	if (mm->mm_grp != NULL)
+		return (mqtt_input_subgrp(mc, mm, buf, len));
+
+	cookie = mm->mm_cookie;
+	mqtt_message_free(mc, mm);
+
+	if (len == 0)
+		return (MQTT_S_DEAD);
+
+	(*mc->mc_settings->mqtt_on_suback)(mc, cookie, buf, len);
+
+	return (MQTT_S_IDLE);
+}
+
+static enum mqtt_state
+mqtt_input_unsuback(struct mqtt_conn *mc, const void *mem, size_t len)
+{
+	struct mqtt_message *mm;
+	const struct mqtt_u16 *mu16 = mem;
+	void *cookie;
+	int pid;
+
+	if (len < sizeof(*mu16))
+		return (MQTT_S_DEAD);
+
+	pid = mqtt_u16_rd(mu16);
+	mm = mqtt_get_pending(mc, pid);
+	if (mm == NULL || mm->mm_type != MQTT_T_UNSUBSCRIBE)
+		return (MQTT_S_DEAD);
+
+	len -= sizeof(*mu16);
+
+	if (mm->mm_grp != NULL)
+		return (mqtt_input_subgrp(mc, mm, NULL, len));
+
+	cookie = mm->mm_cookie;
+	mqtt_message_free(mc, mm);
+
+	if (len != 0)
+		return (MQTT_S_DEAD);
+
+	(*mc->mc_settings->mqtt_on_unsuback)(mc, cookie);
+
+	return (MQTT_S_IDLE);
+}
+#endif /* MQTT_NO_SUBSCRIBE */
+
+#ifndef MQTT_NO_SERVER
+static enum mqtt_state
+mqtt_input_connect(struct mqtt_conn *mc, const void *mem, size_t len)
+{
+	struct mqtt_conn_settings mcs;
+	const struct mqtt_p_connect *pc = mem;
+	const uint8_t *buf;
+	unsigned int keep_alive;
+	uint8_t flags;
+
+	if (len < sizeof(*pc))
+		return (MQTT_S_DEAD);
+
+	if (mqtt_u16_rd(&pc->len) != sizeof(pc->mqtt) ||
+	    memcmp(pc->mqtt, "MQTT", sizeof(pc->mqtt)) != 0)
+		return (MQTT_S_DEAD);
+
+	mc->mc_connected = 1;
+
+	if (pc->level != 0x4) {
+		/* let the client know why before we hang up */
+		mqtt_connack(mc, 0, MQTT_CONN_PROTO_VERSION);
+		return (MQTT_S_DEAD);
+	}
+
+	flags = pc->flags;
+	if (ISSET(flags, 1 << 0))
+		return (MQTT_S_DEAD);
+	if (!ISSET(flags, MQTT_CONNECT_F_WILL) &&
+	    ISSET(flags, MQTT_CONNECT_F_WILL_QOS(0x3) |
+	    MQTT_CONNECT_F_WILL_RETAIN))
+		return (MQTT_S_DEAD);
+	if (ISSET(flags, MQTT_CONNECT_F_WILL_QOS(0x3)) ==
+	    MQTT_CONNECT_F_WILL_QOS(0x3))
+		return (MQTT_S_DEAD);
+	if (ISSET(flags, MQTT_CONNECT_F_PASSWORD) &&
+	    !ISSET(flags, MQTT_CONNECT_F_USERNAME))
+		return (MQTT_S_DEAD);
+
+	memset(&mcs, 0, sizeof(mcs));
+	mcs.clean_session = !!ISSET(flags, MQTT_CONNECT_F_CLEAN_SESSION);
+	keep_alive = mqtt_u16_rd(&pc->keep_alive);
+	mcs.keep_alive = keep_alive;
+
+	buf = (const uint8_t *)(pc + 1);
+	len -= sizeof(*pc);
+
+	if (mqtt_lenstr_rd(&buf, &len, &mcs.clientid, &mcs.clientid_len) == -1)
+		return (MQTT_S_DEAD);
+
+	if (ISSET(flags, MQTT_CONNECT_F_WILL)) {
+		if (mqtt_lenstr_rd(&buf, &len,
+		    &mcs.will_topic, &mcs.will_topic_len) == -1)
+			return (MQTT_S_DEAD);
+		if (mqtt_lenstr_rd(&buf, &len,
+		    &mcs.will_payload, &mcs.will_payload_len) == -1)
+			return (MQTT_S_DEAD);
+
+		mcs.will_qos = (flags >> 3) & 0x3;
+		mcs.will_retain = !!ISSET(flags, MQTT_CONNECT_F_WILL_RETAIN);
+	}
+
+	if (ISSET(flags, MQTT_CONNECT_F_USERNAME)) {
+		if (mqtt_lenstr_rd(&buf, &len,
+		    &mcs.username, &mcs.username_len) == -1)
+			return (MQTT_S_DEAD);
+	}
+	if (ISSET(flags, MQTT_CONNECT_F_PASSWORD)) {
+		if (mqtt_lenstr_rd(&buf, &len,
+		    &mcs.password, &mcs.password_len) == -1)
+			return (MQTT_S_DEAD);
+	}
+
+	if (len != 0)
+		return (MQTT_S_DEAD);
+
+	/* the server gives the client one and a half keepalives */
+	mc->mc_keepalive.tv_sec = keep_alive + (keep_alive / 2);
+	mc->mc_keepalive.tv_nsec = (keep_alive & 1) ? 500000000 : 0;
+
+	(*mc->mc_settings->mqtt_on_conn)(mc, &mcs);
+
+	return (MQTT_S_IDLE);
+}
+
+static enum mqtt_state
+mqtt_input_filters(struct mqtt_conn *mc, const void *mem, size_t len,
+    int type)
+{
+	const struct mqtt_settings *ms = mc->mc_settings;
+	struct mqtt_topic *topics;
+	const uint8_t *buf;
+	const char *filter;
+	size_t rlen, filter_len;
+	size_t ntopics, i;
+	unsigned int pid;
+
+	pid = mqtt_u16_rd(mem);
+	buf = (const uint8_t *)mem + sizeof(struct mqtt_u16);
+	len -= sizeof(struct mqtt_u16);
+
+	/* count and validate the filters before allocating for them */
+	rlen = len;
+	ntopics = 0;
+	while (rlen > 0) {
+		if (mqtt_lenstr_rd(&buf, &rlen, &filter, &filter_len) == -1)
+			return (MQTT_S_DEAD);
+		if (filter_len == 0)
+			return (MQTT_S_DEAD);
+		if (type == MQTT_T_SUBSCRIBE) {
+			if (rlen < 1 || (*buf & ~0x3) != 0 || *buf == 0x3)
+				return (MQTT_S_DEAD);
+			buf++;
+			rlen--;
+		}
+		ntopics++;
+	}
+	if (ntopics == 0)
+		return (MQTT_S_DEAD);
+
+	topics = reallocarray(NULL, ntopics, sizeof(*topics));
+	if (topics == NULL)
+		return (MQTT_S_DEAD);
+
+	buf = (const uint8_t *)mem + sizeof(struct mqtt_u16);
+	for (i = 0; i < ntopics; i++) {
+		struct mqtt_topic *t = &topics[i];
+
+		mqtt_lenstr_rd(&buf, &len, &t->filter, &t->len);
+		if (type == MQTT_T_SUBSCRIBE) {
+			t->qos = *buf++;
+			len--;
+		} else
+			t->qos = MQTT_QOS0;
+	}
+
+	if (type == MQTT_T_SUBSCRIBE)
+		(*ms->mqtt_on_subscribe)(mc, pid, topics, ntopics);
+	else
+		(*ms->mqtt_on_unsubscribe)(mc, pid, topics, ntopics);
+
+	free(topics);
+
+	return (MQTT_S_IDLE);
+}
+#endif /* MQTT_NO_SERVER */
+
+#ifndef MQTT_NO_PUBLISH_INPUT
+static enum mqtt_state
+mqtt_pub_msg(struct mqtt_conn *mc)
+{
+	struct mqtt_msg *msg;
+	enum mqtt_state state;
+
+	if (mc->mc_ncodecs > 0 && mc->mc_msg->msg_payload_len > 0) {
+		state = mqtt_codec_decode_msg(mc);
+		if (state != MQTT_S_PUB_DONE) {
+			mqtt_msg_unref(mc->mc_msg);
+			mc->mc_msg = NULL;
+			return (state);
+		}
+	}
+
+	msg = mc->mc_msg;
+	mc->mc_msg = NULL;
+
+	msg->msg_qos = (mc->mc_flags >> 1) & 0x3;
+	msg->msg_pid = msg->msg_qos == MQTT_QOS0 ? 0 : mc->mc_pid;
+
+	if (mc->mc_lvc != NULL) {
+		mqtt_lvc_update(mc->mc_lvc,
+		    msg->msg_topic, msg->msg_topic_len,
+		    msg->msg_payload, msg->msg_payload_len);
+	}
+
+	MQTT_TRACE3(packet__done, mc, MQTT_T_PUBLISH, mc->mc_pktlen);
+
+	/* the dispatcher or the app gets our reference */
+	if (mc->mc_dispatch != NULL)
+		mqtt_dispatch_push(mc->mc_dispatch, msg);
+	else
+		(*mc->mc_settings->mqtt_on_msg)(mc, msg);
+
+	return (MQTT_S_IDLE);
+}
+#endif /* MQTT_NO_PUBLISH_INPUT */
+
+static void
+mqtt_batch_flush(struct mqtt_conn *mc)
+{
+	size_t n = mc->mc_nbatch;
+
+	if (n == 0)
+		return;
+
+	mc->mc_nbatch = 0;
+	(*mc->mc_settings->mqtt_on_message_batch)(mc, mc->mc_batch, n);
+}
+
+#ifndef MQTT_NO_PUBLISH_INPUT
+static void
+mqtt_batch_add(struct mqtt_conn *mc)
+{
+	struct mqtt_batch_msg *bm = &mc->mc_batch[mc->mc_nbatch++];
+	enum mqtt_qos qos = (mc->mc_flags >> 1) & 0x3;
+
+	bm->topic = (char *)mc->mc_topic;
+	bm->topic_len = mc->mc_topic_len;
+	bm->payload = (char *)mc->mc_mem;
+	bm->payload_len = mc->mc_len;
+	bm->qos = qos;
+	bm->pid = qos == MQTT_QOS0 ? 0 : mc->mc_pid;
+
+	if (mc->mc_nbatch == mc->mc_batch_max)
+		mqtt_batch_flush(mc);
+}
+#endif /* MQTT_NO_PUBLISH_INPUT */
+
+static enum mqtt_state
+mqtt_nstate(struct mqtt_conn *mc)
+{
+	enum mqtt_state state = mc->mc_nstate;
+
+	switch (state) {
+#ifndef MQTT_NO_PUBLISH_INPUT
+	case MQTT_S_TOPIC:
+		state = mqtt_topic_filter(mc);
+		if (state == MQTT_S_PAYLOAD) {
+			/* the topic is in place as if it was just read */
+			mc->mc_nstate = state;
+			state = mqtt_nstate(mc);
+		}
+		break;
+	case MQTT_S_PID_HI:
+		break;
+	case MQTT_S_PAYLOAD:
+		mc->mc_topic = mc->mc_mem;
+		if (mc->mc_fwd != NULL)
+			return (mqtt_bridge_payload_cpy(mc));
+		if (mc->mc_msg != NULL) {
+			if (mc->mc_remlen > 0)
+				return (mqtt_msg_payload_cpy(mc));
+
+			/* empty payload, the message is complete already */
+			return (mqtt_pub_msg(mc));
+		}
+
+		if (mc->mc_remlen > 0) {
+			return (mqtt_strcpy(mc, mc->mc_remlen,
+			    MQTT_S_PUB_DONE));
+		}
+
+		mc->mc_mem = NULL;
+		mc->mc_len = 0;
+		/* FALLTHROUGH */
+
+	case MQTT_S_PUB_DONE:
+		if (mc->mc_fwd != NULL)
+			return (mqtt_bridge_fwd(mc));
+		if (mc->mc_msg != NULL)
+			return (mqtt_pub_msg(mc));
+
+		if (mc->mc_ncodecs > 0 && mc->mc_len > 0) {
+			state = mqtt_codec_decode(mc);
+			if (state != MQTT_S_PUB_DONE) {
+				free(mc->mc_topic);
+				free(mc->mc_mem);
+				return (state);
+			}
+		}
+
+		if (mc->mc_lvc != NULL) {
+			/* a full cache isn't a reason to drop the message */
+			mqtt_lvc_update(mc->mc_lvc,
+			    (const char *)mc->mc_topic, mc->mc_topic_len,
+			    mc->mc_mem, mc->mc_len);
+		}
+
+		MQTT_TRACE3(packet__done, mc, MQTT_T_PUBLISH, mc->mc_pktlen);
+
+		/* we give the topic and payload to the main app */
+		if (mc->mc_batch != NULL) {
+			mqtt_batch_add(mc);
+			state = MQTT_S_IDLE;
+			break;
+		}
+
+		(*mc->mc_settings->mqtt_on_message)(mc,
+		    mc->mc_topic, mc->mc_topic_len,
+		    mc->mc_mem, mc->mc_len,
+		    (mc->mc_flags >> 1) & 0x3);
+		state = MQTT_S_IDLE;
+		break;
+#endif /* MQTT_NO_PUBLISH_INPUT */
+
+	case MQTT_S_DONE:
+		MQTT_TRACE3(packet__done, mc, mc->mc_type, mc->mc_pktlen);
+
+		/* deliver publishes before anything that came after them */
+		mqtt_batch_flush(mc);
+
+		switch (mc->mc_type) {
+#ifndef MQTT_NO_SERVER
+		case MQTT_T_CONNECT:
+			state = mqtt_input_connect(mc, mc->mc_mem, mc->mc_len);
+			break;
+		case MQTT_T_SUBSCRIBE:
+		case MQTT_T_UNSUBSCRIBE:
+			state = mqtt_input_filters(mc, mc->mc_mem, mc->mc_len,
+			    mc->mc_type);
+			break;
+#endif
+		case MQTT_T_CONNACK:
+			state = mqtt_input_connack(mc, mc->mc_mem, mc->mc_len);
+			break;
+#ifndef MQTT_NO_SUBSCRIBE
+		case MQTT_T_SUBACK:
+			state = mqtt_input_suback(mc, mc->mc_mem, mc->mc_len);
+			break;
+		case MQTT_T_UNSUBACK:
+			state = mqtt_input_unsuback(mc, mc->mc_mem, mc->mc_len);
+			break;
+#endif
+		default:
+			abort();
+		}
+		free(mc->mc_mem);
+		break;
+	default:
+		abort();
+	}
+
+	return (state);
+}
+
+static int
+mqtt_input_buf(struct mqtt_conn *mc, const uint8_t *buf, size_t len)
+{
+	enum mqtt_state state = mc->mc_state;
+	size_t rem;
+
+	switch (state) {
+	case MQTT_S_GONE:
+	case MQTT_S_DEAD:
+		/* mqtt_parse would abort on anything more */
+		return (-1);
+	default:
+		break;
+	}
+
+	while (len > 0) {
+		switch (state) {
+		case MQTT_S_MEMCPY:
+			rem = mc->mc_len - mc->mc_off;
+			if (len < rem)
+				rem = len;
+			memcpy(mc->mc_mem + mc->mc_off, buf, rem);
+			mc->mc_off += rem;
+			if (mc->mc_off == mc->mc_len)
+				state = mqtt_nstate(mc);
+
+			break;
+		case MQTT_S_SKIP:
+			rem = mc->mc_skip;
+			if (len < rem)
+				rem = len;
+			mc->mc_skip -= rem;
+			if (mc->mc_skip == 0)
+				state = MQTT_S_IDLE;
+
+			break;
+		default:
+			state = mqtt_parse(mc, *buf);
+			rem = 1;
+			break;
+		}
+
+		switch (state) {
+		case MQTT_S_GONE:
+			/* the publishes we did get are still good */
+			mqtt_batch_flush(mc);
+			mc->mc_state = state;
+			/* coalesced subscribes have nowhere to go now */
+			mc->mc_inputting = 0;
+			mqtt_subq_free(mc);
+			if (mc->mc_settings->mqtt_on_disconnect != NULL) {
+				(*mc->mc_settings->mqtt_on_disconnect)(mc);
+				return (-1);
+			}
+			mc->mc_dead_reason = MQTT_DEAD_DISCONNECT;
+			mc->mc_errstr = "disconnected";
+			/* FALLTHROUGH */
+		case MQTT_S_DEAD:
+			mqtt_batch_flush(mc);
+			mc->mc_inputting = 0;
+			mqtt_subq_free(mc);
+			if (mc->mc_dead_reason == MQTT_DEAD_NONE) {
+				mqtt_die(mc, MQTT_DEAD_INPUT, "bad input");
+				return (-1);
+			}
+			mc->mc_state = MQTT_S_DEAD;
+			(*mc->mc_settings->mqtt_dead)(mc);
+			return (-1);
+		case MQTT_S_IDLE:
+			/* the packet is either freed or the app's now */
+			if (mc->mc_incharge > 0) {
+				mqtt_rele(mc, mc->mc_incharge);
+				mc->mc_incharge = 0;
+			}
+			break;
+		default:
+			break;
+		}
+
+		buf += rem;
+		len -= rem;
+
+		mc->mc_state = state;
+	}
+
+	return (0);
+}
+
+static int
+mqtt_input_begin(struct mqtt_conn *mc)
+{
+	switch (mc->mc_state) {
+	case MQTT_S_GONE:
+	case MQTT_S_DEAD:
+		/* nothing more can be said on this connection */
+		return (-1);
+	default:
+		break;
+	}
+
+	mc->mc_inputting = mc->mc_settings->mqtt_coalesce_subscribe;
+
+	return (0);
+}
+
+static void
+mqtt_input_end(struct mqtt_conn *mc)
+{
+	/* subscribes from the batch callback can still be coalesced */
+	mqtt_batch_flush(mc);
+
+	mc->mc_inputting = 0;
+	if (mc->mc_nsubq > 0)
+		mqtt_subq_flush(mc);
+
+	/* a server expects to hear from the client every keepalive */
+	if (MQTT_SERVER(mc) && MQTT_KEEPALIVES(mc))
+		mqtt_timer_set(mc, MQTT_TMO_KEEPALIVE, &mc->mc_keepalive);
+
+	/* mqtt_liveness_timeout looks at this when it fires */
+	if (MQTT_LIVENESS(mc))
+		clock_gettime(CLOCK_MONOTONIC, &mc->mc_live_heard);
+}
+
+void
+mqtt_input(struct mqtt_conn *mc, const void *ptr, size_t len)
+{
+	MQTT_TRACE2(input__start, mc, len);
+
+	if (mqtt_input_begin(mc) == -1)
+		return;
+
+	if (mqtt_input_buf(mc, ptr, len) == 0)
+		mqtt_input_end(mc);
+
+	/* mc may be gone by now, so don't look inside it */
+	MQTT_TRACE1(input__done, mc);
+}
+
+/*
+ * parse a chain of buffers in one go, eg, the result of a readv(2)
+ * into several fixed size buffers. a packet may span any number of
+ * the buffers.
+ */
+void
+mqtt_inputv(struct mqtt_conn *mc, const struct iovec *iov, int iovcnt)
+{
+#ifdef MQTT_USDT
+	size_t len = 0;
+#endif
+	int i;
+
+#ifdef MQTT_USDT
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+#endif
+	MQTT_TRACE2(input__start, mc, len);
+
+	if (mqtt_input_begin(mc) == -1)
+		return;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (mqtt_input_buf(mc,
+		    iov[i].iov_base, iov[i].iov_len) == -1)
+			goto done;
+	}
+
+	mqtt_input_end(mc);
+done:
+	MQTT_TRACE1(input__done, mc);
+}
+
+static void
+mqtt_timer_arm(struct mqtt_conn *mc, const struct timespec *now,
+    const struct timespec *rel)
+{
+	const struct timespec *next = NULL;
+	struct timespec ts;
+	unsigned int i;
+
+	for (i = 0; i < MQTT_TMO_COUNT; i++) {
+		const struct timespec *dl = &mc->mc_deadlines[i];
+
+		if (!timespecisset(dl))
+			continue;
+		if (next == NULL || timespeccmp(dl, next, <))
+			next = dl;
+	}
+
+	if (next == NULL) {
+		/* there's no way to cancel a timeout, so let it fire */
+		timespecclear(&mc->mc_armed);
+		return;
+	}
+
+	if (timespeccmp(next, &mc->mc_armed, ==))
+		return;
+	mc->mc_armed = *next;
+
+	if (rel == NULL) {
+		if (timespeccmp(next, now, <=))
+			timespecclear(&ts);
+		else
+			timespecsub(next, now, &ts);
+		rel = &ts;
+	}
+
+	(*mc->mc_settings->mqtt_want_timeout)(mc, rel);
+}
+
+static void
+mqtt_timer_set(struct mqtt_conn *mc, enum mqtt_tmo tmo,
+    const struct timespec *rel)
+{
+	struct timespec now;
+	struct timespec *dl = &mc->mc_deadlines[tmo];
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecadd(&now, rel, dl);
+
+	for (i = 0; i < MQTT_TMO_COUNT; i++) {
+		if (i != tmo && timespecisset(&mc->mc_deadlines[i]) &&
+		    timespeccmp(&mc->mc_deadlines[i], dl, <))
+			break;
+	}
+
+	/* use rel as is if it's the earliest so the app sees it exactly */
+	mqtt_timer_arm(mc, &now, i == MQTT_TMO_COUNT ? rel : NULL);
+}
+
+static void
+mqtt_bucket_init(struct mqtt_bucket *b, uint64_t rate, uint64_t burst)
+{
+	b->b_rate = rate;
+	if (burst == 0)
+		burst = rate;
+	b->b_burst = burst * MQTT_NSEC;
+	b->b_tokens = b->b_burst;
+}
+
+static void
+mqtt_bucket_fill(struct mqtt_bucket *b, int64_t nsec)
+{
+	if (b->b_rate == 0)
+		return;
+
+	/* don't overflow on a long idle period */
+	if (nsec > b->b_burst / (int64_t)b->b_rate + 1) {
+		b->b_tokens = b->b_burst;
+		return;
+	}
+
+	b->b_tokens += nsec * (int64_t)b->b_rate;
+	if (b->b_tokens > b->b_burst)
+		b->b_tokens = b->b_burst;
+}
+
+/* how long until there are tokens for n units */
+static int64_t
+mqtt_bucket_wait(const struct mqtt_bucket *b, int64_t need)
+{
+	int64_t deficit;
+
+	if (b->b_rate == 0)
+		return (0);
+
+	deficit = need - b->b_tokens;
+	if (deficit <= 0)
+		return (0);
+
+	return ((deficit + (int64_t)b->b_rate - 1) / (int64_t)b->b_rate);
+}
+
+/*
+ * pace messages per second and bytes per second. a rate of 0 isn't
+ * limited, and a burst of 0 allows a second worth of the rate to go
+ * in one go. both rates of 0 turn pacing off.
+ */
+int
+mqtt_set_pacing(struct mqtt_conn *mc, unsigned int msgs, unsigned int msgs_burst,
+    size_t bytes, size_t bytes_burst)
+{
+	/* keep the token maths inside an int64_t */
+	if (bytes_burst > INT64_MAX / MQTT_NSEC ||
+	    (bytes_burst == 0 && bytes > INT64_MAX / MQTT_NSEC))
+		return (-1);
+
+	mqtt_bucket_init(&mc->mc_pace_msgs, msgs, msgs_burst);
+	mqtt_bucket_init(&mc->mc_pace_bytes, bytes, bytes_burst);
+	clock_gettime(CLOCK_MONOTONIC, &mc->mc_pace_last);
+
+	mc->mc_pacing = (msgs > 0 || bytes > 0);
+	if (!mc->mc_pacing) {
+		timespecclear(&mc->mc_deadlines[MQTT_TMO_PACE]);
+		mqtt_output(mc);
+	}
+
+	return (0);
+}
+
+/*
+ * take the tokens for a publish, or schedule a timeout for when
+ * there will be enough. a message bigger than the byte burst is let
+ * through once the bucket is full, which leaves the bucket in debt
+ * for the excess.
+ */
+static int
+mqtt_pace(struct mqtt_conn *mc, const struct mqtt_message *mm)
+{
+	struct mqtt_bucket *bm = &mc->mc_pace_msgs;
+	struct mqtt_bucket *bb = &mc->mc_pace_bytes;
+	struct timespec now, diff, rel;
+	int64_t len, need, wait, bwait;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &mc->mc_pace_last, &diff);
+	mc->mc_pace_last = now;
+	mqtt_bucket_fill(bm, diff.tv_sec * MQTT_NSEC + diff.tv_nsec);
+	mqtt_bucket_fill(bb, diff.tv_sec * MQTT_NSEC + diff.tv_nsec);
+
+	len = (int64_t)((mm->mm_len - mm->mm_off) + mm->mm_fdlen) * MQTT_NSEC;
+	need = len < bb->b_burst ? len : bb->b_burst;
+
+	wait = mqtt_bucket_wait(bm, MQTT_NSEC);
+	bwait = mqtt_bucket_wait(bb, need);
+	if (bwait > wait)
+		wait = bwait;
+
+	if (wait > 0) {
+		if (!timespecisset(&mc->mc_deadlines[MQTT_TMO_PACE])) {
+			rel.tv_sec = wait / MQTT_NSEC;
+			rel.tv_nsec = wait % MQTT_NSEC;
+			MQTT_TRACE2(paced, mc, wait);
+			mqtt_timer_set(mc, MQTT_TMO_PACE, &rel);
+		}
+		return (-1);
+	}
+
+	if (bm->b_rate > 0)
+		bm->b_tokens -= MQTT_NSEC;
+	if (bb->b_rate > 0)
+		bb->b_tokens -= len;
+
+	return (0);
+}
+
+static struct mqtt_message *
+mqtt_output_next(struct mqtt_conn *mc, int held)
+{
+	struct mqtt_message *mm;
+	int i;
+
+	/* don't interleave another packet with a partially written one */
+	if (mc->mc_output != NULL)
+		return (mc->mc_output);
+
+	if (held) {
+		/*
+		 * publishes can be put in the control class, but only
+		 * packets that aren't publishes get past a paced one.
+		 * the other classes only have publishes in them.
+		 */
+		TAILQ_FOREACH(mm, &mc->mc_messages[MQTT_PRIO_CONTROL],
+		    mm_entry) {
+			if (mm->mm_type != MQTT_T_PUBLISH)
+				return (mm);
+		}
+
+		return (NULL);
+	}
+
+	for (i = 0; i < MQTT_NPRIO; i++) {
+		mm = TAILQ_FIRST(&mc->mc_messages[i]);
+		if (mm != NULL)
+			return (mm);
+	}
+
+	return (NULL);
+}
+
+static void
+mqtt_output_queue(struct mqtt_conn *mc)
+{
+	const struct mqtt_settings *ms = mc->mc_settings;
+	struct mqtt_message *mm;
+	ssize_t rv;
+	int held = 0;
+
+	while ((mm = mqtt_output_next(mc, held)) != NULL) {
+		/*
+		 * once a publish is paced every publish after it has to
+		 * wait too, but acks and PINGREQs can still go around it.
+		 */
+		if (mc->mc_pacing && mm->mm_type == MQTT_T_PUBLISH &&
+		    mm != mc->mc_output && mqtt_pace(mc, mm) == -1) {
+			held = 1;
+			continue;
+		}
+
+		if (mm->mm_off < mm->mm_len) {
+			rv = (*ms->mqtt_output)(mc,
+			    mm->mm_buf + mm->mm_off, mm->mm_len - mm->mm_off);
+			MQTT_TRACE4(output, mc, mm->mm_type,
+			    mm->mm_len - mm->mm_off, rv);
+			if (rv == -1)
+				return;
+			if (rv > 0)
+				mc->mc_output = mm;
+
+			mm->mm_off += rv;
+			mc->mc_queued -= rv;
+			if (mm->mm_off < mm->mm_len) {
+				(*ms->mqtt_want_output)(mc);
+				return;
+			}
+		}
+
+		if (mm->mm_fdlen > 0) {
+			rv = (*ms->mqtt_output_fd)(mc,
+			    mm->mm_fd, mm->mm_fdoff, mm->mm_fdlen);
+			MQTT_TRACE4(output__fd, mc, mm->mm_type,
+			    mm->mm_fdlen, rv);
+			if (rv == -1)
+				return;
+			if (rv > 0)
+				mc->mc_output = mm;
+
+			mm->mm_fdoff += rv;
+			mm->mm_fdlen -= rv;
+			mc->mc_queued -= rv;
+			if (mm->mm_fdlen > 0) {
+				(*ms->mqtt_want_output)(mc);
+				return;
+			}
+		}
+
+		mc->mc_output = NULL;
+		TAILQ_REMOVE(&mc->mc_messages[mm->mm_prio], mm, mm_entry);
+		if (mc->mc_lathist != NULL)
+			mqtt_lathist_add(mc, mm);
+		mqtt_rele(mc, mm->mm_len);
+		free(mm->mm_buf);
+		mm->mm_buf = NULL;
+		if (mm->mm_fd != -1) {
+			close(mm->mm_fd);
+			mm->mm_fd = -1;
+		}
+		if (mm->mm_id == -1)
+			mqtt_message_free(mc, mm);
+		else
+			TAILQ_INSERT_TAIL(&mc->mc_pending, mm, mm_entry);
+	}
+
+	if (!MQTT_SERVER(mc) && MQTT_KEEPALIVES(mc))
+		mqtt_timer_set(mc, MQTT_TMO_KEEPALIVE, &mc->mc_keepalive);
+}
+
+void
+mqtt_output(struct mqtt_conn *mc)
+{
+	const struct mqtt_settings *ms = mc->mc_settings;
+
+	mqtt_output_queue(mc);
+
+	/* this is outside the queue walk so on_drain can publish */
+	if (mc->mc_blocked && mc->mc_queued <= ms->mqtt_output_lowat) {
+		mc->mc_blocked = 0;
+		if (ms->mqtt_on_drain != NULL)
+			(*ms->mqtt_on_drain)(mc);
+	}
+}
+
+/*
+ * stateless packet encoders
+ */
+
+/* the length of a packet with len bytes after the fixed header */
+static size_t
+mqtt_packet_len(size_t len)
+{
+	size_t rv = sizeof(uint8_t) + len;
+
+	do {
+		len >>= 7;
+		rv++;
+	} while (len);
+
+	return (rv);
+}
+
+static int
+mqtt_retain_flags(enum mqtt_retain retain, uint8_t *flags)
+{
+	switch (retain) {
+	case MQTT_RETAIN:
+		*flags |= (1 << 0);
+		/* FALLTHROUGH */
+	case MQTT_NORETAIN:
+		break;
+	default:
+		return (-1);
+	}
+
+	return (0);
+}
+
+ssize_t
+mqtt_encode_connect(void *buf, size_t buflen,
+    const struct mqtt_conn_settings *mcs)
+{
+	uint8_t *p = buf;
+	struct mqtt_p_connect *pc;
+	size_t len = sizeof(*pc);
+	size_t plen;
+	uint8_t flags = 0;
+
+	if (mcs->keep_alive > 0xffff)
+		return (-1);
+
+	if (mcs->clean_session)
+		flags |= MQTT_CONNECT_F_CLEAN_SESSION;
+
+	if (mcs->clientid_len > MQTT_MAX_LEN)
+		return (-1);
+	len += sizeof(struct mqtt_u16) + mcs->clientid_len;
+
+	if (mcs->will_topic != NULL) {
+		if (mcs->will_topic_len > MQTT_MAX_TOPIC)
+			return (-1);
+		len += sizeof(struct mqtt_u16) + mcs->will_topic_len;
+
+		if (mcs->will_payload_len > MQTT_MAX_LEN)
+			return (-1);
+		len += sizeof(struct mqtt_u16) + mcs->will_payload_len;
+
+		flags |= MQTT_CONNECT_F_WILL;
+		flags |= MQTT_CONNECT_F_WILL_QOS(mcs->will_qos);
+		if (mcs->will_retain)
+			flags |= MQTT_CONNECT_F_WILL_RETAIN;
+	}
+
+	if (mcs->username != NULL) {
+		if (mcs->username_len > MQTT_MAX_LEN)
+			return (-1);
+
+		len += sizeof(struct mqtt_u16) + mcs->username_len;
+		flags |= MQTT_CONNECT_F_USERNAME;
+
+		if (mcs->password != NULL) {
+			if (mcs->password_len > MQTT_MAX_LEN)
+				return (-1);
+
+			len += sizeof(struct mqtt_u16) + mcs->password_len;
+			flags |= MQTT_CONNECT_F_PASSWORD;
+		}
+	}
+
+	if (len > MQTT_MAX_REMLEN)
+		return (-1);
+
+	plen = mqtt_packet_len(len);
+	if (plen > buflen)
+		return (plen);
+
+	p += mqtt_header_set(p, MQTT_T_CONNECT, 0, len);
+
+	pc = (struct mqtt_p_connect *)p;
+	mqtt_u16(&pc->len, sizeof(pc->mqtt));
+	pc->mqtt[0] = 'M';
+	pc->mqtt[1] = 'Q';
+	pc->mqtt[2] = 'T';
+	pc->mqtt[3] = 'T';
+	pc->level = 0x4;
+	pc->flags = flags;
+	mqtt_u16(&pc->keep_alive, mcs->keep_alive);
+
+	p += sizeof(*pc);
+
+	p += mqtt_lenstr(p, mcs->clientid_len, mcs->clientid);
+	if (mcs->will_topic != NULL) {
+		p += mqtt_lenstr(p,
+		    mcs->will_topic_len, mcs->will_topic);
+		p += mqtt_lenstr(p,
+		    mcs->will_payload_len, mcs->will_payload);
+	}
+	if (mcs->username != NULL) {
+		p += mqtt_lenstr(p,
+		    mcs->username_len, mcs->username);
+		if (mcs->password != NULL) {
+			p += mqtt_lenstr(p,
+			    mcs->password_len, mcs->password);
+		}
+	}
+
+	return (plen);
+}
+
+/* pid is only encoded for QOS1 and QOS2 */
+ssize_t
+mqtt_encode_publish(void *buf, size_t buflen,
+    const char *topic, size_t topic_len,
+    const void *payload, size_t payload_len,
+    enum mqtt_qos qos, enum mqtt_retain retain, unsigned int pid)
+{
+	uint8_t *p = buf;
+	size_t len = 0;
+	size_t plen;
+	uint8_t flags = 0;
+
+	if (mqtt_retain_flags(retain, &flags) == -1)
+		return (-1);
+
+	switch (qos) {
+	case MQTT_QOS0:
+		break;
+	case MQTT_QOS1:
+	case MQTT_QOS2:
+		if (pid > 0xffff)
+			return (-1);
+		len += sizeof(struct mqtt_u16);
+		break;
+	default:
+		return (-1);
+	}
+	if (qos > MQTT_MAX_QOS)
+		return (-1);
+	flags |= qos << 1;
+
+	if (topic_len > MQTT_MAX_TOPIC)
+		return (-1);
+	len += sizeof(struct mqtt_u16) + topic_len;
+
+	if (payload_len > MQTT_MAX_REMLEN - len)
+		return (-1);
+	len += payload_len;
+
+	plen = mqtt_packet_len(len);
+	if (plen > buflen)
+		return (plen);
+
+	p += mqtt_header_set(p, MQTT_T_PUBLISH, flags, len);
+	p += mqtt_lenstr(p, topic_len, topic);
+	if (qos != MQTT_QOS0)
+		p += mqtt_u16(p, pid);
+	memcpy(p, payload, payload_len);
+
+	return (plen);
+}
+
+static size_t		mqtt_filter_len(int, const struct mqtt_topic *);
+static int		mqtt_filters_check(int, const struct mqtt_topic *,
+			    size_t);
+
+static ssize_t
+mqtt_encode_filters(void *buf, size_t buflen, int type, unsigned int pid,
+    const struct mqtt_topic *topics, size_t ntopics)
+{
+	uint8_t *p = buf;
+	size_t len = sizeof(struct mqtt_u16); /* pid */
+	size_t plen, i;
+
+	if (pid > 0xffff)
+		return (-1);
+	if (mqtt_filters_check(type, topics, ntopics) == -1)
+		return (-1);
+
+	for (i = 0; i < ntopics; i++) {
+		len += mqtt_filter_len(type, &topics[i]);
+		if (len > MQTT_MAX_REMLEN)
+			return (-1);
+	}
+
+	plen = mqtt_packet_len(len);
+	if (plen > buflen)
+		return (plen);
+
+	p += mqtt_header_set(p, type, 0x2 /* wat */, len);
+	p += mqtt_u16(p, pid);
+
+	for (i = 0; i < ntopics; i++) {
+		const struct mqtt_topic *t = &topics[i];
+
+		p += mqtt_lenstr(p, t->len, t->filter);
+		if (type == MQTT_T_SUBSCRIBE)
+			*p++ = t->qos;
+	}
+
+	return (plen);
+}
+
+ssize_t
+mqtt_encode_subscribe(void *buf, size_t buflen, unsigned int pid,
+    const struct mqtt_topic *topics, size_t ntopics)
+{
+	return (mqtt_encode_filters(buf, buflen, MQTT_T_SUBSCRIBE, pid,
+	    topics, ntopics));
+}
+
+ssize_t
+mqtt_encode_unsubscribe(void *buf, size_t buflen, unsigned int pid,
+    const struct mqtt_topic *topics, size_t ntopics)
+{
+	return (mqtt_encode_filters(buf, buflen, MQTT_T_UNSUBSCRIBE, pid,
+	    topics, ntopics));
+}
+
+static ssize_t
+mqtt_encode_empty(void *buf, size_t buflen, uint8_t type)
+{
+	size_t plen = mqtt_packet_len(0);
+
+	if (plen <= buflen)
+		mqtt_header_set(buf, type, 0x0, 0);
+
+	return (plen);
+}
+
+ssize_t
+mqtt_encode_pingreq(void *buf, size_t buflen)
+{
+	return (mqtt_encode_empty(buf, buflen, MQTT_T_PINGREQ));
+}
+
+ssize_t
+mqtt_encode_pingresp(void *buf, size_t buflen)
+{
+	return (mqtt_encode_empty(buf, buflen, MQTT_T_PINGRESP));
+}
+
+ssize_t
+mqtt_encode_disconnect(void *buf, size_t buflen)
+{
+	return (mqtt_encode_empty(buf, buflen, MQTT_T_DISCONNECT));
+}
+
+ssize_t
+mqtt_encode_connack(void *buf, size_t buflen, int session_present,
+    enum mqtt_connack_code code)
+{
+	uint8_t *p = buf;
+	struct mqtt_p_connack *pc;
+	size_t plen = mqtt_packet_len(sizeof(*pc));
+
+	if (plen > buflen)
+		return (plen);
+
+	p += mqtt_header_set(p, MQTT_T_CONNACK, 0x0, sizeof(*pc));
+	pc = (struct mqtt_p_connack *)p;
+	pc->flags = (session_present && code == MQTT_CONN_ACCEPTED) ?
+	    MQTT_CONNACK_F_SP : 0;
+	pc->code = code;
+
+	return (plen);
+}
+
+ssize_t
+mqtt_encode_suback(void *buf, size_t buflen, unsigned int pid,
+    const uint8_t *rcodes, size_t nrcodes)
+{
+	uint8_t *p = buf;
+	size_t len = 0;
+	size_t plen;
+
+	if (pid > 0xffff || nrcodes == 0)
+		return (-1);
+
+	len += sizeof(struct mqtt_u16); /* pid */
+	if (nrcodes > MQTT_MAX_REMLEN - len)
+		return (-1);
+	len += nrcodes;
+
+	plen = mqtt_packet_len(len);
+	if (plen > buflen)
+		return (plen);
+
+	p += mqtt_header_set(p, MQTT_T_SUBACK, 0x0, len);
+	p += mqtt_u16(p, pid);
+	memcpy(p, rcodes, nrcodes);
+
+	return (plen);
+}
+
+ssize_t
+mqtt_encode_unsuback(void *buf, size_t buflen, unsigned int pid)
+{
+	uint8_t *p = buf;
+	size_t len = sizeof(struct mqtt_u16); /* pid */
+	size_t plen;
+
+	if (pid > 0xffff)
+		return (-1);
+
+	plen = mqtt_packet_len(len);
+	if (plen > buflen)
+		return (plen);
+
+	p += mqtt_header_set(p, MQTT_T_UNSUBACK, 0x0, len);
+	mqtt_u16(p, pid);
+
+	return (plen);
+}
+
+int
+mqtt_connect(struct mqtt_conn *mc, const struct mqtt_conn_settings *mcs)
+{
+	uint8_t *msg;
+	ssize_t len;
+
+	if (MQTT_SERVER(mc))
+		return (-1);
+
+	len = mqtt_encode_connect(NULL, 0, mcs);
+	if (len == -1)
+		return (-1);
+
+	msg = malloc(len);
+	if (msg == NULL)
+		return (-1);
+
+	mqtt_encode_connect(msg, len, mcs);
+	mc->mc_keepalive.tv_sec = mcs->keep_alive;
+
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue(mc, NULL, MQTT_T_CONNECT, -1, msg, len) == -1) {
+		free(msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+void
+mqtt_disconnect(struct mqtt_conn *mc)
+{
+
+}
+
+#ifndef MQTT_NO_PUBLISH
+static int
+mqtt_publish_encoded(struct mqtt_conn *mc, const struct mqtt_codec_ent *mce,
+    uint8_t flags, const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len)
+{
+	const struct mqtt_codec *mcd = mce->mce_codec;
+	uint8_t hdr[sizeof(struct mqtt_header)];
+	uint8_t *msg, *buf;
+	size_t len = 0;
+	size_t bound, hlen, off;
+	ssize_t rv;
+
+	len += sizeof(struct mqtt_u16) + topic_len;
+
+	bound = (*mcd->bound)(mce->mce_ctx, payload_len);
+	if (bound > MQTT_MAX_REMLEN - len)
+		return (-1);
+
+	/*
+	 * the length of the header depends on the encoded length of
+	 * the payload, so leave room for the biggest one and put it in
+	 * front of the body afterwards.
+	 */
+	msg = malloc(sizeof(hdr) + len + bound);
+	if (msg == NULL)
+		return (-1);
+
+	buf = msg + sizeof(hdr);
+	buf += mqtt_lenstr(buf, topic_len, topic);
+
+	rv = (*mcd->encode)(mce->mce_ctx, buf, bound, payload, payload_len);
+	if (rv < 0 || (size_t)rv > bound) {
+		free(msg);
+		return (-1);
+	}
+	len += rv;
+
+	hlen = mqtt_header_set(hdr, MQTT_T_PUBLISH, flags, len);
+	off = sizeof(hdr) - hlen;
+	memcpy(msg + off, hdr, hlen);
+
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue_fd(mc, NULL, MQTT_T_PUBLISH, -1,
+	    msg, off, sizeof(hdr) + len, -1, 0, 0) == NULL) {
+		free(msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+mqtt_publish(struct mqtt_conn *mc,
+    const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len,
+    enum mqtt_qos qos, enum mqtt_retain retain)
+{
+	uint8_t *msg;
+	ssize_t len;
+
+	if (mqtt_wouldblock(mc))
+		return (MQTT_WOULDBLOCK);
+
+	if (qos != MQTT_QOS0)
+		return (-1); /* XXX */
+
+	if (mc->mc_ncodecs > 0) {
+		const struct mqtt_codec_ent *mce;
+		uint8_t flags = 0;
+
+		if (mqtt_retain_flags(retain, &flags) == -1 ||
+		    topic_len > MQTT_MAX_TOPIC)
+			return (-1);
+
+		mce = mqtt_codec_lookup(mc, topic, topic_len);
+		if (mce != NULL) {
+			return (mqtt_publish_encoded(mc, mce, flags,
+			    topic, topic_len, payload, payload_len));
+		}
+	}
+
+	len = mqtt_encode_publish(NULL, 0, topic, topic_len,
+	    payload, payload_len, qos, retain, 0);
+	if (len == -1)
+		return (-1);
+
+	msg = malloc(len);
+	if (msg == NULL)
+		return (-1);
+
+	mqtt_encode_publish(msg, len, topic, topic_len,
+	    payload, payload_len, qos, retain, 0);
+
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue(mc, NULL, MQTT_T_PUBLISH, -1, msg, len) == -1) {
+		free(msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * publish a payload that lives in a file. only the header and topic
+ * are built in memory, the payload is handed to the mqtt_output_fd
+ * callback so the transport can use sendfile(2) or splice(2) to move
+ * it. on success the connection takes ownership of fd and closes it
+ * once the payload has been written.
+ */
+int
+mqtt_publish_fd(struct mqtt_conn *mc,
+    const char *topic, size_t topic_len,
+    int fd, off_t offset, size_t payload_len,
+    enum mqtt_qos qos, enum mqtt_retain retain)
+{
+	uint8_t *msg, *buf;
+	size_t len = 0;
+	size_t hlen;
+	uint8_t flags = 0;
+
+	if (mc->mc_settings->mqtt_output_fd == NULL)
+		return (-1);
+	if (fd < 0 || offset < 0)
+		return (-1);
+
+	if (mqtt_wouldblock(mc))
+		return (MQTT_WOULDBLOCK);
+
+	if (mqtt_retain_flags(retain, &flags) == -1)
+		return (-1);
+
+	flags |= qos << 1;
+
+	if (topic_len > MQTT_MAX_TOPIC)
+		return (-1);
+	len += sizeof(struct mqtt_u16) + topic_len;
+
+	if (qos != MQTT_QOS0)
+		return (-1); /* XXX */
+
+	if (payload_len > MQTT_MAX_REMLEN - len)
+		return (-1);
+
+	msg = malloc(sizeof(struct mqtt_header) + len);
+	if (msg == NULL)
+		return (-1);
+
+	hlen = mqtt_header_set(msg, MQTT_T_PUBLISH, flags, len + payload_len);
+	buf = msg + hlen;
+
+	mqtt_lenstr(buf, topic_len, topic);
+
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue_fd(mc, NULL, MQTT_T_PUBLISH, -1,
+	    msg, 0, hlen + len, fd, offset, payload_len) == NULL) {
+		free(msg);
+		return (-1);
+	}
+
+	return (0);
+}
+#else /* MQTT_NO_PUBLISH */
+int
+mqtt_publish(struct mqtt_conn *mc,
+    const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len,
+    enum mqtt_qos qos, enum mqtt_retain retain)
+{
+	return (-1);
+}
+
+int
+mqtt_publish_fd(struct mqtt_conn *mc,
+    const char *topic, size_t topic_len,
+    int fd, off_t offset, size_t payload_len,
+    enum mqtt_qos qos, enum mqtt_retain retain)
+{
+	return (-1);
+}
+#endif /* MQTT_NO_PUBLISH */
+
+struct mqtt_publish_template {
+	uint8_t		 mpt_flags;
+	size_t		 mpt_len;
+	uint8_t		 mpt_topic[];	/* u16 length followed by the topic */
+};
+
+struct mqtt_publish_template *
+mqtt_publish_template_create(const char *topic, size_t topic_len,
+    enum mqtt_qos qos, enum mqtt_retain retain)
+{
+	struct mqtt_publish_template *mpt;
+	uint8_t flags = 0;
+	size_t len = 0;
+
+	if (mqtt_retain_flags(retain, &flags) == -1)
+		return (NULL);
+
+	if (qos != MQTT_QOS0)
+		return (NULL); /* XXX */
+	flags |= qos << 1;
+
+	if (topic_len > MQTT_MAX_TOPIC)
+		return (NULL);
+	len += sizeof(struct mqtt_u16) + topic_len;
+
+	mpt = malloc(sizeof(*mpt) + len);
+	if (mpt == NULL)
+		return (NULL);
+
+	mpt->mpt_flags = flags;
+	mpt->mpt_len = mqtt_lenstr(mpt->mpt_topic, topic_len, topic);
+
+	return (mpt);
+}
+
+void
+mqtt_publish_template_destroy(struct mqtt_publish_template *mpt)
+{
+	free(mpt);
+}
+
+/*
+ * write the fixed header and topic for a publish of payload_len bytes
+ * into buf so it can be sent ahead of the payload with writev(2) or
+ * similar. returns the length of the header, which is only written if
+ * it fits in buflen.
+ */
+ssize_t
+mqtt_publish_template_header(const struct mqtt_publish_template *mpt,
+    void *buf, size_t buflen, size_t payload_len)
+{
+	uint8_t hdr[sizeof(struct mqtt_header)];
+	size_t len = mpt->mpt_len;
+	size_t hlen;
+
+	if (payload_len > MQTT_MAX_REMLEN - len)
+		return (-1);
+	len += payload_len;
+
+	hlen = mqtt_header_set(hdr, MQTT_T_PUBLISH, mpt->mpt_flags, len);
+	if (hlen + mpt->mpt_len <= buflen) {
+		memcpy(buf, hdr, hlen);
+		memcpy((uint8_t *)buf + hlen, mpt->mpt_topic, mpt->mpt_len);
+	}
+
+	return (hlen + mpt->mpt_len);
+}
+
+int
+mqtt_publish_template_send(struct mqtt_conn *mc,
+    const struct mqtt_publish_template *mpt,
+    const char *payload, size_t payload_len)
+{
+#ifdef MQTT_NO_PUBLISH
+	return (-1);
+#else
+	uint8_t *msg, *buf;
+	size_t len = mpt->mpt_len;
+	size_t hlen;
+
+	if (mqtt_wouldblock(mc))
+		return (MQTT_WOULDBLOCK);
+
+	if (payload_len > MQTT_MAX_REMLEN - len)
+		return (-1);
+	len += payload_len;
+
+	msg = malloc(sizeof(struct mqtt_header) + len);
+	if (msg == NULL)
+		return (-1);
+
+	hlen = mqtt_header_set(msg, MQTT_T_PUBLISH, mpt->mpt_flags, len);
+	buf = msg + hlen;
+
+	memcpy(buf, mpt->mpt_topic, mpt->mpt_len);
+	buf += mpt->mpt_len;
+	memcpy(buf, payload, payload_len);
+
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue(mc, NULL, MQTT_T_PUBLISH, -1,
+	    msg, hlen + len) == -1) {
+		free(msg);
+		return (-1);
+	}
+
+	return (0);
+#endif
+}
+
+static size_t
+mqtt_filter_len(int type, const struct mqtt_topic *t)
+{
+	size_t len = sizeof(struct mqtt_u16) + t->len;
+
+	if (type == MQTT_T_SUBSCRIBE)
+		len += sizeof(uint8_t); /* requested qos */
+
+	return (len);
+}
+
+static int
+mqtt_filters_check(int type, const struct mqtt_topic *topics, size_t n)
+{
+	const struct mqtt_topic *t;
+	size_t i;
+
+	if (n == 0)
+		return (-1);
+
+	for (i = 0; i < n; i++) {
+		t = &topics[i];
+
+		if (t->len == 0 || t->len > MQTT_MAX_TOPIC)
+			return (-1);
+
+		if (type == MQTT_T_SUBSCRIBE) {
+			switch (t->qos) {
+			case MQTT_QOS0:
+			case MQTT_QOS1:
+			case MQTT_QOS2:
+				break;
+			default:
+				return (-1);
+			}
+
+			/* the broker would send publishes we can't parse */
+			if (t->qos > MQTT_MAX_QOS)
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+#ifndef MQTT_NO_SUBSCRIBE
+/*
+ * pack the filters into as few packets as will fit. the return codes
+ * for subscribe filters that couldn't be sent are reported as
+ * failures. an unsuback can't say that, so if an unsubscribe only
+ * partly went out this fails and the cookie is never called back.
+ */
+static int
+mqtt_filters_enqueue(struct mqtt_conn *mc, struct mqtt_subgrp *sg,
+    const struct mqtt_topic *topics, size_t ntopics)
+{
+	struct mqtt_message *mm;
+	uint8_t *msg;
+	int type = sg->sg_type;
+	size_t i, j;
+	size_t len, flen, plen;
+	int pid;
+	int rv = 0;
+
+	/* hold a ref while the packets are going out */
+	sg->sg_npkts = 1;
+
+	for (i = 0; i < ntopics; i = j) {
+		len = sizeof(struct mqtt_u16); /* pid */
+		for (j = i; j < ntopics; j++) {
+			flen = mqtt_filter_len(type, &topics[j]);
+			if (len + flen > MQTT_MAX_REMLEN)
+				break;
+			len += flen;
+		}
+
+		plen = mqtt_packet_len(len);
+		msg = malloc(plen);
+		if (msg == NULL)
+			break;
+
+		pid = mqtt_id(mc);
+		mqtt_encode_filters(msg, plen, type, pid, topics + i, j - i);
+
+		/*
+		 * mqtt_output can write the packet and read the ack before
+		 * mqtt_enqueue_fd would return, so the group is attached
+		 * between allocating the message and pushing it out.
+		 */
+		mm = mqtt_message_alloc(mc, NULL, type, pid,
+		    msg, 0, plen, -1, 0, 0);
+		if (mm == NULL) {
+			free(msg);
+			break;
+		}
+		mm->mm_grp = sg;
+		mm->mm_grp_off = i;
+		mm->mm_grp_n = j - i;
+		sg->sg_npkts++;
+
+		mqtt_message_push(mc, mm);
+	}
+
+	if (i == 0) {
+		/* nothing went out */
+		free(sg);
+		return (-1);
+	}
+
+	if (i < ntopics && type == MQTT_T_UNSUBSCRIBE) {
+		/* let the acks for what did go out pass silently */
+		sg->sg_nreqs = 0;
+		rv = -1;
+	}
+
+	/* the acks can all come back before mqtt_message_push returns */
+	if (sg->sg_npkts == 1)
+		mqtt_subgrp_done(mc, sg);
+
+	mqtt_subgrp_rele(sg);
+	return (rv);
+}
+
+static struct mqtt_subgrp *
+mqtt_subgrp_alloc(int type, size_t nreqs, size_t ntopics)
+{
+	struct mqtt_subgrp *sg;
+
+	sg = malloc(sizeof(*sg) + nreqs * sizeof(sg->sg_reqs[0]) + ntopics);
+	if (sg == NULL)
+		return (NULL);
+
+	sg->sg_type = type;
+	sg->sg_npkts = 0;
+	sg->sg_nreqs = nreqs;
+	sg->sg_rcodes = (uint8_t *)&sg->sg_reqs[nreqs];
+	memset(sg->sg_rcodes, MQTT_SUBACK_FAILURE, ntopics);
+
+	return (sg);
+}
+
+static int
+mqtt_filtersv(struct mqtt_conn *mc, int type, void *cookie,
+    const struct mqtt_topic *topics, int ntopics)
+{
+	struct mqtt_subgrp *sg;
+
+	if (MQTT_SERVER(mc))
+		return (-1);
+	if (ntopics < 1 || mqtt_filters_check(type, topics, ntopics) == -1)
+		return (-1);
+
+	/* keep coalesced subscribes in order with everything else */
+	if (mc->mc_nsubq > 0)
+		mqtt_subq_flush(mc);
+
+	sg = mqtt_subgrp_alloc(type, 1, ntopics);
+	if (sg == NULL)
+		return (-1);
+
+	sg->sg_reqs[0].sr_cookie = cookie;
+	sg->sg_reqs[0].sr_off = 0;
+	sg->sg_reqs[0].sr_n = ntopics;
+
+	return (mqtt_filters_enqueue(mc, sg, topics, ntopics));
+}
+
+int
+mqtt_subscribev(struct mqtt_conn *mc, void *cookie,
+    const struct mqtt_topic *topics, int ntopics)
+{
+	return (mqtt_filtersv(mc, MQTT_T_SUBSCRIBE, cookie, topics, ntopics));
+}
+
+int
+mqtt_unsubscribev(struct mqtt_conn *mc, void *cookie,
+    const struct mqtt_topic *topics, int ntopics)
+{
+	return (mqtt_filtersv(mc, MQTT_T_UNSUBSCRIBE, cookie, topics, ntopics));
+}
+
+/*
+ * send the subscribes coalesced by mqtt_subscribe as a group where
+ * each call gets its own return code back via its own cookie.
+ */
+static void
+mqtt_subq_flush(struct mqtt_conn *mc)
+{
+	const struct mqtt_settings *ms = mc->mc_settings;
+	struct mqtt_subgrp *sg;
+	struct mqtt_topic *subq = mc->mc_subq;
+	void **cookies = mc->mc_subq_cookies;
+	uint8_t rcode = MQTT_SUBACK_FAILURE;
+	size_t n = mc->mc_nsubq;
+	size_t i;
+
+	/* mqtt_enqueue_fd calls this, so make sure it won't recurse */
+	mc->mc_nsubq = 0;
+
+	sg = mqtt_subgrp_alloc(MQTT_T_SUBSCRIBE, n, n);
+	if (sg != NULL) {
+		for (i = 0; i < n; i++) {
+			sg->sg_reqs[i].sr_cookie = cookies[i];
+			sg->sg_reqs[i].sr_off = i;
+			sg->sg_reqs[i].sr_n = 1;
+		}
+
+		if (mqtt_filters_enqueue(mc, sg, subq, n) == 0) {
+			mc->mc_nsubq = n;
+			mqtt_subq_free(mc);
+			return;
+		}
+	}
+
+	/*
+	 * mqtt_subscribe already said yes to these, so the failure is
+	 * reported the same way a refusal from the server would be. the
+	 * queue comes off the connection first so mqtt_on_suback can
+	 * subscribe again.
+	 */
+	mc->mc_subq = NULL;
+	mc->mc_subq_cookies = NULL;
+	mc->mc_subq_cap = 0;
+
+	for (i = 0; i < n; i++) {
+		free((char *)subq[i].filter);
+		(*ms->mqtt_on_suback)(mc, cookies[i], &rcode, 1);
+	}
+
+	free(subq);
+	free(cookies);
+}
+
+static int
+mqtt_subq_add(struct mqtt_conn *mc, void *cookie,
+    const char *filter, size_t filter_len, enum mqtt_qos qos)
+{
+	struct mqtt_topic check = { filter, filter_len, qos };
+	struct mqtt_topic *t;
+	void **cookies;
+	char *f;
+	size_t n = mc->mc_nsubq;
+
+	if (mqtt_filters_check(MQTT_T_SUBSCRIBE, &check, 1) == -1)
+		return (-1);
+
+	if (n == mc->mc_subq_cap) {
+		size_t cap = n ? n * 2 : 8;
+
+		t = reallocarray(mc->mc_subq, cap, sizeof(*t));
+		if (t == NULL)
+			return (-1);
+		mc->mc_subq = t;
+
+		cookies = reallocarray(mc->mc_subq_cookies,
+		    cap, sizeof(*cookies));
+		if (cookies == NULL)
+			return (-1);
+		mc->mc_subq_cookies = cookies;
+
+		mc->mc_subq_cap = cap;
+	}
+
+	f = malloc(filter_len);
+	if (f == NULL)
+		return (-1);
+	memcpy(f, filter, filter_len);
 
-		mc->mc_state = state;
-	} while (len > 0);
+	t = &mc->mc_subq[n];
+	t->filter = f;
+	t->len = filter_len;
+	t->qos = qos;
+	mc->mc_subq_cookies[n] = cookie;
+	mc->mc_nsubq = n + 1;
+
+	return (0);
 }
 
-void
-mqtt_output(struct mqtt_conn *mc)
+static int
+mqtt_filter(struct mqtt_conn *mc, int type, void *cookie,
+    const struct mqtt_topic *t)
 {
-	struct mqtt_message *mm = TAILQ_FIRST(&mc->mc_messages);
-	ssize_t rv;
+	uint8_t *msg;
+	ssize_t len;
+	int pid;
 
-	do {
-		rv = (*mc->mc_settings->mqtt_output)(mc,
-		    mm->mm_buf + mm->mm_off, mm->mm_len - mm->mm_off);
-		if (rv == -1)
-			return;
+	len = mqtt_encode_filters(NULL, 0, type, 0, t, 1);
+	if (len == -1)
+		return (-1);
 
-		mm->mm_off += rv;
-		if (mm->mm_off < mm->mm_len) {
-			(*mc->mc_settings->mqtt_want_output)(mc);
-			return;
-		}
+	msg = malloc(len);
+	if (msg == NULL)
+		return (-1);
 
-		TAILQ_REMOVE(&mc->mc_messages, mm, mm_entry);
-		free(mm->mm_buf);
-		if (mm->mm_id == -1)
-			free(mm);
-		else
-			TAILQ_INSERT_TAIL(&mc->mc_pending, mm, mm_entry);
+	pid = mqtt_id(mc);
+	mqtt_encode_filters(msg, len, type, pid, t, 1);
 
-		mm = TAILQ_FIRST(&mc->mc_messages);
-	} while (mm != NULL);
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue(mc, cookie, type, pid, msg, len) == -1) {
+		free(msg);
+		return (-1);
+	}
 
-	if (MQTT_KEEPALIVES(mc))
-		(*mc->mc_settings->mqtt_want_timeout)(mc, &mc->mc_keepalive);
+	return (0);
 }
 
 int
-mqtt_connect(struct mqtt_conn *mc, const struct mqtt_conn_settings *mcs)
+mqtt_subscribe(struct mqtt_conn *mc, void *cookie,
+    const char *filter, size_t filter_len, enum mqtt_qos qos)
 {
-	uint8_t *msg, *buf;
-	struct mqtt_p_connect *pc;
-	size_t len = sizeof(*pc);
-	size_t hlen;
-	uint8_t flags = 0;
-	unsigned int keep_alive;
+	struct mqtt_topic t = { filter, filter_len, qos };
 
-	if (mcs->clean_session)
-		flags |= MQTT_CONNECT_F_CLEAN_SESSION;
-
-	keep_alive = mcs->keep_alive;
-	if (keep_alive > 0xffff)
+	if (MQTT_SERVER(mc))
 		return (-1);
 
-	mc->mc_keepalive.tv_sec = mcs->keep_alive;
+	if (mc->mc_inputting)
+		return (mqtt_subq_add(mc, cookie, filter, filter_len, qos));
 
-	if (mcs->clientid_len > MQTT_MAX_LEN)
-		return (-1);
-	len += sizeof(struct mqtt_u16) + mcs->clientid_len;
+	return (mqtt_filter(mc, MQTT_T_SUBSCRIBE, cookie, &t));
+}
 
-	if (mcs->will_topic != NULL) {
-		if (mcs->will_topic_len > MQTT_MAX_LEN)
-			return (-1);
-		len += sizeof(struct mqtt_u16) + mcs->will_topic_len;
+int
+mqtt_unsubscribe(struct mqtt_conn *mc, void *cookie,
+    const char *filter, size_t filter_len)
+{
+	struct mqtt_topic t = { filter, filter_len, MQTT_QOS0 };
 
-		if (mcs->will_payload_len > MQTT_MAX_LEN)
-			return (-1);
-		len += sizeof(struct mqtt_u16) + mcs->will_payload_len;
+	if (MQTT_SERVER(mc))
+		return (-1);
 
-		flags |= MQTT_CONNECT_F_WILL;
-		flags |= MQTT_CONNECT_F_WILL_QOS(mcs->will_qos);
-		if (mcs->will_retain)
-			flags |= MQTT_CONNECT_F_WILL_RETAIN;
-	}
+	return (mqtt_filter(mc, MQTT_T_UNSUBSCRIBE, cookie, &t));
+}
+#else /* MQTT_NO_SUBSCRIBE */
+static void
+mqtt_subq_flush(struct mqtt_conn *mc)
+{
+}
 
-	if (mcs->username != NULL) {
-		if (mcs->username_len > MQTT_MAX_LEN)
-			return (-1);
+int
+mqtt_subscribev(struct mqtt_conn *mc, void *cookie,
+    const struct mqtt_topic *topics, int ntopics)
+{
+	return (-1);
+}
 
-		len += sizeof(struct mqtt_u16) + mcs->username_len;
-		flags |= MQTT_CONNECT_F_USERNAME;
+int
+mqtt_unsubscribev(struct mqtt_conn *mc, void *cookie,
+    const struct mqtt_topic *topics, int ntopics)
+{
+	return (-1);
+}
 
-		if (mcs->password != NULL) {
-			if (mcs->password_len > MQTT_MAX_LEN)
-				return (-1);
+int
+mqtt_subscribe(struct mqtt_conn *mc, void *cookie,
+    const char *filter, size_t filter_len, enum mqtt_qos qos)
+{
+	return (-1);
+}
 
-			len += sizeof(struct mqtt_u16) + mcs->password_len;
-			flags |= MQTT_CONNECT_F_PASSWORD;
-		}
-	}
+int
+mqtt_unsubscribe(struct mqtt_conn *mc, void *cookie,
+    const char *filter, size_t filter_len)
+{
+	return (-1);
+}
+#endif /* MQTT_NO_SUBSCRIBE */
 
-	if (len > MQTT_MAX_REMLEN)
-		return (-1);
+static int
+mqtt_pingreq(struct mqtt_conn *mc)
+{
+	uint8_t *msg;
+	ssize_t len;
 
-	msg = malloc(sizeof(struct mqtt_header) + len);
+	len = mqtt_encode_pingreq(NULL, 0);
+	msg = malloc(len);
 	if (msg == NULL)
 		return (-1);
 
-	hlen = mqtt_header_set(msg, MQTT_T_CONNECT, 0, len);
-	buf = msg + hlen;
-
-	pc = (struct mqtt_p_connect *)buf;
-	mqtt_u16(&pc->len, sizeof(pc->mqtt));
-	pc->mqtt[0] = 'M';
-	pc->mqtt[1] = 'Q';
-	pc->mqtt[2] = 'T';
-	pc->mqtt[3] = 'T';
-	pc->level = 0x4;
-	pc->flags = flags;
-	mqtt_u16(&pc->keep_alive, keep_alive);
-
-	buf += sizeof(*pc);
-
-	buf += mqtt_lenstr(buf, mcs->clientid_len, mcs->clientid);
-	if (mcs->will_topic != NULL) {
-		buf += mqtt_lenstr(buf,
-		    mcs->will_topic_len, mcs->will_topic);
-		buf += mqtt_lenstr(buf,
-		    mcs->will_payload_len, mcs->will_payload);
-	}
-	if (mcs->username != NULL) {
-		buf += mqtt_lenstr(buf,
-		    mcs->username_len, mcs->username);
-		if (mcs->password != NULL) {
-			buf += mqtt_lenstr(buf,
-			    mcs->password_len, mcs->password);
-		}
-	}
+	mqtt_encode_pingreq(msg, len);
 
 	/* try to shove the message onto the transport straight away */
-	if (mqtt_enqueue(mc, NULL, MQTT_T_CONNECT, -1,
-	    msg, hlen + len) == -1) {
+	if (mqtt_enqueue(mc, NULL, MQTT_T_PINGREQ, -1, msg, len) == -1) {
 		free(msg);
 		return (-1);
 	}
@@ -730,61 +3755,57 @@ mqtt_connect(struct mqtt_conn *mc, const struct mqtt_conn_settings *mcs)
 	return (0);
 }
 
-void
-mqtt_disconnect(struct mqtt_conn *mc)
+static int
+mqtt_pingresp(struct mqtt_conn *mc)
 {
+	uint8_t *msg;
+	ssize_t len;
 
-}
+	len = mqtt_encode_pingresp(NULL, 0);
+	msg = malloc(len);
+	if (msg == NULL)
+		return (-1);
 
-int
-mqtt_publish(struct mqtt_conn *mc,
-    const char *topic, size_t topic_len,
-    const char *payload, size_t payload_len,
-    enum mqtt_qos qos, enum mqtt_retain retain)
-{
-	uint8_t *msg, *buf;
-	size_t len = 0;
-	size_t hlen;
-	uint8_t flags = 0;
+	mqtt_encode_pingresp(msg, len);
 
-	switch (retain) {
-	case MQTT_RETAIN:
-		flags |= (1 << 0);
-		/* FALLTHROUGH */
-	case MQTT_NORETAIN:
-		break;
-	default:
-		return (-1); /* XXX */
+	/* try to shove the message onto the transport straight away */
+	if (mqtt_enqueue(mc, NULL, MQTT_T_PINGRESP, -1, msg, len) == -1) {
+		free(msg);
+		return (-1);
 	}
 
-	flags |= qos << 1;
+	return (0);
+}
 
-	if (topic_len > MQTT_MAX_LEN)
+/* only clients ping, the keepalive ones are sent by mqtt_timeout */
+int
+mqtt_ping(struct mqtt_conn *mc)
+{
+	if (MQTT_SERVER(mc))
 		return (-1);
-	len += sizeof(struct mqtt_u16) + topic_len;
 
-	if (qos != MQTT_QOS0) {
-		//len += sizeof(struct mqtt_u16);
-		return (-1); /* XXX */
-	}
+	return (mqtt_pingreq(mc));
+}
 
-	len += payload_len;
-	if (len > MQTT_MAX_REMLEN)
+int
+mqtt_connack(struct mqtt_conn *mc, int session_present,
+    enum mqtt_connack_code code)
+{
+	uint8_t *msg;
+	ssize_t len;
+
+	if (!MQTT_SERVER(mc))
 		return (-1);
 
-	msg = malloc(sizeof(struct mqtt_header) + len);
+	len = mqtt_encode_connack(NULL, 0, session_present, code);
+	msg = malloc(len);
 	if (msg == NULL)
 		return (-1);
 
-	hlen = mqtt_header_set(msg, MQTT_T_PUBLISH, flags, len);
-	buf = msg + hlen;
-
-	buf += mqtt_lenstr(buf, topic_len, topic);
-	memcpy(buf, payload, payload_len);
+	mqtt_encode_connack(msg, len, session_present, code);
 
 	/* try to shove the message onto the transport straight away */
-	if (mqtt_enqueue(mc, NULL, MQTT_T_PUBLISH, -1,
-	    msg, hlen + len) == -1) {
+	if (mqtt_enqueue(mc, NULL, MQTT_T_CONNACK, -1, msg, len) == -1) {
 		free(msg);
 		return (-1);
 	}
@@ -793,41 +3814,27 @@ mqtt_publish(struct mqtt_conn *mc,
 }
 
 int
-mqtt_subscribe(struct mqtt_conn *mc, void *cookie,
-    const char *filter, size_t filter_len, enum mqtt_qos qos)
+mqtt_suback(struct mqtt_conn *mc, unsigned int pid,
+    const uint8_t *rcodes, size_t nrcodes)
 {
-	uint8_t *msg, *buf;
-	int pid;
-	size_t len = 0;
-	size_t hlen;
-
-	len += sizeof(struct mqtt_u16); /* pid */
+	uint8_t *msg;
+	ssize_t len;
 
-	if (filter_len > MQTT_MAX_LEN)
+	if (!MQTT_SERVER(mc))
 		return (-1);
 
-	len += sizeof(struct mqtt_u16) + filter_len;
-	len += sizeof(uint8_t); /* requested qos */
-
-	if (len > MQTT_MAX_REMLEN)
+	len = mqtt_encode_suback(NULL, 0, pid, rcodes, nrcodes);
+	if (len == -1)
 		return (-1);
 
-	msg = malloc(sizeof(struct mqtt_header) + len);
+	msg = malloc(len);
 	if (msg == NULL)
 		return (-1);
 
-	hlen = mqtt_header_set(msg, MQTT_T_SUBSCRIBE, 0x2 /* wat */, len);
-	buf = msg + hlen;
-
-	pid = mqtt_id(mc);
-	buf += mqtt_u16(buf, pid);
-
-	buf += mqtt_lenstr(buf, filter_len, filter);
-	*buf = qos;
+	mqtt_encode_suback(msg, len, pid, rcodes, nrcodes);
 
 	/* try to shove the message onto the transport straight away */
-	if (mqtt_enqueue(mc, cookie, MQTT_T_SUBSCRIBE, pid,
-	    msg, hlen + len) == -1) {
+	if (mqtt_enqueue(mc, NULL, MQTT_T_SUBACK, -1, msg, len) == -1) {
 		free(msg);
 		return (-1);
 	}
@@ -836,39 +3843,26 @@ mqtt_subscribe(struct mqtt_conn *mc, void *cookie,
 }
 
 int
-mqtt_unsubscribe(struct mqtt_conn *mc, void *cookie,
-    const char *filter, size_t filter_len)
+mqtt_unsuback(struct mqtt_conn *mc, unsigned int pid)
 {
-	uint8_t *msg, *buf;
-	int pid;
-	size_t len = 0;
-	size_t hlen;
-
-	len += sizeof(struct mqtt_u16); /* pid */
+	uint8_t *msg;
+	ssize_t len;
 
-	if (filter_len > MQTT_MAX_LEN)
+	if (!MQTT_SERVER(mc))
 		return (-1);
 
-	len += sizeof(struct mqtt_u16) + filter_len;
-
-	if (len > MQTT_MAX_REMLEN)
+	len = mqtt_encode_unsuback(NULL, 0, pid);
+	if (len == -1)
 		return (-1);
 
-	msg = malloc(sizeof(struct mqtt_header) + len);
+	msg = malloc(len);
 	if (msg == NULL)
 		return (-1);
 
-	hlen = mqtt_header_set(msg, MQTT_T_UNSUBSCRIBE, 0x2 /* wat */, len);
-	buf = msg + hlen;
-
-	pid = mqtt_id(mc);
-	buf += mqtt_u16(buf, pid);
-
-	buf += mqtt_lenstr(buf, filter_len, filter);
+	mqtt_encode_unsuback(msg, len, pid);
 
 	/* try to shove the message onto the transport straight away */
-	if (mqtt_enqueue(mc, cookie, MQTT_T_UNSUBSCRIBE, pid,
-	    msg, hlen + len) == -1) {
+	if (mqtt_enqueue(mc, NULL, MQTT_T_UNSUBACK, -1, msg, len) == -1) {
 		free(msg);
 		return (-1);
 	}
@@ -876,38 +3870,136 @@ mqtt_unsubscribe(struct mqtt_conn *mc, void *cookie,
 	return (0);
 }
 
+/*
+ * the timeout handlers return -1 if the connection died. mqtt_dead
+ * may have destroyed it, so it can't be looked at again.
+ */
 static int
-mqtt_pingreq(struct mqtt_conn *mc)
+mqtt_keepalive_timeout(struct mqtt_conn *mc)
 {
-	uint8_t *msg;
-	size_t hlen;
+	MQTT_TRACE2(keepalive__timeout, mc, mc->mc_pinging);
 
-	msg = malloc(sizeof(struct mqtt_header));
-	if (msg == NULL)
+	if (MQTT_SERVER(mc)) {
+		/* the client has gone quiet for too long */
+		mqtt_die(mc, MQTT_DEAD_KEEPALIVE, "keepalive timeout");
 		return (-1);
+	}
 
-	hlen = mqtt_header_set(msg, MQTT_T_PINGREQ, 0x0 /* wat */, 0);
+	if (mc->mc_pinging) {
+		mqtt_die(mc, MQTT_DEAD_PINGRESP, "no pingresp");
+		return (-1);
+	}
 
-	/* try to shove the message onto the transport straight away */
-	if (mqtt_enqueue(mc, NULL, MQTT_T_PINGREQ, -1, msg, hlen) == -1) {
-		free(msg);
+	if (mqtt_pingreq(mc) == -1) {
+		mqtt_die(mc, MQTT_DEAD_NOMEM, "pingreq failed");
 		return (-1);
 	}
 
+	mc->mc_pinging = 1;
+	return (0);
+}
+
+int
+mqtt_set_liveness(struct mqtt_conn *mc, unsigned int idle,
+    unsigned int wait)
+{
+	if (MQTT_SERVER(mc))
+		return (-1);
+	if (idle > 0 && wait == 0)
+		return (-1);
+
+	mc->mc_live_idle.tv_sec = idle / 1000;
+	mc->mc_live_idle.tv_nsec = (idle % 1000) * 1000000;
+	mc->mc_live_wait.tv_sec = wait / 1000;
+	mc->mc_live_wait.tv_nsec = (wait % 1000) * 1000000;
+	mc->mc_live_probing = 0;
+	clock_gettime(CLOCK_MONOTONIC, &mc->mc_live_heard);
+
+	if (!MQTT_LIVENESS(mc))
+		timespecclear(&mc->mc_deadlines[MQTT_TMO_LIVENESS]);
+
 	return (0);
 }
 
-#include <err.h>
+/*
+ * the liveness timer is started by output. input doesn't move it, it
+ * only notes when it happened, so it's up to this to work out if the
+ * peer has been quiet for long enough to be asked if it's still there.
+ */
+static int
+mqtt_liveness_timeout(struct mqtt_conn *mc, const struct timespec *now)
+{
+	struct timespec dl, rel;
+
+	MQTT_TRACE2(liveness__timeout, mc, mc->mc_live_probing);
+
+	if (mc->mc_live_probing) {
+		if (timespeccmp(&mc->mc_live_heard, &mc->mc_live_probe, <)) {
+			mqtt_die(mc, MQTT_DEAD_LIVENESS, "liveness timeout");
+			return (-1);
+		}
+		mc->mc_live_probing = 0;
+	}
+
+	timespecadd(&mc->mc_live_heard, &mc->mc_live_idle, &dl);
+	if (timespeccmp(&dl, now, >)) {
+		/* it's been heard from, so only keep watching if it owes us */
+		if (mc->mc_queued == 0 && TAILQ_EMPTY(&mc->mc_pending))
+			return (0);
+
+		timespecsub(&dl, now, &rel);
+		mqtt_timer_set(mc, MQTT_TMO_LIVENESS, &rel);
+		return (0);
+	}
+
+	/* the deadline has to be set first so the PINGREQ can't reset it */
+	mc->mc_live_probing = 1;
+	mc->mc_live_probe = *now;
+	mqtt_timer_set(mc, MQTT_TMO_LIVENESS, &mc->mc_live_wait);
+	if (mqtt_pingreq(mc) == -1) {
+		mqtt_die(mc, MQTT_DEAD_NOMEM, "pingreq failed");
+		return (-1);
+	}
+
+	return (0);
+}
 
 void
 mqtt_timeout(struct mqtt_conn *mc)
 {
-	if (mc->mc_pinging) {
-		errx(1, "%s[%u]: no pingresp", __func__, __LINE__);
-	} else {
-		if (mqtt_pingreq(mc) == -1)
-			errx(1, "%s[%u]: pingreq failed", __func__, __LINE__);
+	struct timespec now;
+	unsigned int i;
+	int expired[MQTT_TMO_COUNT];
+
+	switch (mc->mc_state) {
+	case MQTT_S_GONE:
+	case MQTT_S_DEAD:
+		/* on_disconnect or on_dead has already been called */
+		return;
+	default:
+		break;
+	}
 
-		mc->mc_pinging = 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecclear(&mc->mc_armed);
+
+	/* work out what's expired before any of it can move */
+	for (i = 0; i < MQTT_TMO_COUNT; i++) {
+		struct timespec *dl = &mc->mc_deadlines[i];
+
+		expired[i] = timespecisset(dl) && timespeccmp(dl, &now, <=);
+		if (expired[i])
+			timespecclear(dl);
 	}
+
+	if (expired[MQTT_TMO_PACE])
+		mqtt_output(mc);
+	if (expired[MQTT_TMO_KEEPALIVE] &&
+	    mqtt_keepalive_timeout(mc) == -1)
+		return;
+	if (expired[MQTT_TMO_LIVENESS] &&
+	    mqtt_liveness_timeout(mc, &now) == -1)
+		return;
+
+	mqtt_timer_arm(mc, &now, NULL);
 }
@@ -16,7 +16,11 @@
  */
 
 struct mqtt_conn;
+struct mqtt_conn_settings;
+struct mqtt_msg;
+struct mqtt_topic;
 struct timespec;
+struct iovec;
 
 enum mqtt_qos {
 	MQTT_QOS0,
@@ -29,25 +33,132 @@ enum mqtt_retain {
 	MQTT_RETAIN,
 };
 
+enum mqtt_prio {
+	MQTT_PRIO_CONTROL,
+	MQTT_PRIO_LATENCY,
+	MQTT_PRIO_BULK,
+};
+#define MQTT_NPRIO		3
+
+enum mqtt_connack_code {
+	MQTT_CONN_ACCEPTED,
+	MQTT_CONN_PROTO_VERSION,
+	MQTT_CONN_IDENTIFIER,
+	MQTT_CONN_SERVER_UNAVAILABLE,
+	MQTT_CONN_BAD_CREDENTIALS,
+	MQTT_CONN_NOT_AUTHORIZED,
+};
+
+#define MQTT_SUBACK_FAILURE	0x80
+
+/* why mqtt_dead was called, see mqtt_dead_reason */
+enum mqtt_dead_reason {
+	MQTT_DEAD_NONE,
+	MQTT_DEAD_INPUT,	/* the peer sent something we couldn't use */
+	MQTT_DEAD_DISCONNECT,	/* the peer sent DISCONNECT */
+	MQTT_DEAD_KEEPALIVE,	/* a server didn't hear from its client */
+	MQTT_DEAD_PINGRESP,	/* no PINGRESP within a keepalive */
+	MQTT_DEAD_LIVENESS,	/* no PINGRESP within the liveness wait */
+	MQTT_DEAD_NOMEM,	/* a PINGREQ couldn't be queued */
+};
+
+#define MQTT_WOULDBLOCK		(-2)
+
+/*
+ * a PUBLISH as delivered by mqtt_on_message_batch. the topic and
+ * payload are owned by the app once it has been called, like they
+ * are for mqtt_on_message.
+ */
+struct mqtt_batch_msg {
+	char		*topic;
+	size_t		 topic_len;
+	char		*payload;
+	size_t		 payload_len;
+	enum mqtt_qos	 qos;
+	unsigned int	 pid;		/* 0 for QOS0 */
+};
+
+#define MQTT_BATCH_DEFAULT	64
+
 struct mqtt_settings {
 	unsigned int	  mqtt_max_topic;
 	unsigned int	  mqtt_max_payload;
 
+	/*
+	 * if mqtt_output_hiwat is set, publishes fail with MQTT_WOULDBLOCK
+	 * once that many bytes are queued for output. mqtt_on_drain is
+	 * called when the queue falls to mqtt_output_lowat again.
+	 */
+	size_t		  mqtt_output_hiwat;
+	size_t		  mqtt_output_lowat;
+	void		(*mqtt_on_drain)(struct mqtt_conn *);
+
+	/*
+	 * coalesce mqtt_subscribe calls made from callbacks into as few
+	 * SUBSCRIBE packets as possible, sent when mqtt_input returns.
+	 */
+	unsigned int	  mqtt_coalesce_subscribe;
+
 	void		(*mqtt_want_output)(struct mqtt_conn *);
 	ssize_t		(*mqtt_output)(struct mqtt_conn *,
 			      const void *, size_t);
+	ssize_t		(*mqtt_output_fd)(struct mqtt_conn *,
+			      int, off_t, size_t);
 	void		(*mqtt_want_timeout)(struct mqtt_conn *,
 			      const struct timespec *);
 	void		(*mqtt_timeout)(struct mqtt_conn *);
 
 	void		(*mqtt_on_connect)(struct mqtt_conn *);
+
+	/*
+	 * if mqtt_on_topic is set it is called with the topic of each
+	 * PUBLISH before the rest of it is read. if it returns 0 the
+	 * message is skipped over without being allocated or copied,
+	 * and isn't seen by the message callbacks or the last value
+	 * cache.
+	 */
+	int		(*mqtt_on_topic)(struct mqtt_conn *,
+			      const char *, size_t, enum mqtt_qos);
+
 	void		(*mqtt_on_message)(struct mqtt_conn *,
 			      char *, size_t, char *, size_t,
 			      enum mqtt_qos);
+
+	/*
+	 * if mqtt_on_message_batch is set it is used instead of
+	 * mqtt_on_message. it is called with the messages parsed by
+	 * one mqtt_input call, or sooner if mqtt_message_batch_max
+	 * (MQTT_BATCH_DEFAULT if 0) have been collected.
+	 */
+	void		(*mqtt_on_message_batch)(struct mqtt_conn *,
+			      struct mqtt_batch_msg *, size_t);
+	unsigned int	  mqtt_message_batch_max;
+
+	/*
+	 * if mqtt_on_msg is set it is used instead of both of the
+	 * above. the message is passed with a reference the app has to
+	 * give back with mqtt_msg_unref. messages go to a dispatcher
+	 * instead if one has been set with mqtt_set_dispatch.
+	 */
+	void		(*mqtt_on_msg)(struct mqtt_conn *, struct mqtt_msg *);
+
 	void		(*mqtt_on_suback)(struct mqtt_conn *, void *,
 			      const uint8_t *, size_t);
 	void		(*mqtt_on_unsuback)(struct mqtt_conn *, void *);
 	void		(*mqtt_dead)(struct mqtt_conn *);
+
+	/*
+	 * server role callbacks. the strings passed to these point
+	 * into the packet being parsed and are only valid for the
+	 * duration of the call.
+	 */
+	void		(*mqtt_on_conn)(struct mqtt_conn *,
+			      const struct mqtt_conn_settings *);
+	void		(*mqtt_on_subscribe)(struct mqtt_conn *, unsigned int,
+			      const struct mqtt_topic *, size_t);
+	void		(*mqtt_on_unsubscribe)(struct mqtt_conn *, unsigned int,
+			      const struct mqtt_topic *, size_t);
+	void		(*mqtt_on_disconnect)(struct mqtt_conn *);
 };
 
 struct mqtt_conn_settings {
@@ -71,11 +182,16 @@ struct mqtt_conn_settings {
 
 struct mqtt_conn	*mqtt_conn_create(const struct mqtt_settings *,
 			     void *);
+struct mqtt_conn	*mqtt_conn_create_server(const struct mqtt_settings *,
+			     void *);
 int			 mqtt_connect(struct mqtt_conn *,
 			     const struct mqtt_conn_settings *);
 void			*mqtt_cookie(struct mqtt_conn *);
 const char		*mqtt_errstr(struct mqtt_conn *);
+enum mqtt_dead_reason	 mqtt_dead_reason(struct mqtt_conn *);
 void			 mqtt_input(struct mqtt_conn *, const void *, size_t);
+void			 mqtt_inputv(struct mqtt_conn *,
+			     const struct iovec *, int);
 void			 mqtt_output(struct mqtt_conn *);
 void			 mqtt_timeout(struct mqtt_conn *);
 void			 mqtt_disconnect(struct mqtt_conn *);
@@ -90,13 +206,259 @@ struct mqtt_topic {
 int			mqtt_publish(struct mqtt_conn *,
 			    const char *, size_t, const char *, size_t,
 			    enum mqtt_qos, enum mqtt_retain);
+int			mqtt_set_publish_prio(struct mqtt_conn *,
+			    enum mqtt_prio);
+/*
+ * limit publishes to msgs per second (with a burst) and bytes per
+ * second (with a burst). a rate of 0 is unlimited, a burst of 0 is a
+ * second's worth. held publishes are sent from mqtt_timeout.
+ */
+int			mqtt_set_pacing(struct mqtt_conn *,
+			    unsigned int, unsigned int, size_t, size_t);
+/*
+ * fast liveness for clients. once there's output waiting on the
+ * server, a PINGREQ is sent if nothing has been read for idle ms,
+ * and the connection is dead if the server is still quiet wait ms
+ * after that. this notices a dead server well before the keepalive
+ * does. an idle of 0 turns it off.
+ */
+int			mqtt_set_liveness(struct mqtt_conn *,
+			    unsigned int, unsigned int);
+/*
+ * payload codecs, eg, compression. bound returns the largest encoded
+ * size of a payload, and decoded_len the size a received payload will
+ * decode to. encode and decode return the number of bytes written to
+ * the destination, or -1 on error.
+ */
+struct mqtt_codec {
+	size_t		(*bound)(void *, size_t);
+	ssize_t		(*encode)(void *, void *, size_t,
+			    const void *, size_t);
+	ssize_t		(*decoded_len)(void *, const void *, size_t);
+	ssize_t		(*decode)(void *, void *, size_t,
+			    const void *, size_t);
+};
+
+int			mqtt_codec_set(struct mqtt_conn *, const char *, size_t,
+			    const struct mqtt_codec *, void *);
+
+/* last value cache */
+struct mqtt_lvc;
+
+struct mqtt_lvc		*mqtt_lvc_create(size_t);
+void			 mqtt_lvc_destroy(struct mqtt_lvc *);
+int			 mqtt_lvc_update(struct mqtt_lvc *,
+			     const char *, size_t, const void *, size_t);
+int			 mqtt_lvc_get(const struct mqtt_lvc *,
+			     const char *, size_t, const void **, size_t *);
+int			 mqtt_lvc_next(const struct mqtt_lvc *, size_t *,
+			     const char **, size_t *, const void **, size_t *);
+size_t			 mqtt_lvc_count(const struct mqtt_lvc *);
+void			 mqtt_set_lvc(struct mqtt_conn *, struct mqtt_lvc *);
+
+/*
+ * refcounted messages. the topic and payload live in the same
+ * allocation as the refcount, are NUL terminated, and don't change
+ * after the message is created, so a message can be shared between
+ * threads without copying it.
+ */
+struct mqtt_msg		*mqtt_msg_create(const char *, size_t,
+			     const void *, size_t, enum mqtt_qos);
+struct mqtt_msg		*mqtt_msg_ref(struct mqtt_msg *);
+void			 mqtt_msg_unref(struct mqtt_msg *);
+const char		*mqtt_msg_topic(const struct mqtt_msg *, size_t *);
+const char		*mqtt_msg_payload(const struct mqtt_msg *, size_t *);
+enum mqtt_qos		 mqtt_msg_qos(const struct mqtt_msg *);
+unsigned int		 mqtt_msg_pid(const struct mqtt_msg *);
+
+/*
+ * hand received messages to worker threads. each worker has its own
+ * ring, and messages on the same topic always go to the same worker.
+ * the ring size must be a power of 2. when a ring is full the io
+ * thread either waits for space, or with MQTT_DISPATCH_SHED_QOS0
+ * drops QOS0 messages and only waits for the others.
+ */
+struct mqtt_dispatch;
+
+enum mqtt_dispatch_policy {
+	MQTT_DISPATCH_BLOCK,
+	MQTT_DISPATCH_SHED_QOS0,
+};
+
+struct mqtt_dispatch	*mqtt_dispatch_create(unsigned int, unsigned int,
+			     enum mqtt_dispatch_policy);
+void			 mqtt_dispatch_destroy(struct mqtt_dispatch *);
+unsigned int		 mqtt_dispatch_worker(const struct mqtt_dispatch *,
+			     const char *, size_t);
+int			 mqtt_dispatch_push(struct mqtt_dispatch *,
+			     struct mqtt_msg *);
+struct mqtt_msg		*mqtt_dispatch_pop(struct mqtt_dispatch *,
+			     unsigned int);
+struct mqtt_msg		*mqtt_dispatch_wait(struct mqtt_dispatch *,
+			     unsigned int);
+void			 mqtt_dispatch_close(struct mqtt_dispatch *);
+uint64_t		 mqtt_dispatch_shed(const struct mqtt_dispatch *);
+void			 mqtt_set_dispatch(struct mqtt_conn *,
+			     struct mqtt_dispatch *);
+
+/*
+ * a memory budget shared between connections. each connection
+ * accounts its own state, partially read packets, and queued output
+ * against the budget it has been given. once the budget is used up
+ * QOS0 publishes are refused by mqtt_publish and friends, and QOS0
+ * publishes being received are skipped without being read into
+ * memory. everything else is still allowed so sessions stay up.
+ * mqtt_memused reports what a connection holds whether it has a
+ * budget or not.
+ */
+struct mqtt_budget;
+
+struct mqtt_budget	*mqtt_budget_create(size_t);
+void			 mqtt_budget_destroy(struct mqtt_budget *);
+int			 mqtt_budget_charge(struct mqtt_budget *, size_t);
+void			 mqtt_budget_add(struct mqtt_budget *, size_t);
+void			 mqtt_budget_rele(struct mqtt_budget *, size_t);
+size_t			 mqtt_budget_used(const struct mqtt_budget *);
+size_t			 mqtt_budget_limit(const struct mqtt_budget *);
+uint64_t		 mqtt_budget_shed(const struct mqtt_budget *);
+void			 mqtt_set_budget(struct mqtt_conn *,
+			     struct mqtt_budget *);
+size_t			 mqtt_memused(struct mqtt_conn *);
+
+/*
+ * forward the publishes read by one connection onto the output queue
+ * of another without handing them to the app. the topic and payload
+ * are read straight into the packet that is sent on, and only its
+ * header is rewritten: strip is taken off the front of the topic if
+ * it's there, prefix is put in front, the QOS is 0, and the retain
+ * flag is kept unless MQTT_BRIDGE_NORETAIN is set. bridged publishes
+ * aren't seen by the message callbacks, codecs, or the last value
+ * cache.
+ *
+ * QOS0 publishes are dropped while the peer is over its output high
+ * watermark, and counted by mqtt_bridge_shed. mqtt_bridge_blocked
+ * says when to stop reading the source until the peer's
+ * mqtt_on_drain is called. each connection forwards to at most one
+ * peer and is forwarded to by at most one, so a bridge in both
+ * directions is two calls. a NULL peer stops forwarding.
+ */
+#define MQTT_BRIDGE_NORETAIN	0x1
+
+int			 mqtt_set_bridge(struct mqtt_conn *, struct mqtt_conn *,
+			     const char *, size_t, const char *, size_t,
+			     unsigned int);
+int			 mqtt_bridge_blocked(struct mqtt_conn *);
+uint64_t		 mqtt_bridge_shed(struct mqtt_conn *);
+
+/*
+ * MQTT over WebSockets. the mqtt_output callback of the connection
+ * should pass its bytes to mqtt_ws_output, and bytes read from the
+ * transport go to mqtt_ws_input instead of mqtt_input. ws_output is
+ * called to write to the transport. when it can't take everything
+ * ws_want_output is called, and mqtt_ws_flush should be called once
+ * the transport is writable again. ws_on_open is called when the
+ * handshake is done, which is when mqtt_connect can be called.
+ * mqtt_ws_destroy is safe to call from the callbacks, including the
+ * mqtt_dead of the connection while in mqtt_ws_input.
+ */
+struct mqtt_ws;
+
+struct mqtt_ws_settings {
+	size_t		  ws_output_size;
+	ssize_t		(*ws_output)(struct mqtt_ws *, const void *, size_t);
+	void		(*ws_want_output)(struct mqtt_ws *);
+	void		(*ws_on_open)(struct mqtt_ws *);
+	void		(*ws_dead)(struct mqtt_ws *);
+};
+
+struct mqtt_ws		*mqtt_ws_create(const struct mqtt_ws_settings *,
+			     struct mqtt_conn *, void *);
+void			 mqtt_ws_destroy(struct mqtt_ws *);
+void			*mqtt_ws_cookie(struct mqtt_ws *);
+const char		*mqtt_ws_errstr(struct mqtt_ws *);
+int			 mqtt_ws_handshake(struct mqtt_ws *,
+			     const char *, const char *, const char *);
+void			 mqtt_ws_input(struct mqtt_ws *, void *, size_t);
+ssize_t			 mqtt_ws_output(struct mqtt_ws *,
+			     const void *, size_t);
+void			 mqtt_ws_flush(struct mqtt_ws *);
+
+/*
+ * enqueue to flush latency histogram. bucket n counts the messages
+ * that took from 2^n to 2^(n+1) - 1 nanoseconds between being queued
+ * and the last of their bytes being accepted by the transport. the
+ * last bucket also counts everything slower. it costs two clock reads
+ * per message, so it is only done once a histogram has been set.
+ */
+#define MQTT_LATHIST_BUCKETS	40
+
+struct mqtt_lathist {
+	uint64_t	 lh_buckets[MQTT_LATHIST_BUCKETS];
+};
+
+void			 mqtt_set_lathist(struct mqtt_conn *,
+			     struct mqtt_lathist *);
+
+int			mqtt_publish_fd(struct mqtt_conn *,
+			    const char *, size_t, int, off_t, size_t,
+			    enum mqtt_qos, enum mqtt_retain);
+
+/*
+ * a publish template pre-encodes the topic and flags for a topic that
+ * is published to repeatedly.
+ */
+struct mqtt_publish_template;
+
+struct mqtt_publish_template *
+			mqtt_publish_template_create(const char *, size_t,
+			    enum mqtt_qos, enum mqtt_retain);
+void			mqtt_publish_template_destroy(
+			    struct mqtt_publish_template *);
+ssize_t			mqtt_publish_template_header(
+			    const struct mqtt_publish_template *,
+			    void *, size_t, size_t);
+int			mqtt_publish_template_send(struct mqtt_conn *,
+			    const struct mqtt_publish_template *,
+			    const char *, size_t);
 
 int			mqtt_subscribe(struct mqtt_conn *, void *,
 			    const char *, size_t, enum mqtt_qos);
-int			mqtt_subscribev(struct mqtt_conn *,
+int			mqtt_subscribev(struct mqtt_conn *, void *,
 			    const struct mqtt_topic *, int);
 int			mqtt_unsubscribe(struct mqtt_conn *, void *,
 			    const char *, size_t);
-int			mqtt_unsubscribev(struct mqtt_conn *,
+int			mqtt_unsubscribev(struct mqtt_conn *, void *,
 			    const struct mqtt_topic *, int);
 int			mqtt_ping(struct mqtt_conn *);
+
+/* server role */
+int			mqtt_connack(struct mqtt_conn *, int,
+			    enum mqtt_connack_code);
+int			mqtt_suback(struct mqtt_conn *, unsigned int,
+			    const uint8_t *, size_t);
+int			mqtt_unsuback(struct mqtt_conn *, unsigned int);
+
+/*
+ * stateless encoders. these write a whole packet into buf without a
+ * connection or any allocation, so they can be used to build packets
+ * in buffers the app manages itself. like snprintf(3) they return the
+ * length of the packet, and only write it if it fits in buflen. -1 is
+ * returned if the packet can't be encoded.
+ */
+ssize_t			mqtt_encode_connect(void *, size_t,
+			    const struct mqtt_conn_settings *);
+ssize_t			mqtt_encode_publish(void *, size_t,
+			    const char *, size_t, const void *, size_t,
+			    enum mqtt_qos, enum mqtt_retain, unsigned int);
+ssize_t			mqtt_encode_subscribe(void *, size_t, unsigned int,
+			    const struct mqtt_topic *, size_t);
+ssize_t			mqtt_encode_unsubscribe(void *, size_t, unsigned int,
+			    const struct mqtt_topic *, size_t);
+ssize_t			mqtt_encode_pingreq(void *, size_t);
+ssize_t			mqtt_encode_pingresp(void *, size_t);
+ssize_t			mqtt_encode_disconnect(void *, size_t);
+ssize_t			mqtt_encode_connack(void *, size_t, int,
+			    enum mqtt_connack_code);
+ssize_t			mqtt_encode_suback(void *, size_t, unsigned int,
+			    const uint8_t *, size_t);
+ssize_t			mqtt_encode_unsuback(void *, size_t, unsigned int);
@@ -0,0 +1,790 @@
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * header only C++17 wrapper around amqtt.
+ *
+ * amqtt::connection<Handler> owns a struct mqtt_conn and calls the
+ * member functions of a Handler object. the mqtt_settings for each
+ * Handler type are built at compile time, with a static function
+ * per callback that calls straight into the handler, so there are
+ * no virtual calls or std::function involved and the handler can be
+ * inlined into the thunks.
+ *
+ * a handler has to provide:
+ *
+ *	void	 want_output(connection &);
+ *	ssize_t	 output(connection &, std::string_view);
+ *	void	 want_timeout(connection &, const struct timespec &);
+ *	void	 dead(connection &);
+ *
+ * and may provide any of:
+ *
+ *	void	 on_connect(connection &);
+ *	bool	 on_topic(connection &, std::string_view, mqtt_qos);
+ *	void	 on_message(connection &, std::string_view topic,
+ *		     std::string_view payload, mqtt_qos);
+ *	void	 on_msg(connection &, amqtt::msg);
+ *	void	 on_suback(connection &, void *,
+ *		     amqtt::span<const uint8_t>);
+ *	void	 on_unsuback(connection &, void *);
+ *	void	 on_drain(connection &);
+ *	ssize_t	 output_fd(connection &, int, off_t, size_t);
+ *
+ *	void	 on_conn(connection &, const mqtt_conn_settings &);
+ *	void	 on_subscribe(connection &, unsigned int,
+ *		     amqtt::span<const mqtt_topic>);
+ *	void	 on_unsubscribe(connection &, unsigned int,
+ *		     amqtt::span<const mqtt_topic>);
+ *	void	 on_disconnect(connection &);
+ *
+ *	static constexpr void settings(mqtt_settings &);
+ *
+ * the strings given to on_message are only valid for the duration of
+ * the call, the wrapper frees them afterwards. on_msg gets its own
+ * reference to the message that it can keep for as long as it likes.
+ * settings can set the watermarks and other tunables in the
+ * mqtt_settings before they are used.
+ *
+ * when built as C++20, subscribes and unsubscribes can also be
+ * awaited from a coroutine:
+ *
+ *	uint8_t rcode = co_await c.async_subscribe("a/b", MQTT_QOS1);
+ *	bool ok = co_await c.async_unsubscribe("a/b");
+ *
+ * the coroutine is resumed from inside mqtt_input when the ack is
+ * parsed, so it works with whatever event loop drives the connection.
+ * the state for each await lives in the awaiter, which the compiler
+ * keeps in the coroutine frame, so awaiting doesn't allocate. if the
+ * connection dies or is destroyed first, the coroutines waiting on it
+ * are resumed with a failure. the wrapper tells its own cookies apart
+ * from the app's by setting the low bit, so cookies passed to
+ * subscribe and unsubscribe must be aligned.
+ */
+
+#ifndef AMQTT_HPP
+#define AMQTT_HPP
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#define AMQTT_COROUTINES	1
+#endif
+
+extern "C" {
+#include "amqtt.h"
+}
+
+namespace amqtt {
+
+/* std::span is C++20, this is just enough of it for the callbacks */
+template <class T>
+class span {
+public:
+	constexpr span() noexcept = default;
+	constexpr span(T *data, size_t size) noexcept
+	    : data_(data), size_(size) { }
+
+	constexpr T	*data() const noexcept { return data_; }
+	constexpr size_t size() const noexcept { return size_; }
+	constexpr bool	 empty() const noexcept { return size_ == 0; }
+	constexpr T	*begin() const noexcept { return data_; }
+	constexpr T	*end() const noexcept { return data_ + size_; }
+	constexpr T	&operator[](size_t i) const noexcept { return data_[i]; }
+
+private:
+	T		*data_ = nullptr;
+	size_t		 size_ = 0;
+};
+
+inline std::string_view
+view(const mqtt_topic &t) noexcept
+{
+	return std::string_view(t.filter, t.len);
+}
+
+/* a reference to a struct mqtt_msg */
+class msg {
+public:
+	msg() noexcept = default;
+	explicit msg(struct mqtt_msg *m) noexcept : m_(m) { }
+	msg(std::string_view topic, std::string_view payload,
+	    mqtt_qos qos = MQTT_QOS0)
+	    : m_(mqtt_msg_create(topic.data(), topic.size(),
+	      payload.data(), payload.size(), qos)) {
+		if (m_ == nullptr)
+			throw std::bad_alloc();
+	}
+
+	msg(const msg &o) noexcept
+	    : m_(o.m_ != nullptr ? mqtt_msg_ref(o.m_) : nullptr) { }
+	msg(msg &&o) noexcept : m_(std::exchange(o.m_, nullptr)) { }
+	~msg() { reset(); }
+
+	msg &
+	operator=(msg o) noexcept
+	{
+		std::swap(m_, o.m_);
+		return (*this);
+	}
+
+	explicit operator bool() const noexcept { return m_ != nullptr; }
+
+	std::string_view
+	topic() const noexcept
+	{
+		size_t len;
+		const char *t = mqtt_msg_topic(m_, &len);
+		return std::string_view(t, len);
+	}
+
+	std::string_view
+	payload() const noexcept
+	{
+		size_t len;
+		const char *p = mqtt_msg_payload(m_, &len);
+		return std::string_view(p, len);
+	}
+
+	mqtt_qos	 qos() const noexcept { return mqtt_msg_qos(m_); }
+	unsigned int	 pid() const noexcept { return mqtt_msg_pid(m_); }
+
+	struct mqtt_msg	*get() const noexcept { return m_; }
+	struct mqtt_msg	*release() noexcept { return std::exchange(m_, nullptr); }
+
+	void
+	reset() noexcept
+	{
+		if (m_ != nullptr)
+			mqtt_msg_unref(std::exchange(m_, nullptr));
+	}
+
+private:
+	struct mqtt_msg	*m_ = nullptr;
+};
+
+/* pass to the connection constructor to take the server role */
+struct server_t { explicit server_t() = default; };
+inline constexpr server_t server{};
+
+template <class Handler> class connection;
+
+namespace detail {
+
+template <class, template <class> class, class = void>
+struct detect : std::false_type { };
+
+template <class H, template <class> class Op>
+struct detect<H, Op, std::void_t<Op<H>>> : std::true_type { };
+
+template <class H, template <class> class Op>
+inline constexpr bool has = detect<H, Op>::value;
+
+#define AMQTT_HOOK(_name, ...)						\
+	template <class H> using _name##_t =				\
+	    decltype(std::declval<H &>()._name(__VA_ARGS__))
+#define AMQTT_CONN	std::declval<connection<H> &>()
+
+AMQTT_HOOK(on_connect, AMQTT_CONN);
+AMQTT_HOOK(on_topic, AMQTT_CONN, std::string_view(), MQTT_QOS0);
+AMQTT_HOOK(on_message, AMQTT_CONN,
+    std::string_view(), std::string_view(), MQTT_QOS0);
+AMQTT_HOOK(on_msg, AMQTT_CONN, msg());
+AMQTT_HOOK(on_suback, AMQTT_CONN, (void *)nullptr, span<const uint8_t>());
+AMQTT_HOOK(on_unsuback, AMQTT_CONN, (void *)nullptr);
+AMQTT_HOOK(on_drain, AMQTT_CONN);
+AMQTT_HOOK(output_fd, AMQTT_CONN, 0, off_t(), size_t());
+AMQTT_HOOK(on_conn, AMQTT_CONN, std::declval<const mqtt_conn_settings &>());
+AMQTT_HOOK(on_subscribe, AMQTT_CONN, 0U, span<const mqtt_topic>());
+AMQTT_HOOK(on_unsubscribe, AMQTT_CONN, 0U, span<const mqtt_topic>());
+AMQTT_HOOK(on_disconnect, AMQTT_CONN);
+
+#undef AMQTT_CONN
+#undef AMQTT_HOOK
+
+template <class H> using settings_t =
+    decltype(H::settings(std::declval<mqtt_settings &>()));
+
+#ifdef AMQTT_COROUTINES
+/* a subscribe or unsubscribe waiting for its ack */
+struct request {
+	request			*next = nullptr;
+	request			*prev = nullptr;
+	std::coroutine_handle<>	 handle;
+	uint8_t			*rcodes = nullptr;
+	size_t			 nrcodes = 0;
+	bool			 acked = false;
+	bool			 done = false;
+	bool			 suspending = false;
+
+	request() noexcept = default;
+	request(const request &) = delete;
+	request &operator=(const request &) = delete;
+
+	void *
+	cookie() noexcept
+	{
+		return reinterpret_cast<void *>(
+		    reinterpret_cast<uintptr_t>(this) | 1);
+	}
+
+	static request *
+	from(void *cookie) noexcept
+	{
+		uintptr_t v = reinterpret_cast<uintptr_t>(cookie);
+
+		if ((v & 1) == 0)
+			return nullptr;
+		return reinterpret_cast<request *>(v & ~uintptr_t(1));
+	}
+
+	/* the request has been taken off the list by now */
+	void
+	complete(const uint8_t *rc, size_t n, bool ok) noexcept
+	{
+		size_t i;
+
+		/* codes the broker didn't send back count as refusals */
+		for (i = 0; i < nrcodes; i++)
+			rcodes[i] = (ok && i < n) ? rc[i] : MQTT_SUBACK_FAILURE;
+		acked = ok;
+		done = true;
+
+		/* the ack can arrive before await_suspend returns */
+		if (!suspending)
+			handle.resume();
+	}
+};
+
+/* the requests outstanding on a connection */
+class requests {
+public:
+	void
+	insert(request *r) noexcept
+	{
+		r->prev = nullptr;
+		r->next = head_;
+		if (head_ != nullptr)
+			head_->prev = r;
+		head_ = r;
+	}
+
+	void
+	remove(request *r) noexcept
+	{
+		if (r->prev != nullptr)
+			r->prev->next = r->next;
+		else
+			head_ = r->next;
+		if (r->next != nullptr)
+			r->next->prev = r->prev;
+	}
+
+	void
+	fail() noexcept
+	{
+		request *r;
+
+		while ((r = head_) != nullptr) {
+			remove(r);
+			r->complete(nullptr, 0, false);
+		}
+	}
+
+private:
+	request			*head_ = nullptr;
+};
+#endif /* AMQTT_COROUTINES */
+
+} /* namespace detail */
+
+#ifdef AMQTT_COROUTINES
+/*
+ * a coroutine that starts straight away and cleans up after itself
+ * when it finishes, for when nothing needs to wait for it.
+ */
+struct task {
+	struct promise_type {
+		task	 get_return_object() noexcept { return {}; }
+		std::suspend_never
+			 initial_suspend() noexcept { return {}; }
+		std::suspend_never
+			 final_suspend() noexcept { return {}; }
+		void	 return_void() noexcept { }
+		void	 unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+#endif
+
+template <class Handler>
+class connection {
+public:
+	using handler_type = Handler;
+
+	explicit connection(Handler &h)
+	    : h_(h), mc_(mqtt_conn_create(&settings, this)) {
+		if (mc_ == nullptr)
+			throw std::bad_alloc();
+	}
+
+	connection(Handler &h, server_t)
+	    : h_(h), mc_(mqtt_conn_create_server(&settings, this)) {
+		if (mc_ == nullptr)
+			throw std::bad_alloc();
+	}
+
+	/* the mqtt_conn has a pointer back to us */
+	connection(const connection &) = delete;
+	connection &operator=(const connection &) = delete;
+
+	~connection()
+	{
+#ifdef AMQTT_COROUTINES
+		reqs_.fail();
+#endif
+		mqtt_conn_destroy(mc_);
+	}
+
+	Handler		&handler() const noexcept { return h_; }
+	struct mqtt_conn *get() const noexcept { return mc_; }
+	const char	*errstr() const noexcept { return mqtt_errstr(mc_); }
+	enum mqtt_dead_reason
+			 dead_reason() const noexcept
+			 { return mqtt_dead_reason(mc_); }
+
+	int
+	connect(const mqtt_conn_settings &mcs) noexcept
+	{
+		return mqtt_connect(mc_, &mcs);
+	}
+
+	int
+	connect(std::string_view clientid, unsigned int keep_alive,
+	    bool clean_session = true) noexcept
+	{
+		mqtt_conn_settings mcs{};
+
+		mcs.clean_session = clean_session;
+		mcs.keep_alive = keep_alive;
+		mcs.clientid = clientid.data();
+		mcs.clientid_len = clientid.size();
+
+		return mqtt_connect(mc_, &mcs);
+	}
+
+	void
+	input(const void *buf, size_t len) noexcept
+	{
+		mqtt_input(mc_, buf, len);
+	}
+
+	void
+	input(std::string_view buf) noexcept
+	{
+		mqtt_input(mc_, buf.data(), buf.size());
+	}
+
+	void
+	inputv(const struct iovec *iov, int iovcnt) noexcept
+	{
+		mqtt_inputv(mc_, iov, iovcnt);
+	}
+
+	void		 output() noexcept { mqtt_output(mc_); }
+	void		 timeout() noexcept { mqtt_timeout(mc_); }
+
+	int
+	publish(std::string_view topic, std::string_view payload,
+	    mqtt_qos qos = MQTT_QOS0,
+	    mqtt_retain retain = MQTT_NORETAIN) noexcept
+	{
+		return mqtt_publish(mc_, topic.data(), topic.size(),
+		    payload.data(), payload.size(), qos, retain);
+	}
+
+	int
+	subscribe(std::string_view filter, mqtt_qos qos = MQTT_QOS0,
+	    void *cookie = nullptr) noexcept
+	{
+		return mqtt_subscribe(mc_, cookie,
+		    filter.data(), filter.size(), qos);
+	}
+
+	int
+	unsubscribe(std::string_view filter, void *cookie = nullptr) noexcept
+	{
+		return mqtt_unsubscribe(mc_, cookie,
+		    filter.data(), filter.size());
+	}
+
+	int		 ping() noexcept { return mqtt_ping(mc_); }
+
+	int
+	connack(bool session_present, mqtt_connack_code code) noexcept
+	{
+		return mqtt_connack(mc_, session_present, code);
+	}
+
+	int
+	suback(unsigned int pid, span<const uint8_t> rcodes) noexcept
+	{
+		return mqtt_suback(mc_, pid, rcodes.data(), rcodes.size());
+	}
+
+	int
+	unsuback(unsigned int pid) noexcept
+	{
+		return mqtt_unsuback(mc_, pid);
+	}
+
+	size_t		 memused() const noexcept { return mqtt_memused(mc_); }
+
+#ifdef AMQTT_COROUTINES
+	/*
+	 * awaiters are built in place in the coroutine frame and must
+	 * not be moved, so they're only made by the functions below.
+	 */
+	template <class Result, class Start>
+	class awaiter : detail::request {
+	public:
+		awaiter(connection &c, Start start,
+		    uint8_t *rcodes = nullptr, size_t n = 0) noexcept
+		    : c_(c), start_(start)
+		{
+			if (rcodes == nullptr) {
+				rcodes = &rcode_;
+				n = 1;
+			}
+			this->rcodes = rcodes;
+			this->nrcodes = n;
+		}
+
+		bool	 await_ready() const noexcept { return false; }
+
+		bool
+		await_suspend(std::coroutine_handle<> h) noexcept
+		{
+			handle = h;
+			c_.reqs_.insert(this);
+
+			suspending = true;
+			if (start_(c_.mc_, cookie()) == -1) {
+				c_.reqs_.remove(this);
+				done = true;
+			}
+			suspending = false;
+
+			return !done;
+		}
+
+		Result
+		await_resume() const noexcept
+		{
+			if constexpr (std::is_same_v<Result, uint8_t>)
+				return acked ? rcode_ : MQTT_SUBACK_FAILURE;
+			else
+				return acked;
+		}
+
+	private:
+		connection	&c_;
+		Start		 start_;
+		uint8_t		 rcode_ = MQTT_SUBACK_FAILURE;
+	};
+
+	/* resumes with the return code, or MQTT_SUBACK_FAILURE */
+	auto
+	async_subscribe(std::string_view filter, mqtt_qos qos = MQTT_QOS0)
+	    noexcept
+	{
+		auto start = [filter, qos](struct mqtt_conn *mc, void *cookie) {
+			return mqtt_subscribe(mc, cookie,
+			    filter.data(), filter.size(), qos);
+		};
+		return awaiter<uint8_t, decltype(start)>(*this, start);
+	}
+
+	/* resumes with true once acked, with the codes in rcodes */
+	auto
+	async_subscribe(span<const mqtt_topic> topics, span<uint8_t> rcodes)
+	    noexcept
+	{
+		auto start = [topics](struct mqtt_conn *mc, void *cookie) {
+			return mqtt_subscribev(mc, cookie,
+			    topics.data(), topics.size());
+		};
+		return awaiter<bool, decltype(start)>(*this, start,
+		    rcodes.data(), rcodes.size());
+	}
+
+	auto
+	async_unsubscribe(std::string_view filter) noexcept
+	{
+		auto start = [filter](struct mqtt_conn *mc, void *cookie) {
+			return mqtt_unsubscribe(mc, cookie,
+			    filter.data(), filter.size());
+		};
+		return awaiter<bool, decltype(start)>(*this, start);
+	}
+
+	auto
+	async_unsubscribe(span<const mqtt_topic> topics) noexcept
+	{
+		auto start = [topics](struct mqtt_conn *mc, void *cookie) {
+			return mqtt_unsubscribev(mc, cookie,
+			    topics.data(), topics.size());
+		};
+		return awaiter<bool, decltype(start)>(*this, start);
+	}
+#endif /* AMQTT_COROUTINES */
+
+private:
+	Handler		&h_;
+	struct mqtt_conn *mc_;
+#ifdef AMQTT_COROUTINES
+	detail::requests reqs_;
+
+	/* returns true if the cookie was one of ours */
+	bool
+	ack(void *cookie, const uint8_t *rcodes, size_t n) noexcept
+	{
+		detail::request *r = detail::request::from(cookie);
+
+		if (r == nullptr)
+			return false;
+
+		reqs_.remove(r);
+		r->complete(rcodes, n, true);
+		return true;
+	}
+#endif
+
+	static connection &
+	self(struct mqtt_conn *mc) noexcept
+	{
+		return *static_cast<connection *>(mqtt_cookie(mc));
+	}
+
+	static void
+	want_output_cb(struct mqtt_conn *mc)
+	{
+		connection &c = self(mc);
+		c.h_.want_output(c);
+	}
+
+	static ssize_t
+	output_cb(struct mqtt_conn *mc, const void *buf, size_t len)
+	{
+		connection &c = self(mc);
+		return c.h_.output(c,
+		    std::string_view(static_cast<const char *>(buf), len));
+	}
+
+	static ssize_t
+	output_fd_cb(struct mqtt_conn *mc, int fd, off_t off, size_t len)
+	{
+		connection &c = self(mc);
+		return c.h_.output_fd(c, fd, off, len);
+	}
+
+	static void
+	want_timeout_cb(struct mqtt_conn *mc, const struct timespec *ts)
+	{
+		connection &c = self(mc);
+		c.h_.want_timeout(c, *ts);
+	}
+
+	static void
+	dead_cb(struct mqtt_conn *mc)
+	{
+		connection &c = self(mc);
+#ifdef AMQTT_COROUTINES
+		/* the acks aren't coming now */
+		c.reqs_.fail();
+#endif
+		c.h_.dead(c);
+	}
+
+	static void
+	on_drain_cb(struct mqtt_conn *mc)
+	{
+		connection &c = self(mc);
+		c.h_.on_drain(c);
+	}
+
+	/* the library always calls these, so they can't be left out */
+	static void
+	on_connect_cb(struct mqtt_conn *mc)
+	{
+		if constexpr (detail::has<Handler, detail::on_connect_t>) {
+			connection &c = self(mc);
+			c.h_.on_connect(c);
+		}
+	}
+
+	static void
+	on_suback_cb(struct mqtt_conn *mc, void *cookie,
+	    const uint8_t *rcodes, size_t n)
+	{
+		[[maybe_unused]] connection &c = self(mc);
+
+#ifdef AMQTT_COROUTINES
+		if (c.ack(cookie, rcodes, n))
+			return;
+#endif
+		if constexpr (detail::has<Handler, detail::on_suback_t>) {
+			c.h_.on_suback(c, cookie,
+			    span<const uint8_t>(rcodes, n));
+		}
+	}
+
+	static void
+	on_unsuback_cb(struct mqtt_conn *mc, void *cookie)
+	{
+		[[maybe_unused]] connection &c = self(mc);
+
+#ifdef AMQTT_COROUTINES
+		if (c.ack(cookie, nullptr, 0))
+			return;
+#endif
+		if constexpr (detail::has<Handler, detail::on_unsuback_t>) {
+			c.h_.on_unsuback(c, cookie);
+		}
+	}
+
+	static int
+	on_topic_cb(struct mqtt_conn *mc, const char *topic, size_t len,
+	    enum mqtt_qos qos)
+	{
+		connection &c = self(mc);
+		return c.h_.on_topic(c, std::string_view(topic, len), qos);
+	}
+
+	static void
+	on_message_cb(struct mqtt_conn *mc, char *topic, size_t topic_len,
+	    char *payload, size_t payload_len, enum mqtt_qos qos)
+	{
+		struct guard {
+			char *t, *p;
+			~guard() { std::free(t); std::free(p); }
+		} g{ topic, payload };
+
+		if constexpr (detail::has<Handler, detail::on_message_t>) {
+			connection &c = self(mc);
+			c.h_.on_message(c,
+			    std::string_view(topic, topic_len),
+			    std::string_view(payload, payload_len), qos);
+		}
+	}
+
+	static void
+	on_msg_cb(struct mqtt_conn *mc, struct mqtt_msg *m)
+	{
+		connection &c = self(mc);
+		c.h_.on_msg(c, msg(m));
+	}
+
+	static void
+	on_conn_cb(struct mqtt_conn *mc, const struct mqtt_conn_settings *mcs)
+	{
+		connection &c = self(mc);
+		c.h_.on_conn(c, *mcs);
+	}
+
+	static void
+	on_subscribe_cb(struct mqtt_conn *mc, unsigned int pid,
+	    const struct mqtt_topic *topics, size_t n)
+	{
+		connection &c = self(mc);
+		c.h_.on_subscribe(c, pid, span<const mqtt_topic>(topics, n));
+	}
+
+	static void
+	on_unsubscribe_cb(struct mqtt_conn *mc, unsigned int pid,
+	    const struct mqtt_topic *topics, size_t n)
+	{
+		connection &c = self(mc);
+		c.h_.on_unsubscribe(c, pid,
+		    span<const mqtt_topic>(topics, n));
+	}
+
+	static void
+	on_disconnect_cb(struct mqtt_conn *mc)
+	{
+		connection &c = self(mc);
+		c.h_.on_disconnect(c);
+	}
+
+	static constexpr mqtt_settings
+	make_settings() noexcept
+	{
+		using namespace detail;
+		mqtt_settings ms{};
+
+		ms.mqtt_want_output = want_output_cb;
+		ms.mqtt_output = output_cb;
+		ms.mqtt_want_timeout = want_timeout_cb;
+		ms.mqtt_dead = dead_cb;
+		ms.mqtt_on_connect = on_connect_cb;
+		ms.mqtt_on_suback = on_suback_cb;
+		ms.mqtt_on_unsuback = on_unsuback_cb;
+		ms.mqtt_on_message = on_message_cb;
+
+		if constexpr (has<Handler, output_fd_t>)
+			ms.mqtt_output_fd = output_fd_cb;
+		if constexpr (has<Handler, on_drain_t>)
+			ms.mqtt_on_drain = on_drain_cb;
+		if constexpr (has<Handler, on_topic_t>)
+			ms.mqtt_on_topic = on_topic_cb;
+		if constexpr (has<Handler, on_msg_t>)
+			ms.mqtt_on_msg = on_msg_cb;
+		if constexpr (has<Handler, on_conn_t>)
+			ms.mqtt_on_conn = on_conn_cb;
+		if constexpr (has<Handler, on_subscribe_t>)
+			ms.mqtt_on_subscribe = on_subscribe_cb;
+		if constexpr (has<Handler, on_unsubscribe_t>)
+			ms.mqtt_on_unsubscribe = on_unsubscribe_cb;
+		if constexpr (has<Handler, on_disconnect_t>)
+			ms.mqtt_on_disconnect = on_disconnect_cb;
+		if constexpr (has<Handler, settings_t>)
+			Handler::settings(ms);
+
+		return ms;
+	}
+
+	static const mqtt_settings settings;
+};
+
+/* make_settings is constexpr, so this is filled in at compile time */
+template <class Handler>
+const mqtt_settings connection<Handler>::settings =
+    connection<Handler>::make_settings();
+
+} /* namespace amqtt */
+
+#endif /* AMQTT_HPP */
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * mqtt_bench compares the C API with the amqtt.hpp wrapper. a buffer
+ * of PUBLISH packets is parsed by a client connection using each
+ * message callback, and publishes are made into an output callback
+ * that throws the bytes away. the handlers do the same trivial work
+ * on each message, so the difference is the cost of the dispatch.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "amqtt.hpp"
+
+static size_t	 nmsgs = 1000000;
+static size_t	 payload_len = 64;
+static int	 rounds = 5;
+
+static std::vector<uint8_t>	 packets;
+static std::string		 payload;
+static const char		 topic[] = "bench/topic/0";
+
+struct bench_state {
+	size_t		 n;
+	size_t		 bytes;
+};
+
+static uint64_t
+nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+packets_build(void)
+{
+	static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+	size_t off;
+	ssize_t len;
+	size_t i;
+
+	payload.assign(payload_len, 'x');
+
+	len = mqtt_encode_publish(NULL, 0, topic, sizeof(topic) - 1,
+	    payload.data(), payload.size(), MQTT_QOS0, MQTT_NORETAIN, 0);
+	if (len == -1)
+		errx(1, "unable to encode publish");
+
+	packets.resize(sizeof(connack) + nmsgs * len);
+	memcpy(packets.data(), connack, sizeof(connack));
+	off = sizeof(connack);
+	for (i = 0; i < nmsgs; i++) {
+		mqtt_encode_publish(packets.data() + off, len,
+		    topic, sizeof(topic) - 1, payload.data(), payload.size(),
+		    MQTT_QOS0, MQTT_NORETAIN, 0);
+		off += len;
+	}
+}
+
+/*
+ * the C API
+ */
+
+static void
+c_want_output(struct mqtt_conn *)
+{
+}
+
+static ssize_t
+c_output(struct mqtt_conn *mc, const void *, size_t len)
+{
+	struct bench_state *bs = (struct bench_state *)mqtt_cookie(mc);
+
+	bs->bytes += len;
+	return (len);
+}
+
+static void
+c_want_timeout(struct mqtt_conn *, const struct timespec *)
+{
+}
+
+static void
+c_dead(struct mqtt_conn *)
+{
+	errx(1, "connection died");
+}
+
+static void
+c_on_connect(struct mqtt_conn *)
+{
+}
+
+static void
+c_on_message(struct mqtt_conn *mc, char *t, size_t tlen,
+    char *p, size_t plen, enum mqtt_qos)
+{
+	struct bench_state *bs = (struct bench_state *)mqtt_cookie(mc);
+
+	bs->n++;
+	bs->bytes += tlen + plen;
+	free(t);
+	free(p);
+}
+
+static void
+c_on_msg(struct mqtt_conn *mc, struct mqtt_msg *msg)
+{
+	struct bench_state *bs = (struct bench_state *)mqtt_cookie(mc);
+	size_t tlen, plen;
+
+	mqtt_msg_topic(msg, &tlen);
+	mqtt_msg_payload(msg, &plen);
+
+	bs->n++;
+	bs->bytes += tlen + plen;
+	mqtt_msg_unref(msg);
+}
+
+/* designated initialisers are C++20 */
+static struct mqtt_settings
+c_settings(void)
+{
+	struct mqtt_settings ms;
+
+	memset(&ms, 0, sizeof(ms));
+	ms.mqtt_want_output = c_want_output;
+	ms.mqtt_output = c_output;
+	ms.mqtt_want_timeout = c_want_timeout;
+	ms.mqtt_on_connect = c_on_connect;
+	ms.mqtt_dead = c_dead;
+
+	return (ms);
+}
+
+static struct mqtt_settings	 c_settings_message;
+static struct mqtt_settings	 c_settings_msg;
+
+static size_t
+c_input(const struct mqtt_settings *ms)
+{
+	struct bench_state bs = { 0, 0 };
+	struct mqtt_conn *mc;
+
+	mc = mqtt_conn_create(ms, &bs);
+	if (mc == NULL)
+		errx(1, "conn create");
+
+	mqtt_input(mc, packets.data(), packets.size());
+	mqtt_conn_destroy(mc);
+
+	return (bs.n);
+}
+
+static size_t
+c_input_message(void)
+{
+	return (c_input(&c_settings_message));
+}
+
+static size_t
+c_input_msg(void)
+{
+	return (c_input(&c_settings_msg));
+}
+
+static size_t
+c_publish(void)
+{
+	struct bench_state bs = { 0, 0 };
+	struct mqtt_conn *mc;
+	size_t i;
+
+	mc = mqtt_conn_create(&c_settings_message, &bs);
+	if (mc == NULL)
+		errx(1, "conn create");
+
+	for (i = 0; i < nmsgs; i++) {
+		if (mqtt_publish(mc, topic, sizeof(topic) - 1,
+		    payload.data(), payload.size(),
+		    MQTT_QOS0, MQTT_NORETAIN) != 0)
+			errx(1, "publish");
+	}
+	mqtt_conn_destroy(mc);
+
+	return (i);
+}
+
+/*
+ * the C++ wrapper
+ */
+
+struct cxx_handler {
+	bench_state	 bs = { 0, 0 };
+
+	template <class C> void
+	want_output(C &)
+	{
+	}
+
+	template <class C> ssize_t
+	output(C &, std::string_view buf)
+	{
+		bs.bytes += buf.size();
+		return (buf.size());
+	}
+
+	template <class C> void
+	want_timeout(C &, const struct timespec &)
+	{
+	}
+
+	template <class C> void
+	dead(C &)
+	{
+		errx(1, "connection died");
+	}
+};
+
+struct cxx_message : cxx_handler {
+	void
+	on_message(amqtt::connection<cxx_message> &, std::string_view t,
+	    std::string_view p, mqtt_qos)
+	{
+		bs.n++;
+		bs.bytes += t.size() + p.size();
+	}
+};
+
+struct cxx_msg : cxx_handler {
+	void
+	on_msg(amqtt::connection<cxx_msg> &, amqtt::msg m)
+	{
+		bs.n++;
+		bs.bytes += m.topic().size() + m.payload().size();
+	}
+};
+
+template <class H>
+static size_t
+cxx_input(void)
+{
+	H h;
+	amqtt::connection<H> c(h);
+
+	c.input(packets.data(), packets.size());
+
+	return (h.bs.n);
+}
+
+static size_t
+cxx_publish(void)
+{
+	cxx_message h;
+	amqtt::connection<cxx_message> c(h);
+	std::string_view t(topic, sizeof(topic) - 1);
+	size_t i;
+
+	for (i = 0; i < nmsgs; i++) {
+		if (c.publish(t, payload) != 0)
+			errx(1, "publish");
+	}
+
+	return (i);
+}
+
+static void
+run(const char *name, size_t (*fn)(void))
+{
+	uint64_t best = UINT64_MAX, t;
+	int i;
+
+	for (i = 0; i < rounds; i++) {
+		t = nsecs();
+		if ((*fn)() != nmsgs)
+			errx(1, "%s: lost messages", name);
+		t = nsecs() - t;
+		if (t < best)
+			best = t;
+	}
+
+	printf("%-24s %8.1f ns/msg %10.0f msgs/s\n", name,
+	    (double)best / nmsgs, nmsgs / ((double)best / 1000000000.0));
+}
+
+__dead static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-n msgs] [-r rounds] [-s size]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *errstr;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:r:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nmsgs = strtonum(optarg, 1, 100000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "msgs %s: %s", optarg, errstr);
+			break;
+		case 'r':
+			rounds = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "rounds %s: %s", optarg, errstr);
+			break;
+		case 's':
+			payload_len = strtonum(optarg, 0, 1 << 20, &errstr);
+			if (errstr != NULL)
+				errx(1, "size %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage();
+
+	c_settings_message = c_settings();
+	c_settings_message.mqtt_on_message = c_on_message;
+	c_settings_msg = c_settings();
+	c_settings_msg.mqtt_on_msg = c_on_msg;
+
+	packets_build();
+
+	printf("%zu messages, %zu byte payloads, best of %d\n",
+	    nmsgs, payload_len, rounds);
+	run("C on_message", c_input_message);
+	run("C++ on_message", cxx_input<cxx_message>);
+	run("C on_msg", c_input_msg);
+	run("C++ on_msg", cxx_input<cxx_msg>);
+	run("C publish", c_publish);
+	run("C++ publish", cxx_publish);
+
+	return (0);
+}
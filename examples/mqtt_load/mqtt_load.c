@@ -0,0 +1,1781 @@
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * mqtt_load runs a fleet of client connections spread over a few
+ * event loop threads. every connection subscribes to one topic and
+ * publishes to random topics at a fixed rate. the first 8 bytes of
+ * each payload are the time it was published, so the subscriber
+ * side can measure the end to end latency through the broker.
+ *
+ * -b runs a small broker on the server role of the library in its
+ * own thread instead of using an external one. it only does exact
+ * topic matches and forwards everything at QOS0, which is enough to
+ * load the client side and itself.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/queue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <errno.h>
+#include <err.h>
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <event.h>
+#include "amqtt.h"
+
+#ifndef nitems
+#define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+#define LOAD_PAYLOAD_MAX	(1 << 20)
+#define LOAD_HIWAT		(1 << 20)
+#define LOAD_CONNECT_BURST	64	/* per thread per tick */
+#define LOAD_TICK_USEC		10000
+
+/*
+ * latency histogram. values under LOAD_HIST_SUB get their own
+ * bucket, after that each power of 2 is split into LOAD_HIST_SUB
+ * buckets, which keeps the error under 7%.
+ */
+#define LOAD_HIST_SHIFT		4
+#define LOAD_HIST_SUB		(1 << LOAD_HIST_SHIFT)
+#define LOAD_HIST_BUCKETS	((64 - LOAD_HIST_SHIFT + 1) * LOAD_HIST_SUB)
+
+struct load_hist {
+	uint64_t		 h_buckets[LOAD_HIST_BUCKETS];
+};
+
+/* only written by the owning thread, read by the reporter */
+struct load_stats {
+	uint64_t		 s_conns;
+	uint64_t		 s_failed;
+	uint64_t		 s_dead;
+	uint64_t		 s_pubs;
+	uint64_t		 s_pub_bytes;
+	uint64_t		 s_blocked;
+	uint64_t		 s_msgs;
+	uint64_t		 s_msg_bytes;
+	uint64_t		 s_subfail;
+	struct load_hist	 s_lat;
+};
+
+#define load_get(_p)		__atomic_load_n((_p), __ATOMIC_RELAXED)
+#define load_add(_p, _n)	__atomic_store_n((_p), *(_p) + (_n), \
+				    __ATOMIC_RELAXED)
+
+enum load_size {
+	LOAD_SIZE_FIXED,
+	LOAD_SIZE_UNIFORM,
+	LOAD_SIZE_EXP,
+};
+
+struct load_conf {
+	struct sockaddr_storage	 ss;
+	socklen_t		 sslen;
+
+	unsigned int		 nconns;
+	unsigned int		 nthreads;
+	unsigned int		 keepalive;
+	enum mqtt_qos		 qos;
+
+	double			 rate;
+	struct timeval		 interval;
+
+	unsigned int		 fanout;
+	unsigned int		 ntopics;
+	char			**topics;
+	struct mqtt_publish_template
+				**templates;
+
+	enum load_size		 size;
+	unsigned int		 size_min;
+	unsigned int		 size_max;
+	double			 size_mean;
+};
+
+static struct load_conf load_conf;
+static struct load_thread *load_threads;
+static int load_stopping;
+static volatile sig_atomic_t load_signalled;
+
+enum load_state {
+	LOAD_S_IDLE,
+	LOAD_S_CONNECTING,
+	LOAD_S_MQTT,
+	LOAD_S_CONNECTED,
+	LOAD_S_DEAD,
+};
+
+struct load_thread;
+
+struct load_conn {
+	struct load_thread	*lc_thread;
+	struct mqtt_conn	*lc_mc;
+	unsigned int		 lc_id;
+	enum load_state		 lc_state;
+	int			 lc_fd;
+
+	struct event		 lc_ev_rd;
+	struct event		 lc_ev_wr;
+	struct event		 lc_ev_tmo;
+	struct event		 lc_ev_pub;
+
+	TAILQ_ENTRY(load_conn)	 lc_entry;
+};
+
+TAILQ_HEAD(load_conns, load_conn);
+
+struct load_thread {
+	pthread_t		 lt_thread;
+	struct event_base	*lt_base;
+	struct event		 lt_tick;
+
+	struct load_conn	*lt_conns;
+	unsigned int		 lt_nconns;
+	unsigned int		 lt_started;
+	struct load_conns	 lt_reap;
+
+	char			*lt_payload;
+	char			 lt_buf[128 << 10];
+	char			 lt_errstr[128];
+
+	struct load_stats	 lt_stats;
+};
+
+static void		*load_thread(void *);
+static void		 load_tick(int, short, void *);
+static void		 load_conn_start(struct load_conn *);
+static void		 load_conn_fail(struct load_conn *, const char *);
+static void		 load_connected(int, short, void *);
+
+static void		 load_rd(int, short, void *);
+static void		 load_wr(int, short, void *);
+static void		 load_tmo(int, short, void *);
+static void		 load_pub(int, short, void *);
+
+static void		 load_mqtt_want_output(struct mqtt_conn *);
+static ssize_t		 load_mqtt_output(struct mqtt_conn *,
+			     const void *, size_t);
+static void		 load_mqtt_want_timeout(struct mqtt_conn *,
+			     const struct timespec *);
+static void		 load_mqtt_on_connect(struct mqtt_conn *);
+static void		 load_mqtt_on_msg(struct mqtt_conn *,
+			     struct mqtt_msg *);
+static void		 load_mqtt_on_suback(struct mqtt_conn *, void *,
+			     const uint8_t *, size_t);
+static void		 load_mqtt_dead(struct mqtt_conn *);
+
+static const struct mqtt_settings load_mqtt_settings = {
+	.mqtt_output_hiwat = LOAD_HIWAT,
+	.mqtt_output_lowat = LOAD_HIWAT / 2,
+
+	.mqtt_want_output = load_mqtt_want_output,
+	.mqtt_output = load_mqtt_output,
+	.mqtt_want_timeout = load_mqtt_want_timeout,
+
+	.mqtt_on_connect = load_mqtt_on_connect,
+	.mqtt_on_msg = load_mqtt_on_msg,
+	.mqtt_on_suback = load_mqtt_on_suback,
+	.mqtt_dead = load_mqtt_dead,
+};
+
+/* broker stand-in */
+
+#define BROKER_HASH		4096
+
+struct broker_conn;
+
+struct broker_sub {
+	struct broker_conn	*bs_conn;
+	struct broker_topic	*bs_topic;
+	TAILQ_ENTRY(broker_sub)	 bs_tentry;
+	TAILQ_ENTRY(broker_sub)	 bs_centry;
+};
+
+TAILQ_HEAD(broker_subs, broker_sub);
+
+struct broker_topic {
+	TAILQ_ENTRY(broker_topic)
+				 bt_entry;
+	struct broker_subs	 bt_subs;
+	size_t			 bt_len;
+	char			 bt_name[];
+};
+
+TAILQ_HEAD(broker_topics, broker_topic);
+
+struct broker;
+
+struct broker_conn {
+	struct broker		*bc_broker;
+	struct mqtt_conn	*bc_mc;
+	int			 bc_fd;
+	int			 bc_dead;
+
+	struct event		 bc_ev_rd;
+	struct event		 bc_ev_wr;
+	struct event		 bc_ev_tmo;
+
+	struct broker_subs	 bc_subs;
+	TAILQ_ENTRY(broker_conn) bc_entry;
+};
+
+TAILQ_HEAD(broker_conns, broker_conn);
+
+struct broker {
+	pthread_t		 b_thread;
+	struct event_base	*b_base;
+	struct event		 b_ev_accept;
+	struct event		 b_tick;
+	int			 b_fd;
+
+	struct broker_topics	 b_topics[BROKER_HASH];
+	struct broker_conns	 b_reap;
+	char			 b_buf[128 << 10];
+
+	uint64_t		 b_conns;
+	uint64_t		 b_msgs;
+	uint64_t		 b_fwd;
+	uint64_t		 b_drops;
+};
+
+static struct broker	*broker_create(const char *);
+static void		*broker_thread(void *);
+static void		 broker_tick(int, short, void *);
+static void		 broker_accept(int, short, void *);
+static void		 broker_conn_dead(struct broker_conn *);
+
+static void		 broker_rd(int, short, void *);
+static void		 broker_wr(int, short, void *);
+static void		 broker_tmo(int, short, void *);
+
+static void		 broker_mqtt_want_output(struct mqtt_conn *);
+static ssize_t		 broker_mqtt_output(struct mqtt_conn *,
+			     const void *, size_t);
+static void		 broker_mqtt_want_timeout(struct mqtt_conn *,
+			     const struct timespec *);
+static void		 broker_mqtt_on_conn(struct mqtt_conn *,
+			     const struct mqtt_conn_settings *);
+static void		 broker_mqtt_on_msg(struct mqtt_conn *,
+			     struct mqtt_msg *);
+static void		 broker_mqtt_on_subscribe(struct mqtt_conn *,
+			     unsigned int, const struct mqtt_topic *, size_t);
+static void		 broker_mqtt_on_unsubscribe(struct mqtt_conn *,
+			     unsigned int, const struct mqtt_topic *, size_t);
+static void		 broker_mqtt_dead(struct mqtt_conn *);
+
+static const struct mqtt_settings broker_mqtt_settings = {
+	.mqtt_output_hiwat = LOAD_HIWAT,
+	.mqtt_output_lowat = LOAD_HIWAT / 2,
+
+	.mqtt_want_output = broker_mqtt_want_output,
+	.mqtt_output = broker_mqtt_output,
+	.mqtt_want_timeout = broker_mqtt_want_timeout,
+
+	.mqtt_on_msg = broker_mqtt_on_msg,
+	.mqtt_dead = broker_mqtt_dead,
+
+	.mqtt_on_conn = broker_mqtt_on_conn,
+	.mqtt_on_subscribe = broker_mqtt_on_subscribe,
+	.mqtt_on_unsubscribe = broker_mqtt_on_unsubscribe,
+};
+
+static int		setnbio(int);
+static int		setnodelay(int);
+static uint64_t		load_now(void);
+static void		load_resolve(int, const char *, const char *);
+static void		load_size_parse(const char *);
+static void		load_report(const struct broker *, double, int);
+
+__dead static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-46b] [-c conns] [-d duration]"
+	    " [-f fanout] [-h host] [-i interval]\n"
+	    "\t[-k keepalive] [-p port] [-q qos] [-r rate] [-s size]"
+	    " [-t prefix] [-w threads]\n", __progname);
+
+	exit(1);
+}
+
+static void
+load_signal(int sig)
+{
+	load_signalled = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct load_conf *conf = &load_conf;
+	struct load_thread *lt;
+	struct broker *b = NULL;
+	const char *host = NULL;
+	const char *port = NULL;
+	const char *prefix = "amqtt/load";
+	int family = AF_UNSPEC;
+	int run_broker = 0;
+	unsigned int duration = 0;
+	unsigned int interval = 1;
+	unsigned int i, n;
+	struct sigaction sa;
+	struct rlimit rl;
+	struct timespec start, now, ts;
+	char portbuf[NI_MAXSERV];
+	const char *errstr;
+	char *ep;
+	int ch;
+
+	conf->nconns = 1000;
+	conf->nthreads = 4;
+	conf->keepalive = 60;
+	conf->qos = MQTT_QOS0;
+	conf->rate = 1.0;
+	conf->fanout = 1;
+	conf->size = LOAD_SIZE_FIXED;
+	conf->size_min = conf->size_max = 64;
+
+	while ((ch = getopt(argc, argv, "46bc:d:f:h:i:k:p:q:r:s:t:w:")) != -1) {
+		switch (ch) {
+		case '4':
+			family = AF_INET;
+			break;
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'b':
+			run_broker = 1;
+			break;
+		case 'c':
+			conf->nconns = strtonum(optarg, 1, 1 << 24, &errstr);
+			if (errstr != NULL)
+				errx(1, "conns %s: %s", optarg, errstr);
+			break;
+		case 'd':
+			duration = strtonum(optarg, 1, 86400 * 7, &errstr);
+			if (errstr != NULL)
+				errx(1, "duration %s: %s", optarg, errstr);
+			break;
+		case 'f':
+			conf->fanout = strtonum(optarg, 0, 1 << 24, &errstr);
+			if (errstr != NULL)
+				errx(1, "fanout %s: %s", optarg, errstr);
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'i':
+			interval = strtonum(optarg, 1, 3600, &errstr);
+			if (errstr != NULL)
+				errx(1, "interval %s: %s", optarg, errstr);
+			break;
+		case 'k':
+			conf->keepalive = strtonum(optarg, 0, 0xffff, &errstr);
+			if (errstr != NULL)
+				errx(1, "keepalive %s: %s", optarg, errstr);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'q':
+			conf->qos = strtonum(optarg, MQTT_QOS0, MQTT_QOS2,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "qos %s: %s", optarg, errstr);
+			break;
+		case 'r':
+			errno = 0;
+			conf->rate = strtod(optarg, &ep);
+			if (ep == optarg || *ep != '\0' || errno != 0 ||
+			    conf->rate < 0.0 || conf->rate > 1000000.0)
+				errx(1, "rate %s: invalid", optarg);
+			break;
+		case 's':
+			load_size_parse(optarg);
+			break;
+		case 't':
+			prefix = optarg;
+			break;
+		case 'w':
+			conf->nthreads = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "threads %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (run_broker) {
+		struct sockaddr_storage ss;
+		socklen_t sslen = sizeof(ss);
+
+		if (host != NULL)
+			errx(1, "-b and -h are mutually exclusive");
+
+		b = broker_create(port != NULL ? port : "0");
+		if (getsockname(b->b_fd, (struct sockaddr *)&ss, &sslen) == -1)
+			err(1, "broker getsockname");
+		if (getnameinfo((struct sockaddr *)&ss, sslen, NULL, 0,
+		    portbuf, sizeof(portbuf), NI_NUMERICSERV) != 0)
+			errx(1, "broker port");
+
+		host = "127.0.0.1";
+		port = portbuf;
+	}
+	if (host == NULL) {
+		warnx("host unspecified");
+		usage();
+	}
+	load_resolve(family, host, port != NULL ? port : "1883");
+
+	if (conf->nthreads > conf->nconns)
+		conf->nthreads = conf->nconns;
+
+	/* fan-out is the number of subscribers on each topic */
+	if (conf->fanout == 0)
+		conf->ntopics = conf->nconns;
+	else if (conf->fanout > conf->nconns)
+		conf->ntopics = 1;
+	else
+		conf->ntopics = conf->nconns / conf->fanout;
+
+	conf->topics = calloc(conf->ntopics, sizeof(*conf->topics));
+	conf->templates = calloc(conf->ntopics, sizeof(*conf->templates));
+	if (conf->topics == NULL || conf->templates == NULL)
+		err(1, "topics");
+	for (i = 0; i < conf->ntopics; i++) {
+		int rv;
+
+		rv = asprintf(&conf->topics[i], "%s/%u", prefix, i);
+		if (rv == -1)
+			errx(1, "topic");
+
+		/* XXX the library only publishes at QOS0 so far */
+		conf->templates[i] = mqtt_publish_template_create(
+		    conf->topics[i], rv, MQTT_QOS0, MQTT_NORETAIN);
+		if (conf->templates[i] == NULL)
+			errx(1, "publish template %s", conf->topics[i]);
+	}
+
+	if (conf->rate > 0.0) {
+		double secs = 1.0 / conf->rate;
+
+		conf->interval.tv_sec = secs;
+		conf->interval.tv_usec = (secs - conf->interval.tv_sec) *
+		    1000000.0;
+		if (!timerisset(&conf->interval))
+			conf->interval.tv_usec = 1;
+	}
+
+	/* every connection needs a descriptor, and the broker another */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		err(1, "getrlimit");
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+		warn("setrlimit");
+	n = conf->nconns * (run_broker ? 2 : 1) + 32;
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < n) {
+		warnx("open file limit %llu is too low for %u connections",
+		    (unsigned long long)rl.rlim_cur, conf->nconns);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = load_signal;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, NULL) == -1 ||
+	    sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "sigaction");
+
+	load_threads = calloc(conf->nthreads, sizeof(*load_threads));
+	if (load_threads == NULL)
+		err(1, "threads");
+
+	for (i = 0; i < conf->nthreads; i++) {
+		unsigned int first = (uint64_t)conf->nconns * i /
+		    conf->nthreads;
+		unsigned int last = (uint64_t)conf->nconns * (i + 1) /
+		    conf->nthreads;
+		unsigned int c;
+
+		lt = &load_threads[i];
+		lt->lt_base = event_base_new();
+		if (lt->lt_base == NULL)
+			errx(1, "event base");
+
+		lt->lt_nconns = last - first;
+		lt->lt_conns = calloc(lt->lt_nconns, sizeof(*lt->lt_conns));
+		if (lt->lt_conns == NULL)
+			err(1, "conns");
+		TAILQ_INIT(&lt->lt_reap);
+
+		for (c = 0; c < lt->lt_nconns; c++) {
+			struct load_conn *lc = &lt->lt_conns[c];
+
+			lc->lc_thread = lt;
+			lc->lc_id = first + c;
+			lc->lc_state = LOAD_S_IDLE;
+			lc->lc_fd = -1;
+		}
+
+		lt->lt_payload = malloc(conf->size_max);
+		if (lt->lt_payload == NULL)
+			err(1, "payload");
+		memset(lt->lt_payload, 'x', conf->size_max);
+
+		evtimer_set(&lt->lt_tick, load_tick, lt);
+		event_base_set(lt->lt_base, &lt->lt_tick);
+	}
+
+	printf("%u conns on %u threads to %s port %s, %u topics,"
+	    " %.3f msgs/s per conn\n", conf->nconns, conf->nthreads,
+	    host, port != NULL ? port : "1883", conf->ntopics, conf->rate);
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < conf->nthreads; i++) {
+		lt = &load_threads[i];
+		if (pthread_create(&lt->lt_thread, NULL, load_thread, lt) != 0)
+			errx(1, "pthread_create");
+	}
+
+	for (n = 1; !load_signalled; n++) {
+		ts.tv_sec = start.tv_sec + n * interval;
+		ts.tv_nsec = start.tv_nsec;
+		while (!load_signalled && clock_nanosleep(CLOCK_MONOTONIC,
+		    TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		if (load_signalled)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		load_report(b, (now.tv_sec - start.tv_sec) +
+		    (now.tv_nsec - start.tv_nsec) / 1000000000.0, 0);
+
+		if (duration != 0 && n * interval >= duration)
+			break;
+	}
+
+	__atomic_store_n(&load_stopping, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < conf->nthreads; i++)
+		pthread_join(load_threads[i].lt_thread, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	load_report(b, (now.tv_sec - start.tv_sec) +
+	    (now.tv_nsec - start.tv_nsec) / 1000000000.0, 1);
+
+	return (0);
+}
+
+static void
+load_resolve(int family, const char *host, const char *port)
+{
+	struct load_conf *conf = &load_conf;
+	struct addrinfo hints, *res0;
+	int error;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	error = getaddrinfo(host, port, &hints, &res0);
+	if (error) {
+		errx(1, "host %s port %s: %s", host, port,
+		    gai_strerror(error));
+	}
+
+	/* all the connections go to the first address */
+	memcpy(&conf->ss, res0->ai_addr, res0->ai_addrlen);
+	conf->sslen = res0->ai_addrlen;
+
+	freeaddrinfo(res0);
+}
+
+/*
+ * payload sizes are either fixed (64), uniform between a min and max
+ * (16-4096), or exponential around a mean (~256). they have room for
+ * the timestamp at least.
+ */
+static void
+load_size_parse(const char *arg)
+{
+	struct load_conf *conf = &load_conf;
+	const char *errstr;
+	char *s, *min, *max;
+
+	if (arg[0] == '~') {
+		conf->size_mean = strtonum(arg + 1, sizeof(uint64_t),
+		    LOAD_PAYLOAD_MAX, &errstr);
+		if (errstr != NULL)
+			errx(1, "size mean %s: %s", arg + 1, errstr);
+
+		conf->size = LOAD_SIZE_EXP;
+		conf->size_min = sizeof(uint64_t);
+		conf->size_max = LOAD_PAYLOAD_MAX;
+		return;
+	}
+
+	s = strdup(arg);
+	if (s == NULL)
+		err(1, "size");
+
+	max = s;
+	min = strsep(&max, "-");
+
+	conf->size_min = strtonum(min, sizeof(uint64_t),
+	    LOAD_PAYLOAD_MAX, &errstr);
+	if (errstr != NULL)
+		errx(1, "size %s: %s", min, errstr);
+
+	if (max == NULL) {
+		conf->size = LOAD_SIZE_FIXED;
+		conf->size_max = conf->size_min;
+	} else {
+		conf->size_max = strtonum(max, conf->size_min,
+		    LOAD_PAYLOAD_MAX, &errstr);
+		if (errstr != NULL)
+			errx(1, "size %s: %s", max, errstr);
+		conf->size = LOAD_SIZE_UNIFORM;
+	}
+
+	free(s);
+}
+
+static size_t
+load_size(void)
+{
+	const struct load_conf *conf = &load_conf;
+	double u, v;
+
+	switch (conf->size) {
+	case LOAD_SIZE_FIXED:
+		break;
+	case LOAD_SIZE_UNIFORM:
+		return (conf->size_min +
+		    arc4random_uniform(conf->size_max - conf->size_min + 1));
+	case LOAD_SIZE_EXP:
+		u = (arc4random() + 1.0) / 4294967297.0; /* (0, 1] */
+		v = -conf->size_mean * log(u);
+		if (v < conf->size_min)
+			return (conf->size_min);
+		if (v > conf->size_max)
+			return (conf->size_max);
+		return (v);
+	}
+
+	return (conf->size_min);
+}
+
+static uint64_t
+load_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static inline unsigned int
+load_hist_bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < LOAD_HIST_SUB)
+		return (v);
+
+	e = 63 - __builtin_clzll(v);
+	return ((e - LOAD_HIST_SHIFT + 1) * LOAD_HIST_SUB +
+	    ((v >> (e - LOAD_HIST_SHIFT)) & (LOAD_HIST_SUB - 1)));
+}
+
+/* the smallest value that lands in bucket b */
+static uint64_t
+load_hist_value(unsigned int b)
+{
+	unsigned int e;
+
+	if (b < LOAD_HIST_SUB)
+		return (b);
+
+	e = b / LOAD_HIST_SUB + LOAD_HIST_SHIFT - 1;
+	return ((uint64_t)(LOAD_HIST_SUB + b % LOAD_HIST_SUB) <<
+	    (e - LOAD_HIST_SHIFT));
+}
+
+static void
+load_hist_add(struct load_hist *h, uint64_t v)
+{
+	load_add(&h->h_buckets[load_hist_bucket(v)], 1);
+}
+
+static uint64_t
+load_hist_total(const struct load_hist *h)
+{
+	uint64_t total = 0;
+	unsigned int b;
+
+	for (b = 0; b < LOAD_HIST_BUCKETS; b++)
+		total += h->h_buckets[b];
+
+	return (total);
+}
+
+static double
+load_hist_pct(const struct load_hist *h, uint64_t total, double pct)
+{
+	uint64_t sum = 0, want;
+	unsigned int b;
+
+	if (total == 0)
+		return (0.0);
+
+	want = ceil(total * pct / 100.0);
+	if (want == 0)
+		want = 1;
+
+	for (b = 0; b < LOAD_HIST_BUCKETS; b++) {
+		sum += h->h_buckets[b];
+		if (sum >= want)
+			break;
+	}
+	if (b == LOAD_HIST_BUCKETS)
+		b--;
+
+	return (load_hist_value(b) / 1000.0);
+}
+
+static void
+load_stats_sum(struct load_stats *sum)
+{
+	const struct load_stats *st;
+	unsigned int i, b;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (i = 0; i < load_conf.nthreads; i++) {
+		st = &load_threads[i].lt_stats;
+
+		sum->s_conns += load_get(&st->s_conns);
+		sum->s_failed += load_get(&st->s_failed);
+		sum->s_dead += load_get(&st->s_dead);
+		sum->s_pubs += load_get(&st->s_pubs);
+		sum->s_pub_bytes += load_get(&st->s_pub_bytes);
+		sum->s_blocked += load_get(&st->s_blocked);
+		sum->s_msgs += load_get(&st->s_msgs);
+		sum->s_msg_bytes += load_get(&st->s_msg_bytes);
+		sum->s_subfail += load_get(&st->s_subfail);
+
+		for (b = 0; b < LOAD_HIST_BUCKETS; b++) {
+			sum->s_lat.h_buckets[b] +=
+			    load_get(&st->s_lat.h_buckets[b]);
+		}
+	}
+}
+
+static void
+load_report(const struct broker *b, double elapsed, int final)
+{
+	static struct load_stats prev, cur;
+	static struct load_hist lat;
+	static double then;
+	const struct load_hist *h;
+	double secs;
+	uint64_t total;
+	unsigned int i;
+
+	load_stats_sum(&cur);
+
+	if (!final) {
+		secs = elapsed - then;
+		for (i = 0; i < LOAD_HIST_BUCKETS; i++) {
+			lat.h_buckets[i] = cur.s_lat.h_buckets[i] -
+			    prev.s_lat.h_buckets[i];
+		}
+		total = load_hist_total(&lat);
+
+		printf("%7.1fs conns %llu pub/s %.0f recv/s %.0f"
+		    " rx MB/s %.2f blocked %llu lost %llu"
+		    " p50 %.0fus p99 %.0fus p99.9 %.0fus\n", elapsed,
+		    (unsigned long long)cur.s_conns,
+		    (cur.s_pubs - prev.s_pubs) / secs,
+		    (cur.s_msgs - prev.s_msgs) / secs,
+		    (cur.s_msg_bytes - prev.s_msg_bytes) / secs / 1e6,
+		    (unsigned long long)(cur.s_blocked - prev.s_blocked),
+		    (unsigned long long)(cur.s_failed + cur.s_dead),
+		    load_hist_pct(&lat, total, 50.0),
+		    load_hist_pct(&lat, total, 99.0),
+		    load_hist_pct(&lat, total, 99.9));
+		fflush(stdout);
+
+		prev = cur;
+		then = elapsed;
+		return;
+	}
+
+	h = &cur.s_lat;
+	total = load_hist_total(h);
+
+	printf("\n%.1f seconds\n", elapsed);
+	printf("conns: %llu up, %llu failed, %llu died,"
+	    " %llu subscriptions refused\n",
+	    (unsigned long long)cur.s_conns,
+	    (unsigned long long)cur.s_failed,
+	    (unsigned long long)cur.s_dead,
+	    (unsigned long long)cur.s_subfail);
+	for (i = 0; i < load_conf.nthreads; i++) {
+		const char *errstr = load_threads[i].lt_errstr;
+
+		if (errstr[0] != '\0')
+			printf("thread %u last error: %s\n", i, errstr);
+	}
+	printf("published: %llu msgs, %llu bytes, %.0f msgs/s,"
+	    " %llu blocked\n",
+	    (unsigned long long)cur.s_pubs,
+	    (unsigned long long)cur.s_pub_bytes,
+	    cur.s_pubs / elapsed,
+	    (unsigned long long)cur.s_blocked);
+	printf("received: %llu msgs, %llu bytes, %.0f msgs/s\n",
+	    (unsigned long long)cur.s_msgs,
+	    (unsigned long long)cur.s_msg_bytes,
+	    cur.s_msgs / elapsed);
+	printf("latency us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f"
+	    " p99.99 %.1f max %.1f\n",
+	    load_hist_pct(h, total, 50.0),
+	    load_hist_pct(h, total, 90.0),
+	    load_hist_pct(h, total, 99.0),
+	    load_hist_pct(h, total, 99.9),
+	    load_hist_pct(h, total, 99.99),
+	    load_hist_pct(h, total, 100.0));
+
+	if (b != NULL) {
+		printf("broker: %llu conns, %llu msgs in, %llu forwarded,"
+		    " %llu dropped\n",
+		    (unsigned long long)load_get(&b->b_conns),
+		    (unsigned long long)load_get(&b->b_msgs),
+		    (unsigned long long)load_get(&b->b_fwd),
+		    (unsigned long long)load_get(&b->b_drops));
+	}
+}
+
+static int
+setnbio(int fd)
+{
+	int nbio = 1;
+
+	return (ioctl(fd, FIONBIO, &nbio));
+}
+
+static int
+setnodelay(int fd)
+{
+	int on = 1;
+
+	return (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)));
+}
+
+/*
+ * load generator threads
+ */
+
+static void *
+load_thread(void *arg)
+{
+	struct load_thread *lt = arg;
+	struct timeval tv = { 0, LOAD_TICK_USEC };
+
+	evtimer_add(&lt->lt_tick, &tv);
+	event_base_dispatch(lt->lt_base);
+
+	return (NULL);
+}
+
+static void
+load_tick(int nil, short events, void *arg)
+{
+	struct load_thread *lt = arg;
+	struct load_conn *lc;
+	struct timeval tv = { 0, LOAD_TICK_USEC };
+	unsigned int i;
+
+	while ((lc = TAILQ_FIRST(&lt->lt_reap)) != NULL) {
+		TAILQ_REMOVE(&lt->lt_reap, lc, lc_entry);
+		mqtt_conn_destroy(lc->lc_mc);
+		lc->lc_mc = NULL;
+	}
+
+	if (__atomic_load_n(&load_stopping, __ATOMIC_RELAXED)) {
+		event_base_loopexit(lt->lt_base, NULL);
+		return;
+	}
+
+	/* don't hit the broker with every connection at once */
+	for (i = 0; i < LOAD_CONNECT_BURST &&
+	    lt->lt_started < lt->lt_nconns; i++)
+		load_conn_start(&lt->lt_conns[lt->lt_started++]);
+
+	evtimer_add(&lt->lt_tick, &tv);
+}
+
+/*
+ * the mqtt_conn is only destroyed from the tick because this can be
+ * called from inside its callbacks.
+ */
+static void
+load_conn_dead(struct load_conn *lc, const char *errstr)
+{
+	struct load_thread *lt = lc->lc_thread;
+	struct load_stats *st = &lt->lt_stats;
+
+	switch (lc->lc_state) {
+	case LOAD_S_DEAD:
+		return;
+	case LOAD_S_CONNECTED:
+		load_add(&st->s_conns, -1);
+		/* FALLTHROUGH */
+	case LOAD_S_MQTT:
+		load_add(&st->s_dead, 1);
+		break;
+	case LOAD_S_IDLE:
+	case LOAD_S_CONNECTING:
+		load_add(&st->s_failed, 1);
+		break;
+	}
+
+	if (lc->lc_state != LOAD_S_IDLE) {
+		event_del(&lc->lc_ev_rd);
+		event_del(&lc->lc_ev_wr);
+		event_del(&lc->lc_ev_tmo);
+		event_del(&lc->lc_ev_pub);
+	}
+	if (lc->lc_fd != -1) {
+		close(lc->lc_fd);
+		lc->lc_fd = -1;
+	}
+
+	strlcpy(lt->lt_errstr, errstr, sizeof(lt->lt_errstr));
+	lc->lc_state = LOAD_S_DEAD;
+	if (lc->lc_mc != NULL)
+		TAILQ_INSERT_TAIL(&lt->lt_reap, lc, lc_entry);
+}
+
+static void
+load_conn_fail(struct load_conn *lc, const char *what)
+{
+	char errstr[128];
+
+	snprintf(errstr, sizeof(errstr), "%s: %s", what, strerror(errno));
+	load_conn_dead(lc, errstr);
+}
+
+static void
+load_conn_start(struct load_conn *lc)
+{
+	const struct load_conf *conf = &load_conf;
+	struct load_thread *lt = lc->lc_thread;
+	int fd;
+
+	lc->lc_mc = mqtt_conn_create(&load_mqtt_settings, lc);
+	if (lc->lc_mc == NULL) {
+		load_conn_fail(lc, "mqtt_conn_create");
+		return;
+	}
+
+	fd = socket(conf->ss.ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		load_conn_fail(lc, "socket");
+		return;
+	}
+	lc->lc_fd = fd;
+
+	if (setnbio(fd) == -1 || setnodelay(fd) == -1) {
+		load_conn_fail(lc, "socket options");
+		return;
+	}
+
+	event_set(&lc->lc_ev_rd, fd, EV_READ|EV_PERSIST, load_rd, lc);
+	event_base_set(lt->lt_base, &lc->lc_ev_rd);
+	event_set(&lc->lc_ev_wr, fd, EV_WRITE, load_connected, lc);
+	event_base_set(lt->lt_base, &lc->lc_ev_wr);
+	evtimer_set(&lc->lc_ev_tmo, load_tmo, lc);
+	event_base_set(lt->lt_base, &lc->lc_ev_tmo);
+	evtimer_set(&lc->lc_ev_pub, load_pub, lc);
+	event_base_set(lt->lt_base, &lc->lc_ev_pub);
+	lc->lc_state = LOAD_S_CONNECTING;
+
+	if (connect(fd, (struct sockaddr *)&conf->ss, conf->sslen) == -1 &&
+	    errno != EINPROGRESS) {
+		load_conn_fail(lc, "connect");
+		return;
+	}
+
+	event_add(&lc->lc_ev_wr, NULL);
+}
+
+static void
+load_connected(int fd, short events, void *arg)
+{
+	const struct load_conf *conf = &load_conf;
+	struct load_conn *lc = arg;
+	struct load_thread *lt = lc->lc_thread;
+	struct mqtt_conn_settings mcs;
+	char clientid[64];
+	socklen_t len;
+	int error;
+
+	len = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1) {
+		load_conn_fail(lc, "getsockopt");
+		return;
+	}
+	if (error != 0) {
+		errno = error;
+		load_conn_fail(lc, "connect");
+		return;
+	}
+
+	event_set(&lc->lc_ev_wr, fd, EV_WRITE, load_wr, lc);
+	event_base_set(lt->lt_base, &lc->lc_ev_wr);
+	event_add(&lc->lc_ev_rd, NULL);
+	lc->lc_state = LOAD_S_MQTT;
+
+	snprintf(clientid, sizeof(clientid), "amqtt-load-%ld-%u",
+	    (long)getpid(), lc->lc_id);
+
+	memset(&mcs, 0, sizeof(mcs));
+	mcs.clean_session = 1;
+	mcs.keep_alive = conf->keepalive;
+	mcs.clientid = clientid;
+	mcs.clientid_len = strlen(clientid);
+
+	if (mqtt_connect(lc->lc_mc, &mcs) == -1)
+		load_conn_dead(lc, "mqtt connect failed");
+}
+
+static void
+load_rd(int fd, short events, void *arg)
+{
+	struct load_conn *lc = arg;
+	struct load_thread *lt = lc->lc_thread;
+	ssize_t rv;
+
+	rv = read(fd, lt->lt_buf, sizeof(lt->lt_buf));
+	switch (rv) {
+	case -1:
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return;
+		default:
+			break;
+		}
+		load_conn_fail(lc, "read");
+		return;
+	case 0:
+		load_conn_dead(lc, "disconnected");
+		return;
+	default:
+		break;
+	}
+
+	mqtt_input(lc->lc_mc, lt->lt_buf, rv);
+}
+
+static void
+load_wr(int fd, short events, void *arg)
+{
+	struct load_conn *lc = arg;
+
+	mqtt_output(lc->lc_mc);
+}
+
+static void
+load_tmo(int nil, short events, void *arg)
+{
+	struct load_conn *lc = arg;
+
+	mqtt_timeout(lc->lc_mc);
+}
+
+static void
+load_pub(int nil, short events, void *arg)
+{
+	const struct load_conf *conf = &load_conf;
+	struct load_conn *lc = arg;
+	struct load_thread *lt = lc->lc_thread;
+	struct load_stats *st = &lt->lt_stats;
+	size_t len = load_size();
+	uint64_t now;
+	int rv;
+
+	now = load_now();
+	memcpy(lt->lt_payload, &now, sizeof(now));
+
+	rv = mqtt_publish_template_send(lc->lc_mc,
+	    conf->templates[arc4random_uniform(conf->ntopics)],
+	    lt->lt_payload, len);
+	switch (rv) {
+	case 0:
+		load_add(&st->s_pubs, 1);
+		load_add(&st->s_pub_bytes, len);
+		break;
+	case MQTT_WOULDBLOCK:
+		load_add(&st->s_blocked, 1);
+		break;
+	default:
+		load_conn_dead(lc, "publish failed");
+		return;
+	}
+
+	/* the publish may have tried to write and found the conn dead */
+	if (lc->lc_state == LOAD_S_CONNECTED)
+		evtimer_add(&lc->lc_ev_pub, &conf->interval);
+}
+
+static void
+load_mqtt_want_output(struct mqtt_conn *mc)
+{
+	struct load_conn *lc = mqtt_cookie(mc);
+
+	if (lc->lc_state != LOAD_S_DEAD)
+		event_add(&lc->lc_ev_wr, NULL);
+}
+
+static ssize_t
+load_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
+{
+	struct load_conn *lc = mqtt_cookie(mc);
+	ssize_t rv;
+
+	if (lc->lc_state == LOAD_S_DEAD)
+		return (-1);
+
+	rv = write(lc->lc_fd, buf, len);
+	if (rv == -1) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return (0);
+		default:
+			break;
+		}
+
+		load_conn_fail(lc, "write");
+	}
+
+	return (rv);
+}
+
+static void
+load_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+{
+	struct load_conn *lc = mqtt_cookie(mc);
+	struct timeval tv;
+
+	if (lc->lc_state == LOAD_S_DEAD)
+		return;
+
+	TIMESPEC_TO_TIMEVAL(&tv, ts);
+	evtimer_add(&lc->lc_ev_tmo, &tv);
+}
+
+static void
+load_mqtt_on_connect(struct mqtt_conn *mc)
+{
+	const struct load_conf *conf = &load_conf;
+	struct load_conn *lc = mqtt_cookie(mc);
+	struct load_stats *st = &lc->lc_thread->lt_stats;
+	const char *topic;
+	struct timeval tv;
+	uint64_t usec;
+
+	lc->lc_state = LOAD_S_CONNECTED;
+	load_add(&st->s_conns, 1);
+
+	if (conf->fanout > 0) {
+		topic = conf->topics[lc->lc_id % conf->ntopics];
+		if (mqtt_subscribe(mc, NULL, topic, strlen(topic),
+		    conf->qos) == -1) {
+			load_conn_dead(lc, "subscribe failed");
+			return;
+		}
+	}
+
+	if (conf->rate > 0.0) {
+		/* start at a random point so the publishes are spread out */
+		usec = conf->interval.tv_sec * 1000000ULL +
+		    conf->interval.tv_usec;
+		if (usec > UINT32_MAX)
+			usec = UINT32_MAX;
+		usec = arc4random_uniform(usec);
+
+		tv.tv_sec = usec / 1000000;
+		tv.tv_usec = usec % 1000000;
+		evtimer_add(&lc->lc_ev_pub, &tv);
+	}
+}
+
+static void
+load_mqtt_on_msg(struct mqtt_conn *mc, struct mqtt_msg *msg)
+{
+	struct load_conn *lc = mqtt_cookie(mc);
+	struct load_stats *st = &lc->lc_thread->lt_stats;
+	const char *payload;
+	size_t len;
+	uint64_t then, now;
+
+	payload = mqtt_msg_payload(msg, &len);
+	if (len >= sizeof(then)) {
+		memcpy(&then, payload, sizeof(then));
+		now = load_now();
+		if (now >= then)
+			load_hist_add(&st->s_lat, now - then);
+	}
+
+	load_add(&st->s_msgs, 1);
+	load_add(&st->s_msg_bytes, len);
+
+	mqtt_msg_unref(msg);
+}
+
+static void
+load_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
+    const uint8_t *rcodes, size_t nrcodes)
+{
+	struct load_conn *lc = mqtt_cookie(mc);
+	struct load_stats *st = &lc->lc_thread->lt_stats;
+	size_t i;
+
+	for (i = 0; i < nrcodes; i++) {
+		if (rcodes[i] == MQTT_SUBACK_FAILURE)
+			load_add(&st->s_subfail, 1);
+	}
+}
+
+static void
+load_mqtt_dead(struct mqtt_conn *mc)
+{
+	struct load_conn *lc = mqtt_cookie(mc);
+	const char *errstr = mqtt_errstr(mc);
+
+	load_conn_dead(lc, errstr != NULL ? errstr : "mqtt dead");
+}
+
+/*
+ * broker stand-in
+ */
+
+static struct broker *
+broker_create(const char *port)
+{
+	struct broker *b;
+	struct addrinfo hints, *res;
+	struct timeval tv = { 0, 100000 };
+	unsigned int i;
+	int error, fd;
+	int on = 1;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		err(1, "broker");
+
+	for (i = 0; i < nitems(b->b_topics); i++)
+		TAILQ_INIT(&b->b_topics[i]);
+	TAILQ_INIT(&b->b_reap);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+
+	error = getaddrinfo("127.0.0.1", port, &hints, &res);
+	if (error)
+		errx(1, "broker port %s: %s", port, gai_strerror(error));
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd == -1)
+		err(1, "broker socket");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+		err(1, "broker reuseaddr");
+	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1)
+		err(1, "broker bind port %s", port);
+	if (listen(fd, SOMAXCONN) == -1)
+		err(1, "broker listen");
+	if (setnbio(fd) == -1)
+		err(1, "broker set non-blocking");
+
+	freeaddrinfo(res);
+
+	b->b_fd = fd;
+	b->b_base = event_base_new();
+	if (b->b_base == NULL)
+		errx(1, "broker event base");
+
+	event_set(&b->b_ev_accept, fd, EV_READ|EV_PERSIST, broker_accept, b);
+	event_base_set(b->b_base, &b->b_ev_accept);
+	event_add(&b->b_ev_accept, NULL);
+
+	evtimer_set(&b->b_tick, broker_tick, b);
+	event_base_set(b->b_base, &b->b_tick);
+	evtimer_add(&b->b_tick, &tv);
+
+	if (pthread_create(&b->b_thread, NULL, broker_thread, b) != 0)
+		errx(1, "broker pthread_create");
+
+	return (b);
+}
+
+static void *
+broker_thread(void *arg)
+{
+	struct broker *b = arg;
+
+	event_base_dispatch(b->b_base);
+
+	return (NULL);
+}
+
+static uint32_t
+broker_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261U; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static struct broker_topic *
+broker_topic_get(struct broker *b, const char *name, size_t len,
+    int create)
+{
+	struct broker_topics *bts;
+	struct broker_topic *bt;
+
+	bts = &b->b_topics[broker_hash(name, len) % nitems(b->b_topics)];
+	TAILQ_FOREACH(bt, bts, bt_entry) {
+		if (bt->bt_len == len && memcmp(bt->bt_name, name, len) == 0)
+			return (bt);
+	}
+
+	if (!create)
+		return (NULL);
+
+	bt = malloc(sizeof(*bt) + len);
+	if (bt == NULL)
+		return (NULL);
+
+	TAILQ_INIT(&bt->bt_subs);
+	bt->bt_len = len;
+	memcpy(bt->bt_name, name, len);
+	TAILQ_INSERT_TAIL(bts, bt, bt_entry);
+
+	return (bt);
+}
+
+static void
+broker_topic_put(struct broker *b, struct broker_topic *bt)
+{
+	struct broker_topics *bts;
+
+	if (!TAILQ_EMPTY(&bt->bt_subs))
+		return;
+
+	bts = &b->b_topics[broker_hash(bt->bt_name, bt->bt_len) %
+	    nitems(b->b_topics)];
+	TAILQ_REMOVE(bts, bt, bt_entry);
+	free(bt);
+}
+
+/* only exact matches, there's no wildcard support */
+static int
+broker_subscribe(struct broker_conn *bc, const char *filter, size_t len)
+{
+	struct broker *b = bc->bc_broker;
+	struct broker_topic *bt;
+	struct broker_sub *bs;
+
+	if (memchr(filter, '+', len) != NULL ||
+	    memchr(filter, '#', len) != NULL)
+		return (-1);
+
+	bt = broker_topic_get(b, filter, len, 1);
+	if (bt == NULL)
+		return (-1);
+
+	TAILQ_FOREACH(bs, &bc->bc_subs, bs_centry) {
+		if (bs->bs_topic == bt)
+			return (0);
+	}
+
+	bs = malloc(sizeof(*bs));
+	if (bs == NULL) {
+		broker_topic_put(b, bt);
+		return (-1);
+	}
+
+	bs->bs_conn = bc;
+	bs->bs_topic = bt;
+	TAILQ_INSERT_TAIL(&bt->bt_subs, bs, bs_tentry);
+	TAILQ_INSERT_TAIL(&bc->bc_subs, bs, bs_centry);
+
+	return (0);
+}
+
+static void
+broker_unsub(struct broker_conn *bc, struct broker_sub *bs)
+{
+	struct broker_topic *bt = bs->bs_topic;
+
+	TAILQ_REMOVE(&bc->bc_subs, bs, bs_centry);
+	TAILQ_REMOVE(&bt->bt_subs, bs, bs_tentry);
+	broker_topic_put(bc->bc_broker, bt);
+	free(bs);
+}
+
+static void
+broker_tick(int nil, short events, void *arg)
+{
+	struct broker *b = arg;
+	struct broker_conn *bc;
+	struct broker_sub *bs;
+	struct timeval tv = { 0, 100000 };
+
+	while ((bc = TAILQ_FIRST(&b->b_reap)) != NULL) {
+		TAILQ_REMOVE(&b->b_reap, bc, bc_entry);
+
+		while ((bs = TAILQ_FIRST(&bc->bc_subs)) != NULL)
+			broker_unsub(bc, bs);
+
+		mqtt_conn_destroy(bc->bc_mc);
+		free(bc);
+	}
+
+	evtimer_add(&b->b_tick, &tv);
+}
+
+static void
+broker_accept(int lfd, short events, void *arg)
+{
+	struct broker *b = arg;
+	struct broker_conn *bc;
+	int fd;
+
+	for (;;) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd == -1) {
+			switch (errno) {
+			case EAGAIN:
+			case EINTR:
+			case ECONNABORTED:
+				return;
+			case EMFILE:
+			case ENFILE:
+				warn("broker accept");
+				return;
+			default:
+				break;
+			}
+			err(1, "broker accept");
+		}
+
+		if (setnbio(fd) == -1 || setnodelay(fd) == -1) {
+			warn("broker socket options");
+			close(fd);
+			continue;
+		}
+
+		bc = malloc(sizeof(*bc));
+		if (bc == NULL) {
+			warn("broker conn");
+			close(fd);
+			continue;
+		}
+
+		bc->bc_mc = mqtt_conn_create_server(&broker_mqtt_settings, bc);
+		if (bc->bc_mc == NULL) {
+			warn("broker mqtt conn");
+			free(bc);
+			close(fd);
+			continue;
+		}
+
+		bc->bc_broker = b;
+		bc->bc_fd = fd;
+		bc->bc_dead = 0;
+		TAILQ_INIT(&bc->bc_subs);
+
+		event_set(&bc->bc_ev_rd, fd, EV_READ|EV_PERSIST,
+		    broker_rd, bc);
+		event_base_set(b->b_base, &bc->bc_ev_rd);
+		event_set(&bc->bc_ev_wr, fd, EV_WRITE, broker_wr, bc);
+		event_base_set(b->b_base, &bc->bc_ev_wr);
+		evtimer_set(&bc->bc_ev_tmo, broker_tmo, bc);
+		event_base_set(b->b_base, &bc->bc_ev_tmo);
+
+		event_add(&bc->bc_ev_rd, NULL);
+		load_add(&b->b_conns, 1);
+	}
+}
+
+/*
+ * subscriptions are left in place until the tick reaps the conn,
+ * because this can be called while a publish is being forwarded to
+ * the subscribers of a topic.
+ */
+static void
+broker_conn_dead(struct broker_conn *bc)
+{
+	struct broker *b = bc->bc_broker;
+
+	if (bc->bc_dead)
+		return;
+	bc->bc_dead = 1;
+
+	event_del(&bc->bc_ev_rd);
+	event_del(&bc->bc_ev_wr);
+	event_del(&bc->bc_ev_tmo);
+	close(bc->bc_fd);
+	bc->bc_fd = -1;
+
+	load_add(&b->b_conns, -1);
+	TAILQ_INSERT_TAIL(&b->b_reap, bc, bc_entry);
+}
+
+static void
+broker_rd(int fd, short events, void *arg)
+{
+	struct broker_conn *bc = arg;
+	struct broker *b = bc->bc_broker;
+	ssize_t rv;
+
+	rv = read(fd, b->b_buf, sizeof(b->b_buf));
+	switch (rv) {
+	case -1:
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return;
+		default:
+			break;
+		}
+		/* FALLTHROUGH */
+	case 0:
+		broker_conn_dead(bc);
+		return;
+	default:
+		break;
+	}
+
+	mqtt_input(bc->bc_mc, b->b_buf, rv);
+}
+
+static void
+broker_wr(int fd, short events, void *arg)
+{
+	struct broker_conn *bc = arg;
+
+	mqtt_output(bc->bc_mc);
+}
+
+static void
+broker_tmo(int nil, short events, void *arg)
+{
+	struct broker_conn *bc = arg;
+
+	mqtt_timeout(bc->bc_mc);
+}
+
+static void
+broker_mqtt_want_output(struct mqtt_conn *mc)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+
+	if (!bc->bc_dead)
+		event_add(&bc->bc_ev_wr, NULL);
+}
+
+static ssize_t
+broker_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+	ssize_t rv;
+
+	if (bc->bc_dead)
+		return (-1);
+
+	rv = write(bc->bc_fd, buf, len);
+	if (rv == -1) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return (0);
+		default:
+			break;
+		}
+
+		broker_conn_dead(bc);
+	}
+
+	return (rv);
+}
+
+static void
+broker_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+	struct timeval tv;
+
+	if (bc->bc_dead)
+		return;
+
+	TIMESPEC_TO_TIMEVAL(&tv, ts);
+	evtimer_add(&bc->bc_ev_tmo, &tv);
+}
+
+static void
+broker_mqtt_on_conn(struct mqtt_conn *mc,
+    const struct mqtt_conn_settings *mcs)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+
+	if (mqtt_connack(mc, 0, MQTT_CONN_ACCEPTED) == -1)
+		broker_conn_dead(bc);
+}
+
+static void
+broker_mqtt_on_msg(struct mqtt_conn *mc, struct mqtt_msg *msg)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+	struct broker *b = bc->bc_broker;
+	struct broker_topic *bt;
+	struct broker_sub *bs;
+	const char *topic, *payload;
+	size_t topic_len, payload_len;
+
+	topic = mqtt_msg_topic(msg, &topic_len);
+	payload = mqtt_msg_payload(msg, &payload_len);
+	load_add(&b->b_msgs, 1);
+
+	bt = broker_topic_get(b, topic, topic_len, 0);
+	if (bt != NULL) {
+		TAILQ_FOREACH(bs, &bt->bt_subs, bs_tentry) {
+			struct broker_conn *sbc = bs->bs_conn;
+
+			if (!sbc->bc_dead && mqtt_publish(sbc->bc_mc,
+			    topic, topic_len, payload, payload_len,
+			    MQTT_QOS0, MQTT_NORETAIN) == 0)
+				load_add(&b->b_fwd, 1);
+			else
+				load_add(&b->b_drops, 1);
+		}
+	}
+
+	mqtt_msg_unref(msg);
+}
+
+static void
+broker_mqtt_on_subscribe(struct mqtt_conn *mc, unsigned int pid,
+    const struct mqtt_topic *topics, size_t n)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+	uint8_t *rcodes;
+	size_t i;
+
+	rcodes = malloc(n);
+	if (rcodes == NULL) {
+		broker_conn_dead(bc);
+		return;
+	}
+
+	/* everything is forwarded at QOS0 */
+	for (i = 0; i < n; i++) {
+		rcodes[i] = broker_subscribe(bc,
+		    topics[i].filter, topics[i].len) == -1 ?
+		    MQTT_SUBACK_FAILURE : MQTT_QOS0;
+	}
+
+	if (mqtt_suback(mc, pid, rcodes, n) == -1)
+		broker_conn_dead(bc);
+
+	free(rcodes);
+}
+
+static void
+broker_mqtt_on_unsubscribe(struct mqtt_conn *mc, unsigned int pid,
+    const struct mqtt_topic *topics, size_t n)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+	struct broker_topic *bt;
+	struct broker_sub *bs;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		bt = broker_topic_get(bc->bc_broker,
+		    topics[i].filter, topics[i].len, 0);
+		if (bt == NULL)
+			continue;
+
+		TAILQ_FOREACH(bs, &bc->bc_subs, bs_centry) {
+			if (bs->bs_topic == bt)
+				break;
+		}
+		if (bs != NULL)
+			broker_unsub(bc, bs);
+	}
+
+	if (mqtt_unsuback(mc, pid) == -1)
+		broker_conn_dead(bc);
+}
+
+static void
+broker_mqtt_dead(struct mqtt_conn *mc)
+{
+	struct broker_conn *bc = mqtt_cookie(mc);
+
+	broker_conn_dead(bc);
+}
@@ -18,6 +18,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +30,8 @@
 #include <errno.h>
 #include <err.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
 
 #include <event.h>
 #include "amqtt.h"
@@ -39,6 +43,14 @@
 static int		test_connect(int, const char *, const char *);
 static int		setnbio(int);
 
+/* -n */
+static unsigned long long	bench_count;
+static unsigned long long	bench_msgs;
+static unsigned long long	bench_bytes;
+static struct timespec		bench_start;
+
+static void			test_bench(size_t);
+
 struct test {
 	struct mqtt_conn	*mc;
 	struct event		 ev_rd;
@@ -97,8 +109,8 @@ usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-46l] [-k keepalive] [-p port]"
-	    " -d deviceid -h host topic...\n", __progname);
+	fprintf(stderr, "usage: %s [-46l] [-k keepalive] [-n count]"
+	    " [-p port]\n\t-d deviceid -h host topic...\n", __progname);
 
 	exit(1);
 }
@@ -120,7 +132,7 @@ main(int argc, char *argv[])
 	const char *errstr;
 	int fd;
 
-	while ((ch = getopt(argc, argv, "46d:h:k:lp:")) != -1) {
+	while ((ch = getopt(argc, argv, "46d:h:k:ln:p:")) != -1) {
 		switch (ch) {
 		case '4':
 			family = AF_INET;
@@ -142,6 +154,11 @@ main(int argc, char *argv[])
 		case 'l':
 			lwt = 1;
 			break;
+		case 'n':
+			bench_count = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count %s: %s", optarg, errstr);
+			break;
 		case 'p':
 			port = optarg;
 			break;
@@ -394,6 +411,7 @@ test_mqtt_on_connect(struct mqtt_conn *mc)
 {
 	struct test *test = mqtt_cookie(mc);
 	static const char online[] = "Online";
+	struct mqtt_topic *topics;
 	int i;
 
 	if (test->will_topic != NULL) {
@@ -403,12 +421,22 @@ test_mqtt_on_connect(struct mqtt_conn *mc)
 			errx(1, "mqtt_publish %s %s", test->will_topic, online);
 	}
 
+	topics = calloc(test->argc, sizeof(*topics));
+	if (topics == NULL)
+		err(1, "topics");
+
 	for (i = 0; i < test->argc; i++) {
 		const char *arg = test->argv[i];
-		if (mqtt_subscribe(mc, NULL,
-		    arg, strlen(arg), MQTT_QOS0) == -1)
-			errx(1, "mqtt_subscribe %s", arg);
+
+		topics[i].filter = arg;
+		topics[i].len = strlen(arg);
+		topics[i].qos = MQTT_QOS0;
 	}
+
+	if (mqtt_subscribev(mc, NULL, topics, test->argc) == -1)
+		errx(1, "mqtt_subscribev");
+
+	free(topics);
 }
 
 static void
@@ -416,12 +444,48 @@ test_mqtt_on_message(struct mqtt_conn *mc,
     char *topic, size_t topic_len, char *payload, size_t payload_len,
     enum mqtt_qos qos)
 {
-	printf("%s %s\n", topic, payload);
+	if (bench_count > 0)
+		test_bench(topic_len + payload_len);
+	else
+		printf("%s %s\n", topic, payload);
 
 	free(topic);
 	free(payload);
 }
 
+/*
+ * -n counts messages instead of printing them, and reports how long
+ * they took and how much cpu was used once enough have arrived, so
+ * the transports can be compared against the same publisher.
+ */
+static void
+test_bench(size_t len)
+{
+	struct timespec now;
+	struct rusage ru;
+	double secs, cpu;
+
+	if (bench_msgs++ == 0)
+		clock_gettime(CLOCK_MONOTONIC, &bench_start);
+	bench_bytes += len;
+	if (bench_msgs < bench_count)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+
+	secs = (now.tv_sec - bench_start.tv_sec) +
+	    (now.tv_nsec - bench_start.tv_nsec) / 1000000000.0;
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+
+	printf("%llu msgs, %llu bytes in %.3fs: %.0f msgs/s,"
+	    " %.0f ns cpu per msg\n", bench_msgs, bench_bytes, secs,
+	    bench_msgs / secs, cpu * 1000000000.0 / bench_msgs);
+	exit(0);
+}
+
 static void
 test_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
     const uint8_t *rcodes, size_t nrcodes)
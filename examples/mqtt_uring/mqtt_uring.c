@@ -0,0 +1,684 @@
+
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * mqtt_sub, but with the transport driven by Linux io_uring.
+ *
+ * input is fed to mqtt_input() straight out of a provided buffer ring
+ * by a multishot recv, so there is no read syscall per packet and no
+ * copy out of the kernel into a static buffer. output from amqtt is
+ * staged in a per connection buffer and sent with a single send per
+ * pass through the event loop, no matter how many packets were queued.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <limits.h>
+
+#include <liburing.h>
+#include "amqtt.h"
+
+#ifndef nitems
+#define nitems(_a) (sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
+#define URING_ENTRIES		256
+
+#define URING_BGID		0
+#define URING_NBUFS		64	/* must be a power of 2 */
+#define URING_BUFSIZE		(16 << 10)
+
+#define URING_SENDSIZE		(64 << 10)
+
+/* the op is stashed in the low bits of the sqe user_data */
+#define URING_OP_RECV		0
+#define URING_OP_SEND		1
+#define URING_OP_TIMEOUT	2
+#define URING_OP_TIMEOUT_UPD	3
+#define URING_OP_MASK		0x3
+
+struct uring {
+	struct io_uring		 ring;
+	struct io_uring_buf_ring *br;
+	uint8_t			*bufs;
+};
+
+struct uring_conn {
+	struct uring		*ur;
+	struct mqtt_conn	*mc;
+	int			 fd;
+
+	unsigned int		 recving;
+
+	uint8_t			*sbuf;
+	size_t			 slen;		/* bytes staged */
+	size_t			 sinflight;	/* bytes handed to a send */
+	unsigned int		 swant;		/* mqtt_output wants more */
+
+	struct __kernel_timespec tmo;
+	unsigned int		 tmo_armed;
+	unsigned int		 tmo_want;
+
+	const char		*will_topic;
+	size_t			 will_topic_len;
+
+	int			  argc;
+	char			**argv;
+};
+
+static int		uring_init(struct uring *);
+static void		uring_loop(struct uring *, struct uring_conn *);
+static void		uring_recv(struct uring_conn *);
+static void		uring_flush(struct uring_conn *);
+
+static int		test_connect(int, const char *, const char *);
+
+/* -n */
+static unsigned long long	bench_count;
+static unsigned long long	bench_msgs;
+static unsigned long long	bench_bytes;
+static struct timespec		bench_start;
+
+static void			test_bench(size_t);
+
+/* callbacks */
+
+static void	uring_mqtt_want_output(struct mqtt_conn *);
+static ssize_t	uring_mqtt_output(struct mqtt_conn *, const void *, size_t);
+static void	uring_mqtt_want_timeout(struct mqtt_conn *,
+		    const struct timespec *);
+
+static void	test_mqtt_on_connect(struct mqtt_conn *);
+static void	test_mqtt_on_message(struct mqtt_conn *,
+		    char *, size_t, char *, size_t,
+		    enum mqtt_qos);
+static void	test_mqtt_on_suback(struct mqtt_conn *, void *,
+		    const uint8_t *, size_t);
+static void	test_mqtt_dead(struct mqtt_conn *);
+
+static const struct mqtt_settings uring_mqtt_settings = {
+	.mqtt_want_output = uring_mqtt_want_output,
+	.mqtt_output = uring_mqtt_output,
+	.mqtt_want_timeout = uring_mqtt_want_timeout,
+
+	.mqtt_on_connect = test_mqtt_on_connect,
+	.mqtt_on_message = test_mqtt_on_message,
+	.mqtt_on_suback = test_mqtt_on_suback,
+	.mqtt_dead = test_mqtt_dead,
+};
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-46l] [-k keepalive] [-n count]"
+	    " [-p port]\n\t-d deviceid -h host topic...\n", __progname);
+
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct uring ur;
+	struct uring_conn *uc;
+	const char *device = NULL;
+	const char *host = NULL;
+	const char *port = "1883";
+	int lwt = 0;
+	int family = AF_UNSPEC;
+	unsigned int keepalive = 0;
+	char *defv[] = { "#" };
+	char **subv = defv;
+	int subc = nitems(defv);
+	char *ep;
+	unsigned long ul;
+	int ch;
+
+	struct mqtt_conn_settings mcs = {
+		.clean_session = 1,
+	};
+
+	while ((ch = getopt(argc, argv, "46d:h:k:ln:p:")) != -1) {
+		switch (ch) {
+		case '4':
+			family = AF_INET;
+			break;
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'k':
+			errno = 0;
+			ul = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' ||
+			    errno != 0 || ul < 1 || ul > 0xffff)
+				errx(1, "keepalive %s: invalid", optarg);
+			keepalive = ul;
+			break;
+		case 'l':
+			lwt = 1;
+			break;
+		case 'n':
+			errno = 0;
+			bench_count = strtoull(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' ||
+			    errno != 0 || bench_count < 1)
+				errx(1, "count %s: invalid", optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0) {
+		subv = argv;
+		subc = argc;
+	}
+
+	if (host == NULL) {
+		warnx("host unspecified");
+		usage();
+	}
+	if (device == NULL) {
+		warnx("device unspecified");
+		usage();
+	}
+
+	if (uring_init(&ur) == -1)
+		errx(1, "io_uring setup failed");
+
+	uc = calloc(1, sizeof(*uc));
+	if (uc == NULL)
+		err(1, NULL);
+
+	uc->sbuf = malloc(URING_SENDSIZE);
+	if (uc->sbuf == NULL)
+		err(1, NULL);
+
+	uc->ur = &ur;
+	uc->argc = subc;
+	uc->argv = subv;
+	uc->fd = test_connect(family, host, port);
+	/* test_connect will exit itself */
+
+	if (lwt) {
+		static const char offline[] = "Offline";
+		char *will_topic;
+		int rv;
+
+		rv = asprintf(&will_topic, "tele/%s/LWT", device);
+		if (rv == -1)
+			errx(1, "will topic");
+
+		uc->will_topic = will_topic;
+		uc->will_topic_len = rv;
+
+		mcs.will_topic = uc->will_topic;
+		mcs.will_topic_len = uc->will_topic_len;
+		mcs.will_payload = offline;
+		mcs.will_payload_len = sizeof(offline) - 1;
+		mcs.will_retain = 1;
+	}
+
+	uc->mc = mqtt_conn_create(&uring_mqtt_settings, uc);
+	if (uc->mc == NULL)
+		err(1, "create mqtt connection");
+
+	mcs.keep_alive = keepalive;
+	mcs.clientid = device;
+	mcs.clientid_len = strlen(device);
+
+	uring_recv(uc);
+
+	if (mqtt_connect(uc->mc, &mcs) == -1)
+		errx(1, "mqtt connect failed");
+
+	uring_loop(&ur, uc);
+
+	return (0);
+}
+
+static int
+uring_init(struct uring *ur)
+{
+	size_t i;
+	int rv;
+
+	rv = io_uring_queue_init(URING_ENTRIES, &ur->ring, 0);
+	if (rv < 0) {
+		errno = -rv;
+		return (-1);
+	}
+
+	ur->bufs = malloc(URING_NBUFS * URING_BUFSIZE);
+	if (ur->bufs == NULL)
+		return (-1);
+
+	ur->br = io_uring_setup_buf_ring(&ur->ring, URING_NBUFS,
+	    URING_BGID, 0, &rv);
+	if (ur->br == NULL) {
+		errno = -rv;
+		return (-1);
+	}
+
+	for (i = 0; i < URING_NBUFS; i++) {
+		io_uring_buf_ring_add(ur->br, ur->bufs + (i * URING_BUFSIZE),
+		    URING_BUFSIZE, i, io_uring_buf_ring_mask(URING_NBUFS), i);
+	}
+	io_uring_buf_ring_advance(ur->br, URING_NBUFS);
+
+	return (0);
+}
+
+static struct io_uring_sqe *
+uring_sqe(struct uring *ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ur->ring);
+	if (sqe == NULL) {
+		/* the sq is full, push it at the kernel and try again */
+		io_uring_submit(&ur->ring);
+		sqe = io_uring_get_sqe(&ur->ring);
+		if (sqe == NULL)
+			errx(1, "%s: no sqe available", __func__);
+	}
+
+	return (sqe);
+}
+
+static void
+uring_sqe_data(struct io_uring_sqe *sqe, struct uring_conn *uc, int op)
+{
+	io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)uc | op);
+}
+
+static void
+uring_recv(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(uc->ur);
+	io_uring_prep_recv_multishot(sqe, uc->fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	uring_sqe_data(sqe, uc, URING_OP_RECV);
+
+	uc->recving = 1;
+}
+
+static void
+uring_buf_put(struct uring *ur, unsigned int bid)
+{
+	io_uring_buf_ring_add(ur->br, ur->bufs + (bid * URING_BUFSIZE),
+	    URING_BUFSIZE, bid, io_uring_buf_ring_mask(URING_NBUFS), 0);
+	io_uring_buf_ring_advance(ur->br, 1);
+}
+
+static void
+uring_recv_done(struct uring_conn *uc, const struct io_uring_cqe *cqe)
+{
+	struct uring *ur = uc->ur;
+	unsigned int bid;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		uc->recving = 0;
+
+	if (cqe->res < 0) {
+		switch (-cqe->res) {
+		case ENOBUFS:
+			/* we fell behind, rearm below */
+			break;
+		default:
+			errno = -cqe->res;
+			err(1, "%s", __func__);
+		}
+	} else if (cqe->res == 0) {
+		mqtt_disconnect(uc->mc);
+		mqtt_conn_destroy(uc->mc);
+		errx(1, "disconnected");
+	} else {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		mqtt_input(uc->mc, ur->bufs + (bid * URING_BUFSIZE), cqe->res);
+		uring_buf_put(ur, bid);
+	}
+
+	if (!uc->recving)
+		uring_recv(uc);
+}
+
+static void
+uring_flush(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe;
+
+	if (uc->sinflight > 0 || uc->slen == 0)
+		return;
+
+	sqe = uring_sqe(uc->ur);
+	io_uring_prep_send(sqe, uc->fd, uc->sbuf, uc->slen, MSG_NOSIGNAL);
+	uring_sqe_data(sqe, uc, URING_OP_SEND);
+
+	uc->sinflight = uc->slen;
+}
+
+static void
+uring_send_done(struct uring_conn *uc, const struct io_uring_cqe *cqe)
+{
+	size_t sent;
+
+	if (cqe->res < 0) {
+		switch (-cqe->res) {
+		case EAGAIN:
+		case EINTR:
+			sent = 0;
+			break;
+		default:
+			errno = -cqe->res;
+			err(1, "%s", __func__);
+		}
+	} else
+		sent = cqe->res;
+
+	uc->slen -= sent;
+	memmove(uc->sbuf, uc->sbuf + sent, uc->slen);
+	uc->sinflight = 0;
+
+	/* there's room in the staging buffer for amqtt to try again */
+	if (uc->swant) {
+		uc->swant = 0;
+		mqtt_output(uc->mc);
+	}
+}
+
+static void
+uring_timeout(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(uc->ur);
+	if (uc->tmo_armed) {
+		io_uring_prep_timeout_update(sqe, &uc->tmo,
+		    (uint64_t)(uintptr_t)uc | URING_OP_TIMEOUT, 0);
+		uring_sqe_data(sqe, uc, URING_OP_TIMEOUT_UPD);
+	} else {
+		io_uring_prep_timeout(sqe, &uc->tmo, 0, 0);
+		uring_sqe_data(sqe, uc, URING_OP_TIMEOUT);
+		uc->tmo_armed = 1;
+	}
+
+	uc->tmo_want = 0;
+}
+
+static void
+uring_timeout_done(struct uring_conn *uc, const struct io_uring_cqe *cqe)
+{
+	switch (-cqe->res) {
+	case ETIME:
+		uc->tmo_armed = 0;
+		mqtt_timeout(uc->mc);
+		break;
+	case ECANCELED:
+		uc->tmo_armed = 0;
+		break;
+	default:
+		/* updated timeouts complete with 0 and keep going */
+		break;
+	}
+}
+
+static void
+uring_loop(struct uring *ur, struct uring_conn *uc)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head, n;
+	struct uring_conn *cuc;
+	uint64_t data;
+	int rv;
+
+	for (;;) {
+		/* batch everything amqtt produced since the last pass */
+		if (uc->tmo_want)
+			uring_timeout(uc);
+		uring_flush(uc);
+
+		rv = io_uring_submit_and_wait(&ur->ring, 1);
+		if (rv < 0) {
+			if (rv == -EINTR)
+				continue;
+			errno = -rv;
+			err(1, "io_uring_submit_and_wait");
+		}
+
+		n = 0;
+		io_uring_for_each_cqe(&ur->ring, head, cqe) {
+			data = io_uring_cqe_get_data64(cqe);
+			cuc = (struct uring_conn *)(uintptr_t)
+			    (data & ~(uint64_t)URING_OP_MASK);
+
+			switch (data & URING_OP_MASK) {
+			case URING_OP_RECV:
+				uring_recv_done(cuc, cqe);
+				break;
+			case URING_OP_SEND:
+				uring_send_done(cuc, cqe);
+				break;
+			case URING_OP_TIMEOUT:
+				uring_timeout_done(cuc, cqe);
+				break;
+			case URING_OP_TIMEOUT_UPD:
+				break;
+			}
+
+			n++;
+		}
+		io_uring_cq_advance(&ur->ring, n);
+	}
+}
+
+static int
+test_connect(int family, const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *res0;
+	int error, serrno;
+	int fd;
+	const char *cause = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	error = getaddrinfo(host, port, &hints, &res0);
+	if (error) {
+		errx(1, "host %s port %s: %s", host, port,
+		    gai_strerror(error));
+	}
+
+	fd = -1;
+	for (res = res0; res != NULL; res = res->ai_next) {
+		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (fd == -1) {
+			serrno = errno;
+			cause = "socket";
+			continue;
+		}
+
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+			serrno = errno;
+			cause = "connect";
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		break;  /* okay we got one */
+	}
+
+	if (fd == -1) {
+		errno = serrno;
+		err(1, "host %s port %s %s", host, port, cause);
+	}
+
+	freeaddrinfo(res0);
+
+	return (fd);
+}
+
+static void
+uring_mqtt_want_output(struct mqtt_conn *mc)
+{
+	struct uring_conn *uc = mqtt_cookie(mc);
+
+	uc->swant = 1;
+}
+
+static ssize_t
+uring_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
+{
+	struct uring_conn *uc = mqtt_cookie(mc);
+	size_t space = URING_SENDSIZE - uc->slen;
+
+	/*
+	 * the bytes handed to an in-flight send are at the front of
+	 * the buffer and don't move until it completes, so it's safe
+	 * to keep appending behind them.
+	 */
+	if (len > space)
+		len = space;
+
+	memcpy(uc->sbuf + uc->slen, buf, len);
+	uc->slen += len;
+
+	return (len);
+}
+
+static void
+uring_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+{
+	struct uring_conn *uc = mqtt_cookie(mc);
+
+	uc->tmo.tv_sec = ts->tv_sec;
+	uc->tmo.tv_nsec = ts->tv_nsec;
+	uc->tmo_want = 1;
+}
+
+static void
+test_mqtt_on_connect(struct mqtt_conn *mc)
+{
+	struct uring_conn *uc = mqtt_cookie(mc);
+	static const char online[] = "Online";
+	int i;
+
+	if (uc->will_topic != NULL) {
+		if (mqtt_publish(mc, uc->will_topic, uc->will_topic_len,
+		    online, sizeof(online) - 1,
+		    MQTT_QOS0, 1) == -1)
+			errx(1, "mqtt_publish %s %s", uc->will_topic, online);
+	}
+
+	for (i = 0; i < uc->argc; i++) {
+		const char *arg = uc->argv[i];
+		if (mqtt_subscribe(mc, NULL,
+		    arg, strlen(arg), MQTT_QOS0) == -1)
+			errx(1, "mqtt_subscribe %s", arg);
+	}
+}
+
+static void
+test_mqtt_on_message(struct mqtt_conn *mc,
+    char *topic, size_t topic_len, char *payload, size_t payload_len,
+    enum mqtt_qos qos)
+{
+	if (bench_count > 0)
+		test_bench(topic_len + payload_len);
+	else
+		printf("%s %s\n", topic, payload);
+
+	free(topic);
+	free(payload);
+}
+
+/*
+ * -n counts messages instead of printing them, and reports how long
+ * they took and how much cpu was used once enough have arrived, so
+ * the transports can be compared against the same publisher.
+ */
+static void
+test_bench(size_t len)
+{
+	struct timespec now;
+	struct rusage ru;
+	double secs, cpu;
+
+	if (bench_msgs++ == 0)
+		clock_gettime(CLOCK_MONOTONIC, &bench_start);
+	bench_bytes += len;
+	if (bench_msgs < bench_count)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+
+	secs = (now.tv_sec - bench_start.tv_sec) +
+	    (now.tv_nsec - bench_start.tv_nsec) / 1000000000.0;
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+
+	printf("%llu msgs, %llu bytes in %.3fs: %.0f msgs/s,"
+	    " %.0f ns cpu per msg\n", bench_msgs, bench_bytes, secs,
+	    bench_msgs / secs, cpu * 1000000000.0 / bench_msgs);
+	exit(0);
+}
+
+static void
+test_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
+    const uint8_t *rcodes, size_t nrcodes)
+{
+
+}
+
+static void
+test_mqtt_dead(struct mqtt_conn *mc)
+{
+	errx(1, "%s", __func__);
+}
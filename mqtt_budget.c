@@ -0,0 +1,119 @@
+/* */
+
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * a memory budget shared by any number of connections, possibly on
+ * different threads. the connections account what they allocate
+ * against it, and when it is exhausted work that can be dropped
+ * (QOS0 publishes) is refused or shed instead of being queued.
+ *
+ * charges that can't be refused, eg, control packets, always succeed
+ * and may take the budget over its limit.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "amqtt.h"
+
+struct mqtt_budget {
+	size_t			 mb_limit;
+	size_t			 mb_used;
+	uint64_t		 mb_shed;
+};
+
+struct mqtt_budget *
+mqtt_budget_create(size_t limit)
+{
+	struct mqtt_budget *mb;
+
+	if (limit == 0)
+		return (NULL);
+
+	mb = malloc(sizeof(*mb));
+	if (mb == NULL)
+		return (NULL);
+
+	mb->mb_limit = limit;
+	mb->mb_used = 0;
+	mb->mb_shed = 0;
+
+	return (mb);
+}
+
+/* connections have to be destroyed or moved off the budget first */
+void
+mqtt_budget_destroy(struct mqtt_budget *mb)
+{
+	free(mb);
+}
+
+/*
+ * returns 0 if len bytes fit in the budget and have been charged to
+ * it, or -1 if they don't, in which case the work is counted as shed.
+ */
+int
+mqtt_budget_charge(struct mqtt_budget *mb, size_t len)
+{
+	size_t used, nused;
+
+	used = __atomic_load_n(&mb->mb_used, __ATOMIC_RELAXED);
+	do {
+		nused = used + len;
+		if (nused > mb->mb_limit || nused < used) {
+			__atomic_add_fetch(&mb->mb_shed, 1, __ATOMIC_RELAXED);
+			return (-1);
+		}
+	} while (!__atomic_compare_exchange_n(&mb->mb_used, &used, nused,
+	    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return (0);
+}
+
+void
+mqtt_budget_add(struct mqtt_budget *mb, size_t len)
+{
+	__atomic_add_fetch(&mb->mb_used, len, __ATOMIC_RELAXED);
+}
+
+void
+mqtt_budget_rele(struct mqtt_budget *mb, size_t len)
+{
+	__atomic_sub_fetch(&mb->mb_used, len, __ATOMIC_RELAXED);
+}
+
+size_t
+mqtt_budget_used(const struct mqtt_budget *mb)
+{
+	return (__atomic_load_n(&mb->mb_used, __ATOMIC_RELAXED));
+}
+
+size_t
+mqtt_budget_limit(const struct mqtt_budget *mb)
+{
+	return (mb->mb_limit);
+}
+
+uint64_t
+mqtt_budget_shed(const struct mqtt_budget *mb)
+{
+	return (__atomic_load_n(&mb->mb_shed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,343 @@
+/* */
+
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * hand parsed messages from the io thread to worker threads.
+ *
+ * each worker has a single producer/single consumer ring of message
+ * references. the io thread is the only producer, and picks the ring
+ * by hashing the topic so messages on a topic stay in order. the
+ * head and tail indexes live on separate cache lines, and each side
+ * keeps a copy of the other side's index so it only has to look at
+ * the shared one when its copy says the ring is full or empty.
+ *
+ * the mutex and condvars in each ring are only used when a producer
+ * has to wait for space or a consumer has to wait for messages.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mqtt_protocol.h"
+#include "amqtt.h"
+
+#define MQTT_CACHELINE		64
+#define MQTT_ALIGNED		__attribute__((__aligned__(MQTT_CACHELINE)))
+
+struct mqtt_ring {
+	/* producer */
+	unsigned int		 r_tail MQTT_ALIGNED;
+	unsigned int		 r_head_cache;
+
+	/* consumer */
+	unsigned int		 r_head MQTT_ALIGNED;
+	unsigned int		 r_tail_cache;
+
+	/* slow paths */
+	unsigned int		 r_waiting MQTT_ALIGNED;
+	unsigned int		 r_sleeping;
+	pthread_mutex_t		 r_mtx;
+	pthread_cond_t		 r_space;
+	pthread_cond_t		 r_avail;
+
+	struct mqtt_msg		**r_msgs;
+};
+
+struct mqtt_dispatch {
+	struct mqtt_ring	*md_rings;
+	unsigned int		 md_nrings;
+	unsigned int		 md_mask;	/* ring size - 1 */
+	enum mqtt_dispatch_policy
+				 md_policy;
+	unsigned int		 md_closed;
+	uint64_t		 md_shed;
+};
+
+struct mqtt_dispatch *
+mqtt_dispatch_create(unsigned int nworkers, unsigned int size,
+    enum mqtt_dispatch_policy policy)
+{
+	struct mqtt_dispatch *md;
+	struct mqtt_ring *r;
+	unsigned int i;
+	void *mem;
+
+	if (nworkers == 0)
+		return (NULL);
+	if (size < 2 || (size & (size - 1)) != 0)
+		return (NULL);
+
+	switch (policy) {
+	case MQTT_DISPATCH_BLOCK:
+	case MQTT_DISPATCH_SHED_QOS0:
+		break;
+	default:
+		return (NULL);
+	}
+
+	md = malloc(sizeof(*md));
+	if (md == NULL)
+		return (NULL);
+
+	if (posix_memalign(&mem, MQTT_CACHELINE,
+	    nworkers * sizeof(*md->md_rings)) != 0)
+		goto free;
+	md->md_rings = mem;
+
+	for (i = 0; i < nworkers; i++) {
+		r = &md->md_rings[i];
+
+		r->r_msgs = calloc(size, sizeof(*r->r_msgs));
+		if (r->r_msgs == NULL)
+			goto rings;
+
+		r->r_tail = r->r_head_cache = 0;
+		r->r_head = r->r_tail_cache = 0;
+		r->r_waiting = r->r_sleeping = 0;
+		pthread_mutex_init(&r->r_mtx, NULL);
+		pthread_cond_init(&r->r_space, NULL);
+		pthread_cond_init(&r->r_avail, NULL);
+	}
+
+	md->md_nrings = nworkers;
+	md->md_mask = size - 1;
+	md->md_policy = policy;
+	md->md_closed = 0;
+	md->md_shed = 0;
+
+	return (md);
+
+rings:
+	while (i-- > 0) {
+		r = &md->md_rings[i];
+		pthread_cond_destroy(&r->r_avail);
+		pthread_cond_destroy(&r->r_space);
+		pthread_mutex_destroy(&r->r_mtx);
+		free(r->r_msgs);
+	}
+	free(md->md_rings);
+free:
+	free(md);
+	return (NULL);
+}
+
+/*
+ * the workers have to be finished with the dispatcher before it is
+ * destroyed. messages still in the rings are released.
+ */
+void
+mqtt_dispatch_destroy(struct mqtt_dispatch *md)
+{
+	struct mqtt_ring *r;
+	unsigned int i;
+
+	for (i = 0; i < md->md_nrings; i++) {
+		r = &md->md_rings[i];
+
+		while (r->r_head != r->r_tail) {
+			mqtt_msg_unref(r->r_msgs[r->r_head & md->md_mask]);
+			r->r_head++;
+		}
+
+		pthread_cond_destroy(&r->r_avail);
+		pthread_cond_destroy(&r->r_space);
+		pthread_mutex_destroy(&r->r_mtx);
+		free(r->r_msgs);
+	}
+
+	free(md->md_rings);
+	free(md);
+}
+
+unsigned int
+mqtt_dispatch_worker(const struct mqtt_dispatch *md,
+    const char *topic, size_t len)
+{
+	return (mqtt_topic_hash(topic, len) % md->md_nrings);
+}
+
+static int
+mqtt_ring_full(struct mqtt_dispatch *md, struct mqtt_ring *r)
+{
+	unsigned int tail = r->r_tail;
+
+	if (tail - r->r_head_cache <= md->md_mask)
+		return (0);
+
+	r->r_head_cache = __atomic_load_n(&r->r_head, __ATOMIC_ACQUIRE);
+	return (tail - r->r_head_cache > md->md_mask);
+}
+
+static void
+mqtt_ring_wait_space(struct mqtt_dispatch *md, struct mqtt_ring *r)
+{
+	pthread_mutex_lock(&r->r_mtx);
+	__atomic_store_n(&r->r_waiting, 1, __ATOMIC_SEQ_CST);
+	/* the flag has to be visible before we look at the head again */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (mqtt_ring_full(md, r))
+		pthread_cond_wait(&r->r_space, &r->r_mtx);
+	__atomic_store_n(&r->r_waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&r->r_mtx);
+}
+
+/*
+ * the dispatcher takes the callers reference to the message. returns
+ * 0 if the message was queued for a worker, or -1 if it was shed.
+ */
+int
+mqtt_dispatch_push(struct mqtt_dispatch *md, struct mqtt_msg *msg)
+{
+	struct mqtt_ring *r;
+	const char *topic;
+	size_t len;
+
+	topic = mqtt_msg_topic(msg, &len);
+	r = &md->md_rings[mqtt_dispatch_worker(md, topic, len)];
+
+	if (mqtt_ring_full(md, r)) {
+		if (md->md_policy == MQTT_DISPATCH_SHED_QOS0 &&
+		    mqtt_msg_qos(msg) == MQTT_QOS0) {
+			mqtt_msg_unref(msg);
+			__atomic_add_fetch(&md->md_shed, 1, __ATOMIC_RELAXED);
+			return (-1);
+		}
+
+		mqtt_ring_wait_space(md, r);
+	}
+
+	r->r_msgs[r->r_tail & md->md_mask] = msg;
+	__atomic_store_n(&r->r_tail, r->r_tail + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&r->r_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&r->r_mtx);
+		pthread_cond_signal(&r->r_avail);
+		pthread_mutex_unlock(&r->r_mtx);
+	}
+
+	return (0);
+}
+
+static int
+mqtt_ring_empty(struct mqtt_ring *r)
+{
+	unsigned int head = r->r_head;
+
+	if (head != r->r_tail_cache)
+		return (0);
+
+	r->r_tail_cache = __atomic_load_n(&r->r_tail, __ATOMIC_ACQUIRE);
+	return (head == r->r_tail_cache);
+}
+
+static struct mqtt_msg *
+mqtt_ring_get(struct mqtt_dispatch *md, struct mqtt_ring *r, int *waiting)
+{
+	struct mqtt_msg *msg;
+
+	if (mqtt_ring_empty(r))
+		return (NULL);
+
+	msg = r->r_msgs[r->r_head & md->md_mask];
+	__atomic_store_n(&r->r_head, r->r_head + 1, __ATOMIC_SEQ_CST);
+	*waiting = __atomic_load_n(&r->r_waiting, __ATOMIC_SEQ_CST);
+
+	return (msg);
+}
+
+/*
+ * returns the next message for the worker, or NULL if there isn't
+ * one. the worker owns the reference it is given.
+ */
+struct mqtt_msg *
+mqtt_dispatch_pop(struct mqtt_dispatch *md, unsigned int worker)
+{
+	struct mqtt_ring *r = &md->md_rings[worker];
+	struct mqtt_msg *msg;
+	int waiting;
+
+	msg = mqtt_ring_get(md, r, &waiting);
+	if (msg != NULL && waiting) {
+		pthread_mutex_lock(&r->r_mtx);
+		pthread_cond_signal(&r->r_space);
+		pthread_mutex_unlock(&r->r_mtx);
+	}
+
+	return (msg);
+}
+
+/*
+ * like mqtt_dispatch_pop, but sleeps until there's a message. NULL
+ * is only returned once the dispatcher is closed and the worker's
+ * ring is empty.
+ */
+struct mqtt_msg *
+mqtt_dispatch_wait(struct mqtt_dispatch *md, unsigned int worker)
+{
+	struct mqtt_ring *r = &md->md_rings[worker];
+	struct mqtt_msg *msg;
+	int waiting = 0;
+
+	msg = mqtt_dispatch_pop(md, worker);
+	if (msg != NULL)
+		return (msg);
+
+	pthread_mutex_lock(&r->r_mtx);
+	__atomic_store_n(&r->r_sleeping, 1, __ATOMIC_SEQ_CST);
+	/* the flag has to be visible before we look at the tail again */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while ((msg = mqtt_ring_get(md, r, &waiting)) == NULL) {
+		if (__atomic_load_n(&md->md_closed, __ATOMIC_ACQUIRE))
+			break;
+		pthread_cond_wait(&r->r_avail, &r->r_mtx);
+	}
+	__atomic_store_n(&r->r_sleeping, 0, __ATOMIC_RELAXED);
+	if (waiting)
+		pthread_cond_signal(&r->r_space);
+	pthread_mutex_unlock(&r->r_mtx);
+
+	return (msg);
+}
+
+/* wake up the workers so mqtt_dispatch_wait can tell them to stop */
+void
+mqtt_dispatch_close(struct mqtt_dispatch *md)
+{
+	struct mqtt_ring *r;
+	unsigned int i;
+
+	__atomic_store_n(&md->md_closed, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < md->md_nrings; i++) {
+		r = &md->md_rings[i];
+
+		pthread_mutex_lock(&r->r_mtx);
+		pthread_cond_broadcast(&r->r_avail);
+		pthread_mutex_unlock(&r->r_mtx);
+	}
+}
+
+uint64_t
+mqtt_dispatch_shed(const struct mqtt_dispatch *md)
+{
+	return (__atomic_load_n(&md->md_shed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,518 @@
+/* */
+
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * last value cache.
+ *
+ * the latest payload for each topic is kept in a single arena of
+ * records, which are found via an open addressing hash table with
+ * linear probing. a record is updated in place if the new payload
+ * fits in the space it already has, otherwise a new record is
+ * allocated at the end of the arena and the old one is left as a
+ * hole. when the arena fills up the holes are squeezed out, and if
+ * that isn't enough the least recently updated topics are evicted.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mqtt_protocol.h"
+#include "amqtt.h"
+
+#define MQTT_LVC_ALIGN		16
+#define MQTT_LVC_EMPTY		UINT32_MAX
+#define MQTT_LVC_MINSLOTS	64
+
+struct mqtt_lvc_rec {
+	uint32_t	 lr_size;	/* whole record including this */
+	uint32_t	 lr_hash;
+	uint64_t	 lr_gen;	/* when it was last updated */
+	uint32_t	 lr_cap;	/* room for the payload */
+	uint32_t	 lr_plen;
+	uint16_t	 lr_tlen;
+	uint16_t	 lr_live;
+	/* followed by topic and payload, each nul terminated */
+};
+
+struct mqtt_lvc_slot {
+	uint32_t	 ls_hash;
+	uint32_t	 ls_off;
+};
+
+struct mqtt_lvc {
+	uint8_t		*lvc_mem;
+	size_t		 lvc_size;
+	size_t		 lvc_used;
+	size_t		 lvc_live;
+
+	struct mqtt_lvc_slot
+			*lvc_slots;
+	size_t		 lvc_nslots;	/* power of 2 */
+	size_t		 lvc_count;
+
+	uint64_t	 lvc_gen;
+};
+
+static inline size_t
+mqtt_lvc_roundup(size_t len)
+{
+	return ((len + (MQTT_LVC_ALIGN - 1)) & ~(size_t)(MQTT_LVC_ALIGN - 1));
+}
+
+static inline struct mqtt_lvc_rec *
+mqtt_lvc_rec(const struct mqtt_lvc *lvc, uint32_t off)
+{
+	return ((struct mqtt_lvc_rec *)(lvc->lvc_mem + off));
+}
+
+static inline char *
+mqtt_lvc_rec_topic(struct mqtt_lvc_rec *lr)
+{
+	return ((char *)(lr + 1));
+}
+
+static inline uint8_t *
+mqtt_lvc_rec_payload(struct mqtt_lvc_rec *lr)
+{
+	return ((uint8_t *)(lr + 1) + lr->lr_tlen + 1);
+}
+
+static struct mqtt_lvc_slot *
+mqtt_lvc_slot_alloc(size_t nslots)
+{
+	struct mqtt_lvc_slot *slots;
+	size_t i;
+
+	slots = reallocarray(NULL, nslots, sizeof(*slots));
+	if (slots == NULL)
+		return (NULL);
+
+	for (i = 0; i < nslots; i++)
+		slots[i].ls_off = MQTT_LVC_EMPTY;
+
+	return (slots);
+}
+
+struct mqtt_lvc *
+mqtt_lvc_create(size_t size)
+{
+	struct mqtt_lvc *lvc;
+
+	size = mqtt_lvc_roundup(size);
+	if (size == 0 || size > UINT32_MAX)
+		return (NULL);
+
+	lvc = malloc(sizeof(*lvc));
+	if (lvc == NULL)
+		return (NULL);
+
+	lvc->lvc_mem = malloc(size);
+	if (lvc->lvc_mem == NULL)
+		goto free;
+
+	lvc->lvc_nslots = MQTT_LVC_MINSLOTS;
+	lvc->lvc_slots = mqtt_lvc_slot_alloc(lvc->lvc_nslots);
+	if (lvc->lvc_slots == NULL)
+		goto free_mem;
+
+	lvc->lvc_size = size;
+	lvc->lvc_used = 0;
+	lvc->lvc_live = 0;
+	lvc->lvc_count = 0;
+	lvc->lvc_gen = 0;
+
+	return (lvc);
+
+free_mem:
+	free(lvc->lvc_mem);
+free:
+	free(lvc);
+	return (NULL);
+}
+
+void
+mqtt_lvc_destroy(struct mqtt_lvc *lvc)
+{
+	free(lvc->lvc_slots);
+	free(lvc->lvc_mem);
+	free(lvc);
+}
+
+static struct mqtt_lvc_slot *
+mqtt_lvc_find(const struct mqtt_lvc *lvc, uint32_t hash,
+    const char *topic, size_t len)
+{
+	size_t mask = lvc->lvc_nslots - 1;
+	size_t i = hash & mask;
+	struct mqtt_lvc_slot *ls;
+	struct mqtt_lvc_rec *lr;
+
+	for (;;) {
+		ls = &lvc->lvc_slots[i];
+		if (ls->ls_off == MQTT_LVC_EMPTY)
+			return (NULL);
+
+		if (ls->ls_hash == hash) {
+			lr = mqtt_lvc_rec(lvc, ls->ls_off);
+			if (lr->lr_tlen == len &&
+			    memcmp(mqtt_lvc_rec_topic(lr), topic, len) == 0)
+				return (ls);
+		}
+
+		i = (i + 1) & mask;
+	}
+}
+
+static struct mqtt_lvc_slot *
+mqtt_lvc_find_off(const struct mqtt_lvc *lvc, uint32_t hash, uint32_t off)
+{
+	size_t mask = lvc->lvc_nslots - 1;
+	size_t i = hash & mask;
+	struct mqtt_lvc_slot *ls;
+
+	for (;;) {
+		ls = &lvc->lvc_slots[i];
+		if (ls->ls_off == off)
+			return (ls);
+
+		i = (i + 1) & mask;
+	}
+}
+
+static void
+mqtt_lvc_insert(struct mqtt_lvc_slot *slots, size_t nslots,
+    uint32_t hash, uint32_t off)
+{
+	size_t mask = nslots - 1;
+	size_t i = hash & mask;
+
+	while (slots[i].ls_off != MQTT_LVC_EMPTY)
+		i = (i + 1) & mask;
+
+	slots[i].ls_hash = hash;
+	slots[i].ls_off = off;
+}
+
+/* backward shift deletion, so there are no tombstones to clean up */
+static void
+mqtt_lvc_remove(struct mqtt_lvc *lvc, struct mqtt_lvc_slot *ls)
+{
+	size_t mask = lvc->lvc_nslots - 1;
+	size_t i = ls - lvc->lvc_slots;
+	size_t j = i;
+	size_t h;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (lvc->lvc_slots[j].ls_off == MQTT_LVC_EMPTY)
+			break;
+
+		/* can the entry at j be moved back to the hole at i? */
+		h = lvc->lvc_slots[j].ls_hash & mask;
+		if (((j - h) & mask) < ((j - i) & mask))
+			continue;
+
+		lvc->lvc_slots[i] = lvc->lvc_slots[j];
+		i = j;
+	}
+
+	lvc->lvc_slots[i].ls_off = MQTT_LVC_EMPTY;
+	lvc->lvc_count--;
+}
+
+static int
+mqtt_lvc_grow(struct mqtt_lvc *lvc)
+{
+	struct mqtt_lvc_slot *slots;
+	size_t nslots = lvc->lvc_nslots * 2;
+	size_t i;
+
+	slots = mqtt_lvc_slot_alloc(nslots);
+	if (slots == NULL)
+		return (-1);
+
+	for (i = 0; i < lvc->lvc_nslots; i++) {
+		struct mqtt_lvc_slot *ls = &lvc->lvc_slots[i];
+		if (ls->ls_off != MQTT_LVC_EMPTY)
+			mqtt_lvc_insert(slots, nslots, ls->ls_hash, ls->ls_off);
+	}
+
+	free(lvc->lvc_slots);
+	lvc->lvc_slots = slots;
+	lvc->lvc_nslots = nslots;
+
+	return (0);
+}
+
+static void
+mqtt_lvc_kill(struct mqtt_lvc *lvc, struct mqtt_lvc_rec *lr)
+{
+	lr->lr_live = 0;
+	lvc->lvc_live -= lr->lr_size;
+}
+
+/* slide the live records down over the holes */
+static void
+mqtt_lvc_compact(struct mqtt_lvc *lvc)
+{
+	struct mqtt_lvc_rec *lr;
+	size_t off = 0, noff = 0;
+	size_t size;
+
+	while (off < lvc->lvc_used) {
+		lr = mqtt_lvc_rec(lvc, off);
+		size = lr->lr_size;
+
+		if (lr->lr_live) {
+			if (noff != off) {
+				mqtt_lvc_find_off(lvc, lr->lr_hash,
+				    off)->ls_off = noff;
+				memmove(lvc->lvc_mem + noff, lr, size);
+			}
+			noff += size;
+		}
+
+		off += size;
+	}
+
+	lvc->lvc_used = noff;
+}
+
+struct mqtt_lvc_age {
+	uint64_t	 la_gen;
+	uint32_t	 la_off;
+};
+
+static int
+mqtt_lvc_age_cmp(const void *a, const void *b)
+{
+	const struct mqtt_lvc_age *laa = a, *lab = b;
+
+	if (laa->la_gen < lab->la_gen)
+		return (-1);
+	return (laa->la_gen > lab->la_gen);
+}
+
+/*
+ * throw out the least recently updated topics until there's at least
+ * need bytes free. eviction is done in big batches so the sorting is
+ * paid for rarely.
+ */
+static int
+mqtt_lvc_evict(struct mqtt_lvc *lvc, size_t need)
+{
+	struct mqtt_lvc_age *ages;
+	struct mqtt_lvc_rec *lr;
+	size_t off, n = 0, i;
+
+	if (need < lvc->lvc_size / 4)
+		need = lvc->lvc_size / 4;
+
+	ages = reallocarray(NULL, lvc->lvc_count, sizeof(*ages));
+	if (ages == NULL)
+		return (-1);
+
+	for (off = 0; off < lvc->lvc_used; off += lr->lr_size) {
+		lr = mqtt_lvc_rec(lvc, off);
+		if (!lr->lr_live)
+			continue;
+
+		ages[n].la_gen = lr->lr_gen;
+		ages[n].la_off = off;
+		n++;
+	}
+
+	qsort(ages, n, sizeof(*ages), mqtt_lvc_age_cmp);
+
+	for (i = 0; i < n; i++) {
+		if (lvc->lvc_size - lvc->lvc_live >= need)
+			break;
+
+		lr = mqtt_lvc_rec(lvc, ages[i].la_off);
+		mqtt_lvc_remove(lvc,
+		    mqtt_lvc_find_off(lvc, lr->lr_hash, ages[i].la_off));
+		mqtt_lvc_kill(lvc, lr);
+	}
+
+	free(ages);
+
+	mqtt_lvc_compact(lvc);
+
+	return (0);
+}
+
+static struct mqtt_lvc_rec *
+mqtt_lvc_alloc(struct mqtt_lvc *lvc, size_t tlen, size_t plen)
+{
+	struct mqtt_lvc_rec *lr;
+	size_t size;
+
+	size = mqtt_lvc_roundup(sizeof(*lr) + tlen + 1 + plen + 1);
+	if (size > lvc->lvc_size)
+		return (NULL);
+
+	if (lvc->lvc_size - lvc->lvc_used < size) {
+		if (lvc->lvc_size - lvc->lvc_live >= size)
+			mqtt_lvc_compact(lvc);
+		else if (mqtt_lvc_evict(lvc, size) == -1)
+			return (NULL);
+	}
+
+	lr = mqtt_lvc_rec(lvc, lvc->lvc_used);
+	lr->lr_size = size;
+	lr->lr_tlen = tlen;
+	lr->lr_cap = size - (sizeof(*lr) + tlen + 1 + 1);
+	lr->lr_live = 1;
+
+	lvc->lvc_used += size;
+	lvc->lvc_live += size;
+
+	return (lr);
+}
+
+static void
+mqtt_lvc_set(struct mqtt_lvc *lvc, struct mqtt_lvc_rec *lr,
+    const void *payload, size_t plen)
+{
+	uint8_t *p = mqtt_lvc_rec_payload(lr);
+
+	memcpy(p, payload, plen);
+	p[plen] = '\0';
+	lr->lr_plen = plen;
+	lr->lr_gen = ++lvc->lvc_gen;
+}
+
+/*
+ * an empty payload removes the topic from the cache, like it does for
+ * retained messages.
+ */
+int
+mqtt_lvc_update(struct mqtt_lvc *lvc, const char *topic, size_t tlen,
+    const void *payload, size_t plen)
+{
+	struct mqtt_lvc_slot *ls;
+	struct mqtt_lvc_rec *lr, *olr;
+	uint32_t hash;
+
+	if (tlen > 0xffff)
+		return (-1);
+
+	hash = mqtt_topic_hash(topic, tlen);
+	ls = mqtt_lvc_find(lvc, hash, topic, tlen);
+
+	if (ls != NULL) {
+		olr = mqtt_lvc_rec(lvc, ls->ls_off);
+		if (plen == 0) {
+			mqtt_lvc_remove(lvc, ls);
+			mqtt_lvc_kill(lvc, olr);
+			return (0);
+		}
+
+		if (plen <= olr->lr_cap) {
+			mqtt_lvc_set(lvc, olr, payload, plen);
+			return (0);
+		}
+
+		/* make room by removing the old one before allocating */
+		mqtt_lvc_remove(lvc, ls);
+		mqtt_lvc_kill(lvc, olr);
+	} else if (plen == 0)
+		return (0);
+
+	if ((lvc->lvc_count + 1) * 2 > lvc->lvc_nslots) {
+		if (mqtt_lvc_grow(lvc) == -1)
+			return (-1);
+	}
+
+	lr = mqtt_lvc_alloc(lvc, tlen, plen);
+	if (lr == NULL)
+		return (-1);
+
+	lr->lr_hash = hash;
+	memcpy(mqtt_lvc_rec_topic(lr), topic, tlen);
+	mqtt_lvc_rec_topic(lr)[tlen] = '\0';
+	mqtt_lvc_set(lvc, lr, payload, plen);
+
+	mqtt_lvc_insert(lvc->lvc_slots, lvc->lvc_nslots, hash,
+	    (uint8_t *)lr - lvc->lvc_mem);
+	lvc->lvc_count++;
+
+	return (0);
+}
+
+/*
+ * the payload returned by mqtt_lvc_get and mqtt_lvc_next points into
+ * the cache and is only valid until it is next updated.
+ */
+int
+mqtt_lvc_get(const struct mqtt_lvc *lvc, const char *topic, size_t tlen,
+    const void **payload, size_t *plen)
+{
+	struct mqtt_lvc_slot *ls;
+	struct mqtt_lvc_rec *lr;
+
+	ls = mqtt_lvc_find(lvc, mqtt_topic_hash(topic, tlen), topic, tlen);
+	if (ls == NULL)
+		return (-1);
+
+	lr = mqtt_lvc_rec(lvc, ls->ls_off);
+	*payload = mqtt_lvc_rec_payload(lr);
+	*plen = lr->lr_plen;
+
+	return (0);
+}
+
+/*
+ * iterate over the cache. start with *cursor set to 0 and keep calling
+ * it until it returns 0.
+ */
+int
+mqtt_lvc_next(const struct mqtt_lvc *lvc, size_t *cursor,
+    const char **topic, size_t *tlen, const void **payload, size_t *plen)
+{
+	struct mqtt_lvc_slot *ls;
+	struct mqtt_lvc_rec *lr;
+	size_t i;
+
+	for (i = *cursor; i < lvc->lvc_nslots; i++) {
+		ls = &lvc->lvc_slots[i];
+		if (ls->ls_off == MQTT_LVC_EMPTY)
+			continue;
+
+		lr = mqtt_lvc_rec(lvc, ls->ls_off);
+		*topic = mqtt_lvc_rec_topic(lr);
+		*tlen = lr->lr_tlen;
+		*payload = mqtt_lvc_rec_payload(lr);
+		*plen = lr->lr_plen;
+
+		*cursor = i + 1;
+		return (1);
+	}
+
+	*cursor = i;
+	return (0);
+}
+
+size_t
+mqtt_lvc_count(const struct mqtt_lvc *lvc)
+{
+	return (lvc->lvc_count);
+}
@@ -76,3 +76,20 @@ struct mqtt_p_connack {
 #define MQTT_CONNACK_BAD_CREDENTIALS		0x04
 #define MQTT_CONNACK_NOT_AUTHORIZED		0x05
 };
+
+/*
+ * topics are hashed by the last value cache and the dispatcher.
+ */
+static inline uint32_t
+mqtt_topic_hash(const char *topic, size_t len)
+{
+	uint32_t h = 2166136261U; /* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)topic[i];
+		h *= 16777619U;
+	}
+
+	return (h);
+}
@@ -0,0 +1,875 @@
+/* */
+
+/*
+ * Copyright (c) 2021 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * MQTT over WebSockets (RFC 6455), client side.
+ *
+ * this sits between the transport and an mqtt_conn. the mqtt_output
+ * callback for the connection hands its bytes to mqtt_ws_output,
+ * which masks them into binary frames in an output buffer, and bytes
+ * read from the transport go to mqtt_ws_input, which strips the
+ * framing and feeds the payloads to mqtt_inputv in place. mqtt_input
+ * is a stream parser, so a packet can span any number of frames
+ * without them being reassembled first.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MQTT_WS_AVX2
+#endif
+
+#include "amqtt.h"
+
+#define MQTT_WS_GUID		"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define MQTT_WS_KEYLEN		16
+#define MQTT_WS_KEY64LEN	24	/* base64 of MQTT_WS_KEYLEN bytes */
+#define MQTT_WS_HTTPMAX		4096
+#define MQTT_WS_HDRMAX		14
+#define MQTT_WS_CTLMAX		125
+#define MQTT_WS_IOVMAX		16
+#define MQTT_WS_OBUF_DEFAULT	(64 << 10)
+
+#define MQTT_WS_FIN		0x80
+#define MQTT_WS_RSV		0x70
+#define MQTT_WS_OPCODE		0x0f
+#define MQTT_WS_MASK		0x80
+
+#define MQTT_WS_OP_CONT		0x0
+#define MQTT_WS_OP_TEXT		0x1
+#define MQTT_WS_OP_BINARY	0x2
+#define MQTT_WS_OP_CLOSE	0x8
+#define MQTT_WS_OP_PING		0x9
+#define MQTT_WS_OP_PONG		0xa
+
+enum mqtt_ws_state {
+	MQTT_WS_S_INIT,
+	MQTT_WS_S_HTTP,
+	MQTT_WS_S_HDR,
+	MQTT_WS_S_DATA,
+	MQTT_WS_S_CTL,
+	MQTT_WS_S_DEAD,
+};
+
+struct mqtt_ws {
+	const struct mqtt_ws_settings
+			*ws_settings;
+	struct mqtt_conn
+			*ws_mc;
+	void		*ws_cookie;
+	const char	*ws_errstr;
+	enum mqtt_ws_state
+			 ws_state;
+
+	/* callbacks from mqtt_ws_input can destroy the ws under it */
+	unsigned int	 ws_inputting;
+	unsigned int	 ws_destroyed;
+
+	char		 ws_accept[28 + 1];
+
+	/* the http response, or the current frame header */
+	uint8_t		*ws_hbuf;
+	size_t		 ws_hlen;
+
+	/* the current frame */
+	uint8_t		 ws_opcode;
+	uint8_t		 ws_masked;
+	uint8_t		 ws_frag;	/* a binary message is unfinished */
+	uint8_t		 ws_key[4];
+	uint64_t	 ws_rem;
+	size_t		 ws_keyoff;
+	uint8_t		 ws_ctl[MQTT_WS_CTLMAX];
+	size_t		 ws_ctllen;
+
+	/* framed and masked bytes waiting for the transport */
+	uint8_t		*ws_obuf;
+	size_t		 ws_osize;
+	size_t		 ws_ooff;
+	size_t		 ws_olen;
+};
+
+/*
+ * SHA1 (RFC 3174), only needed to check Sec-WebSocket-Accept.
+ */
+
+#define SHA1_ROL(_v, _n)	(((_v) << (_n)) | ((_v) >> (32 - (_n))))
+
+struct mqtt_sha1 {
+	uint32_t	 s_h[5];
+	uint64_t	 s_len;
+	uint8_t		 s_buf[64];
+	size_t		 s_off;
+};
+
+static void
+mqtt_sha1_block(struct mqtt_sha1 *s, const uint8_t *p)
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, f, k, t;
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+		    (uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+	}
+	for (i = 16; i < 80; i++)
+		w[i] = SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = s->s_h[0];
+	b = s->s_h[1];
+	c = s->s_h[2];
+	d = s->s_h[3];
+	e = s->s_h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = SHA1_ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = SHA1_ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	s->s_h[0] += a;
+	s->s_h[1] += b;
+	s->s_h[2] += c;
+	s->s_h[3] += d;
+	s->s_h[4] += e;
+}
+
+static void
+mqtt_sha1_init(struct mqtt_sha1 *s)
+{
+	s->s_h[0] = 0x67452301;
+	s->s_h[1] = 0xefcdab89;
+	s->s_h[2] = 0x98badcfe;
+	s->s_h[3] = 0x10325476;
+	s->s_h[4] = 0xc3d2e1f0;
+	s->s_len = 0;
+	s->s_off = 0;
+}
+
+static void
+mqtt_sha1_update(struct mqtt_sha1 *s, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	s->s_len += len;
+	while (len > 0) {
+		size_t n = sizeof(s->s_buf) - s->s_off;
+
+		if (n > len)
+			n = len;
+		memcpy(s->s_buf + s->s_off, p, n);
+		s->s_off += n;
+		p += n;
+		len -= n;
+
+		if (s->s_off == sizeof(s->s_buf)) {
+			mqtt_sha1_block(s, s->s_buf);
+			s->s_off = 0;
+		}
+	}
+}
+
+static void
+mqtt_sha1_final(struct mqtt_sha1 *s, uint8_t digest[20])
+{
+	uint64_t bits = s->s_len * 8;
+	uint8_t pad[8];
+	unsigned int i;
+
+	mqtt_sha1_update(s, "\x80", 1);
+	while (s->s_off != sizeof(s->s_buf) - sizeof(pad))
+		mqtt_sha1_update(s, "", 1);
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] = bits >> (56 - i * 8);
+	mqtt_sha1_update(s, pad, sizeof(pad));
+
+	for (i = 0; i < 20; i++)
+		digest[i] = s->s_h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static void
+mqtt_base64(char *dst, const uint8_t *src, size_t len)
+{
+	static const char b64[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+
+	while (len >= 3) {
+		v = (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+		*dst++ = b64[(v >> 18) & 0x3f];
+		*dst++ = b64[(v >> 12) & 0x3f];
+		*dst++ = b64[(v >> 6) & 0x3f];
+		*dst++ = b64[v & 0x3f];
+		src += 3;
+		len -= 3;
+	}
+
+	if (len > 0) {
+		v = (uint32_t)src[0] << 16;
+		if (len == 2)
+			v |= (uint32_t)src[1] << 8;
+		*dst++ = b64[(v >> 18) & 0x3f];
+		*dst++ = b64[(v >> 12) & 0x3f];
+		*dst++ = len == 2 ? b64[(v >> 6) & 0x3f] : '=';
+		*dst++ = '=';
+	}
+
+	*dst = '\0';
+}
+
+/*
+ * xor len bytes of src with the 4 byte key into dst, starting off
+ * bytes into the key. dst and src may be the same.
+ */
+
+#ifdef MQTT_WS_AVX2
+__attribute__((__target__("avx2")))
+static size_t
+mqtt_ws_mask_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint32_t m)
+{
+	__m256i vm = _mm256_set1_epi32(m);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		    _mm256_xor_si256(v, vm));
+	}
+
+	return (i);
+}
+#endif
+
+static void
+mqtt_ws_mask(uint8_t *dst, const uint8_t *src, size_t len,
+    const uint8_t key[4], size_t off)
+{
+	uint8_t k[4];
+	uint32_t m;
+	uint64_t m64, v;
+	size_t i = 0;
+
+	/* rotate the key so it starts at byte 0 of the buffer */
+	k[0] = key[(off + 0) & 3];
+	k[1] = key[(off + 1) & 3];
+	k[2] = key[(off + 2) & 3];
+	k[3] = key[(off + 3) & 3];
+	memcpy(&m, k, sizeof(m));
+
+#ifdef MQTT_WS_AVX2
+	if (len >= 64 && __builtin_cpu_supports("avx2"))
+		i = mqtt_ws_mask_avx2(dst, src, len, m);
+#endif
+
+#if defined(__SSE2__)
+	{
+		__m128i vm = _mm_set1_epi32(m);
+
+		for (; i + 16 <= len; i += 16) {
+			__m128i vv = _mm_loadu_si128(
+			    (const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i),
+			    _mm_xor_si128(vv, vm));
+		}
+	}
+#endif
+
+	m64 = (uint64_t)m << 32 | m;
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&v, src + i, sizeof(v));
+		v ^= m64;
+		memcpy(dst + i, &v, sizeof(v));
+	}
+
+	for (; i < len; i++)
+		dst[i] = src[i] ^ k[i & 3];
+}
+
+static void
+mqtt_ws_dead(struct mqtt_ws *ws, const char *errstr)
+{
+	ws->ws_errstr = errstr;
+	ws->ws_state = MQTT_WS_S_DEAD;
+	(*ws->ws_settings->ws_dead)(ws);
+}
+
+struct mqtt_ws *
+mqtt_ws_create(const struct mqtt_ws_settings *wss, struct mqtt_conn *mc,
+    void *cookie)
+{
+	struct mqtt_ws *ws;
+
+	ws = malloc(sizeof(*ws));
+	if (ws == NULL)
+		return (NULL);
+
+	ws->ws_osize = wss->ws_output_size;
+	if (ws->ws_osize == 0)
+		ws->ws_osize = MQTT_WS_OBUF_DEFAULT;
+	if (ws->ws_osize < MQTT_WS_HTTPMAX)
+		ws->ws_osize = MQTT_WS_HTTPMAX;
+
+	ws->ws_obuf = malloc(ws->ws_osize);
+	if (ws->ws_obuf == NULL)
+		goto free;
+
+	ws->ws_hbuf = malloc(MQTT_WS_HTTPMAX);
+	if (ws->ws_hbuf == NULL)
+		goto obuf;
+
+	ws->ws_settings = wss;
+	ws->ws_mc = mc;
+	ws->ws_cookie = cookie;
+	ws->ws_errstr = NULL;
+	ws->ws_state = MQTT_WS_S_INIT;
+	ws->ws_inputting = 0;
+	ws->ws_destroyed = 0;
+	ws->ws_hlen = 0;
+	ws->ws_frag = 0;
+	ws->ws_ooff = 0;
+	ws->ws_olen = 0;
+
+	return (ws);
+
+obuf:
+	free(ws->ws_obuf);
+free:
+	free(ws);
+	return (NULL);
+}
+
+void
+mqtt_ws_destroy(struct mqtt_ws *ws)
+{
+	if (ws->ws_inputting) {
+		/* mqtt_ws_input frees it on the way out */
+		ws->ws_state = MQTT_WS_S_DEAD;
+		ws->ws_destroyed = 1;
+		return;
+	}
+
+	free(ws->ws_hbuf);
+	free(ws->ws_obuf);
+	free(ws);
+}
+
+void *
+mqtt_ws_cookie(struct mqtt_ws *ws)
+{
+	return (ws->ws_cookie);
+}
+
+const char *
+mqtt_ws_errstr(struct mqtt_ws *ws)
+{
+	return (ws->ws_errstr);
+}
+
+/* push as much of the output buffer at the transport as it will take */
+static int
+mqtt_ws_write(struct mqtt_ws *ws)
+{
+	ssize_t rv;
+
+	while (ws->ws_olen > 0) {
+		rv = (*ws->ws_settings->ws_output)(ws,
+		    ws->ws_obuf + ws->ws_ooff, ws->ws_olen);
+		if (rv == -1)
+			return (-1);
+		if (rv == 0) {
+			(*ws->ws_settings->ws_want_output)(ws);
+			return (0);
+		}
+
+		ws->ws_ooff += rv;
+		ws->ws_olen -= rv;
+	}
+
+	ws->ws_ooff = 0;
+	return (0);
+}
+
+static size_t
+mqtt_ws_space(struct mqtt_ws *ws)
+{
+	if (ws->ws_ooff > 0 && ws->ws_olen > 0) {
+		memmove(ws->ws_obuf, ws->ws_obuf + ws->ws_ooff, ws->ws_olen);
+		ws->ws_ooff = 0;
+	}
+
+	return (ws->ws_osize - ws->ws_olen);
+}
+
+static size_t
+mqtt_ws_frame(struct mqtt_ws *ws, uint8_t opcode, const void *buf, size_t len)
+{
+	uint8_t *hdr = ws->ws_obuf + ws->ws_ooff + ws->ws_olen;
+	uint32_t key = arc4random();
+	size_t hlen = 2;
+
+	hdr[0] = MQTT_WS_FIN | opcode;
+	if (len < 126)
+		hdr[1] = MQTT_WS_MASK | len;
+	else if (len <= UINT16_MAX) {
+		hdr[1] = MQTT_WS_MASK | 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		hlen += 2;
+	} else {
+		unsigned int i;
+
+		hdr[1] = MQTT_WS_MASK | 127;
+		for (i = 0; i < 8; i++)
+			hdr[2 + i] = (uint64_t)len >> (56 - i * 8);
+		hlen += 8;
+	}
+
+	memcpy(hdr + hlen, &key, sizeof(key));
+	mqtt_ws_mask(hdr + hlen + sizeof(key), buf, len,
+	    hdr + hlen, 0);
+	hlen += sizeof(key);
+
+	ws->ws_olen += hlen + len;
+	return (len);
+}
+
+/*
+ * this is for the mqtt_output callback of the connection. the bytes
+ * are framed and buffered, so they're either all taken or only as
+ * many as fit in the buffer.
+ */
+ssize_t
+mqtt_ws_output(struct mqtt_ws *ws, const void *buf, size_t len)
+{
+	size_t space;
+
+	switch (ws->ws_state) {
+	case MQTT_WS_S_INIT:
+	case MQTT_WS_S_HTTP:
+		/* the connection will be pulled on once we're open */
+		return (0);
+	case MQTT_WS_S_DEAD:
+		return (-1);
+	default:
+		break;
+	}
+
+	space = mqtt_ws_space(ws);
+	if (space <= MQTT_WS_HDRMAX) {
+		/* push what we have and try again later */
+		if (mqtt_ws_write(ws) == -1)
+			return (-1);
+		space = mqtt_ws_space(ws);
+		if (space <= MQTT_WS_HDRMAX) {
+			(*ws->ws_settings->ws_want_output)(ws);
+			return (0);
+		}
+	}
+
+	space -= MQTT_WS_HDRMAX;
+	if (len > space)
+		len = space;
+
+	len = mqtt_ws_frame(ws, MQTT_WS_OP_BINARY, buf, len);
+	if (mqtt_ws_write(ws) == -1)
+		return (-1);
+
+	return (len);
+}
+
+/*
+ * call this when the transport can take more, after ws_want_output.
+ * once the buffer drains the connection gets to output more.
+ */
+void
+mqtt_ws_flush(struct mqtt_ws *ws)
+{
+	if (ws->ws_state == MQTT_WS_S_DEAD)
+		return;
+
+	if (mqtt_ws_write(ws) == -1) {
+		mqtt_ws_dead(ws, "output failed");
+		return;
+	}
+
+	if (ws->ws_olen == 0 && ws->ws_state != MQTT_WS_S_HTTP &&
+	    ws->ws_state != MQTT_WS_S_INIT)
+		mqtt_output(ws->ws_mc);
+}
+
+int
+mqtt_ws_handshake(struct mqtt_ws *ws, const char *host, const char *path,
+    const char *protocol)
+{
+	uint8_t key[MQTT_WS_KEYLEN];
+	char key64[MQTT_WS_KEY64LEN + 1];
+	uint8_t digest[20];
+	struct mqtt_sha1 s;
+	int rv;
+
+	if (ws->ws_state != MQTT_WS_S_INIT)
+		return (-1);
+	if (protocol == NULL)
+		protocol = "mqtt";
+
+	arc4random_buf(key, sizeof(key));
+	mqtt_base64(key64, key, sizeof(key));
+
+	mqtt_sha1_init(&s);
+	mqtt_sha1_update(&s, key64, strlen(key64));
+	mqtt_sha1_update(&s, MQTT_WS_GUID, strlen(MQTT_WS_GUID));
+	mqtt_sha1_final(&s, digest);
+	mqtt_base64(ws->ws_accept, digest, sizeof(digest));
+
+	rv = snprintf((char *)ws->ws_obuf, ws->ws_osize,
+	    "GET %s HTTP/1.1\r\n"
+	    "Host: %s\r\n"
+	    "Upgrade: websocket\r\n"
+	    "Connection: Upgrade\r\n"
+	    "Sec-WebSocket-Key: %s\r\n"
+	    "Sec-WebSocket-Protocol: %s\r\n"
+	    "Sec-WebSocket-Version: 13\r\n"
+	    "\r\n", path, host, key64, protocol);
+	if (rv < 0 || (size_t)rv >= ws->ws_osize)
+		return (-1);
+
+	ws->ws_ooff = 0;
+	ws->ws_olen = rv;
+	ws->ws_state = MQTT_WS_S_HTTP;
+
+	return (mqtt_ws_write(ws));
+}
+
+static const char *
+mqtt_ws_header(const char *hdrs, const char *name)
+{
+	size_t nlen = strlen(name);
+	const char *p = hdrs;
+
+	while ((p = strstr(p, "\r\n")) != NULL) {
+		p += 2;
+		if (strncasecmp(p, name, nlen) == 0 && p[nlen] == ':') {
+			p += nlen + 1;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return (p);
+		}
+	}
+
+	return (NULL);
+}
+
+/* returns how much of buf was used, or -1 if the handshake failed */
+static ssize_t
+mqtt_ws_http(struct mqtt_ws *ws, const uint8_t *buf, size_t len)
+{
+	const char *hdrs = (const char *)ws->ws_hbuf;
+	const char *end, *accept;
+	size_t alen = strlen(ws->ws_accept);
+	size_t n, used;
+
+	n = MQTT_WS_HTTPMAX - 1 - ws->ws_hlen;
+	if (n > len)
+		n = len;
+	memcpy(ws->ws_hbuf + ws->ws_hlen, buf, n);
+	ws->ws_hlen += n;
+	ws->ws_hbuf[ws->ws_hlen] = '\0';
+
+	end = strstr(hdrs, "\r\n\r\n");
+	if (end == NULL) {
+		if (ws->ws_hlen == MQTT_WS_HTTPMAX - 1)
+			return (-1);
+		return (len);
+	}
+
+	/* only consume up to the end of the response */
+	used = n - (ws->ws_hlen - ((end + 4) - hdrs));
+
+	if (strncmp(hdrs, "HTTP/1.1 101", 12) != 0)
+		return (-1);
+
+	accept = mqtt_ws_header(hdrs, "Sec-WebSocket-Accept");
+	if (accept == NULL || strncmp(accept, ws->ws_accept, alen) != 0 ||
+	    (accept[alen] != '\r' && accept[alen] != ' '))
+		return (-1);
+
+	ws->ws_hlen = 0;
+	ws->ws_state = MQTT_WS_S_HDR;
+
+	return (used);
+}
+
+static int
+mqtt_ws_control(struct mqtt_ws *ws)
+{
+	size_t len;
+
+	switch (ws->ws_opcode) {
+	case MQTT_WS_OP_PING:
+		/* if there's no room for a pong the peer can ping again */
+		if (mqtt_ws_space(ws) < MQTT_WS_HDRMAX + ws->ws_ctllen)
+			return (0);
+		mqtt_ws_frame(ws, MQTT_WS_OP_PONG, ws->ws_ctl, ws->ws_ctllen);
+		return (mqtt_ws_write(ws));
+	case MQTT_WS_OP_PONG:
+		return (0);
+	case MQTT_WS_OP_CLOSE:
+		/* echo the status code back before giving up */
+		len = ws->ws_ctllen < 2 ? 0 : 2;
+		if (mqtt_ws_space(ws) >= MQTT_WS_HDRMAX + len) {
+			mqtt_ws_frame(ws, MQTT_WS_OP_CLOSE, ws->ws_ctl, len);
+			mqtt_ws_write(ws);
+		}
+		return (-1);
+	default:
+		return (-1);
+	}
+}
+
+/* returns how much of buf was used for the header, or -1 on error */
+static ssize_t
+mqtt_ws_hdr(struct mqtt_ws *ws, const uint8_t *buf, size_t len)
+{
+	uint8_t *h = ws->ws_hbuf;
+	size_t need = 2;
+	size_t n, used = 0;
+	unsigned int i;
+	uint8_t plen;
+
+	for (;;) {
+		if (ws->ws_hlen >= 2) {
+			plen = h[1] & 0x7f;
+			need = 2 + (plen == 126 ? 2 : plen == 127 ? 8 : 0) +
+			    ((h[1] & MQTT_WS_MASK) ? 4 : 0);
+		}
+		if (ws->ws_hlen == need)
+			break;
+
+		n = need - ws->ws_hlen;
+		if (n > len - used)
+			n = len - used;
+		if (n == 0)
+			return (used);
+
+		memcpy(h + ws->ws_hlen, buf + used, n);
+		ws->ws_hlen += n;
+		used += n;
+	}
+
+	if (h[0] & MQTT_WS_RSV)
+		return (-1);
+
+	ws->ws_opcode = h[0] & MQTT_WS_OPCODE;
+	ws->ws_masked = h[1] & MQTT_WS_MASK;
+	plen = h[1] & 0x7f;
+	i = 2;
+	if (plen == 126) {
+		ws->ws_rem = (uint64_t)h[2] << 8 | h[3];
+		i += 2;
+	} else if (plen == 127) {
+		ws->ws_rem = 0;
+		for (; i < 10; i++)
+			ws->ws_rem = ws->ws_rem << 8 | h[i];
+		if (ws->ws_rem >> 63)
+			return (-1);
+	} else
+		ws->ws_rem = plen;
+	if (ws->ws_masked)
+		memcpy(ws->ws_key, h + i, sizeof(ws->ws_key));
+	ws->ws_keyoff = 0;
+	ws->ws_hlen = 0;
+
+	switch (ws->ws_opcode) {
+	case MQTT_WS_OP_CONT:
+		/* only carries on a binary message with no FIN yet */
+		if (!ws->ws_frag)
+			return (-1);
+		ws->ws_frag = !(h[0] & MQTT_WS_FIN);
+		ws->ws_state = MQTT_WS_S_DATA;
+		break;
+	case MQTT_WS_OP_BINARY:
+		if (ws->ws_frag)
+			return (-1);
+		ws->ws_frag = !(h[0] & MQTT_WS_FIN);
+		ws->ws_state = MQTT_WS_S_DATA;
+		break;
+	case MQTT_WS_OP_PING:
+	case MQTT_WS_OP_PONG:
+	case MQTT_WS_OP_CLOSE:
+		if (!(h[0] & MQTT_WS_FIN) || ws->ws_rem > MQTT_WS_CTLMAX)
+			return (-1);
+		ws->ws_ctllen = 0;
+		ws->ws_state = MQTT_WS_S_CTL;
+		break;
+	default:
+		/* MQTT has to be carried in binary frames */
+		return (-1);
+	}
+
+	return (used);
+}
+
+static void
+mqtt_ws_input_buf(struct mqtt_ws *ws, uint8_t *p, size_t len)
+{
+	struct iovec iov[MQTT_WS_IOVMAX];
+	int iovcnt = 0;
+	ssize_t rv;
+	size_t n;
+
+	while (len > 0) {
+		switch (ws->ws_state) {
+		case MQTT_WS_S_HTTP:
+			rv = mqtt_ws_http(ws, p, len);
+			if (rv == -1) {
+				mqtt_ws_dead(ws, "websocket handshake failed");
+				return;
+			}
+			if (ws->ws_state == MQTT_WS_S_HDR) {
+				(*ws->ws_settings->ws_on_open)(ws);
+				if (ws->ws_state == MQTT_WS_S_DEAD)
+					return;
+				/* push out anything queued before now */
+				mqtt_output(ws->ws_mc);
+			}
+			break;
+
+		case MQTT_WS_S_HDR:
+			rv = mqtt_ws_hdr(ws, p, len);
+			if (rv == -1) {
+				mqtt_ws_dead(ws, "websocket protocol error");
+				return;
+			}
+			/* control frames with no payload are done already */
+			if (ws->ws_state == MQTT_WS_S_CTL && ws->ws_rem == 0)
+				goto control;
+			break;
+
+		case MQTT_WS_S_DATA:
+			n = len;
+			if (n > ws->ws_rem)
+				n = ws->ws_rem;
+			if (ws->ws_masked) {
+				mqtt_ws_mask(p, p, n, ws->ws_key, ws->ws_keyoff);
+				ws->ws_keyoff += n;
+			}
+
+			if (n > 0) {
+				iov[iovcnt].iov_base = p;
+				iov[iovcnt].iov_len = n;
+				if (++iovcnt == MQTT_WS_IOVMAX) {
+					mqtt_inputv(ws->ws_mc, iov, iovcnt);
+					iovcnt = 0;
+					if (ws->ws_state == MQTT_WS_S_DEAD)
+						return;
+				}
+			}
+
+			ws->ws_rem -= n;
+			if (ws->ws_rem == 0)
+				ws->ws_state = MQTT_WS_S_HDR;
+			rv = n;
+			break;
+
+		case MQTT_WS_S_CTL:
+			n = len;
+			if (n > ws->ws_rem)
+				n = ws->ws_rem;
+			memcpy(ws->ws_ctl + ws->ws_ctllen, p, n);
+			if (ws->ws_masked) {
+				mqtt_ws_mask(ws->ws_ctl + ws->ws_ctllen,
+				    ws->ws_ctl + ws->ws_ctllen, n,
+				    ws->ws_key, ws->ws_keyoff);
+				ws->ws_keyoff += n;
+			}
+			ws->ws_ctllen += n;
+			ws->ws_rem -= n;
+			rv = n;
+			if (ws->ws_rem > 0)
+				break;
+control:
+			ws->ws_state = MQTT_WS_S_HDR;
+			if (mqtt_ws_control(ws) == -1) {
+				/* mqtt gets what came before the close */
+				if (iovcnt > 0) {
+					mqtt_inputv(ws->ws_mc, iov, iovcnt);
+					if (ws->ws_state == MQTT_WS_S_DEAD)
+						return;
+				}
+				mqtt_ws_dead(ws, "websocket closed");
+				return;
+			}
+			break;
+
+		case MQTT_WS_S_INIT:
+		case MQTT_WS_S_DEAD:
+		default:
+			return;
+		}
+
+		p += rv;
+		len -= rv;
+	}
+
+	if (iovcnt > 0)
+		mqtt_inputv(ws->ws_mc, iov, iovcnt);
+}
+
+/*
+ * feed bytes read from the transport in. masked frames are unmasked
+ * in place, so buf has to be writable.
+ */
+void
+mqtt_ws_input(struct mqtt_ws *ws, void *buf, size_t len)
+{
+	ws->ws_inputting = 1;
+	mqtt_ws_input_buf(ws, buf, len);
+	ws->ws_inputting = 0;
+
+	if (ws->ws_destroyed)
+		mqtt_ws_destroy(ws);
+}